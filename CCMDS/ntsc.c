@@ -1,73 +1,276 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Streaming NTSC sync detector: finds scanlines and fields in ADC blocks as
+ * they arrive, without keeping the samples around. */
+
+//#define NTSC_HOST // build a PC program that checks the detector against the PC decoder
+
 #include <math.h>
 
-short * streaming_buffer;
-long streaming_ptr;
+#include "ntsc.h"
 
-#define CAPTURE_LENGTH 1000*1000
-void
-decodeNTSC(unsigned char onPin){
-	int capture_interval = 150; // in us
-	int treshold = 2048, screen_width;
+#ifndef NTSC_HOST
+#include "acquire.h"
+#endif
+
+#define ST_WAIT_NORMAL 0
+#define ST_WAIT_BLANK 1
+#define ST_COUNT_LONGS 2
+#define ST_WAIT_NON_BLANK 3
+#define ST_DRAW 4
+
+void ntsc_sync_init(ntsc_sync *ns, short treshold, int interval_ns, ntsc_event_func event) {
+	ns->treshold = treshold;
+	ns->screen_width = 58000 / interval_ns; // lines shorter than this are definitely part of screen blanking
+	ns->long_high = 15000 / interval_ns; // long VSYNC pulses are 27 us low, short ones 2.3 us
+	ns->state = ST_WAIT_NORMAL;
+	ns->is_sync = 0;
+	ns->line = 0;
+	ns->longs = 0;
+	ns->run = 1; // as if there was an edge just before the first sample
+	ns->position = 0;
+	ns->start = 0;
+	ns->event = event;
+}
+
+static void emit(ntsc_sync *ns, unsigned char type, signed char field, unsigned short line, unsigned long position) {
+	ntsc_event e;
+
+	e.type = type;
+	e.field = field;
+	e.line = line;
+	e.start = ns->start;
+	e.position = position;
+
+	ns->event(&e);
+}
+
+void ntsc_sync_skip(ntsc_sync *ns, unsigned long count) {
+	if(ns->state == ST_DRAW) // the field can't be finished
+		emit(ns, NTSC_LOST, -1, ns->line + 1, ns->position);
+
+	ns->state = ST_WAIT_NORMAL;
+	ns->is_sync = 0;
+	ns->line = 0;
+	ns->longs = 0;
+	ns->run = 1;
+	ns->position += count;
+}
+
+// Same state machine as the PC decoder's, acting on sync starts only. The
+// length of the pulse or scanline before an edge is all that is needed, so
+// nothing but the run length carries over from one block to the next.
+void ntsc_sync_block(ntsc_sync *ns, const short *samples, int count) {
+	unsigned long length, position;
+	unsigned char is_sync;
 	int i;
-	int long_high = 100, long_low = 100;
-	int low, count, lines, vsync;
-
-	screen_width = 58000/capture_interval; // lines shorter than this are definitely part of screen blanking
-
-	// Setup the hardware (ADC, timers, etc.)
-
-	// Initialize a buffer to store our data
-	streaming_buffer = (short *)malloc(sizeof(short) * CAPTURE_LENGTH);
-	low = 0;
-	count = 0;
-	lines = 0;
-	vsync = 0;
-
-	// Stream in data
-	while(1) {
-		if(streaming_buffer[i] < treshold) { // signal low
-			if(!low) { // just went down
-				low = 1;
-				if(count > screen_width) { // should be normal scanline
-					vsync = 0; // not in vertical sync
-					lines++;
-				} else { // short one!
-					vsync = 1; // in vertical sync
-					if(lines > 0) { // display leftover lines
-						//printf("\n%4d ", lines);
-						lines = 0;
-					}
-					/*
-					if(count > long_high)
-						printf("H ", count);
-					else
-						printf("- ", count);
-						*/
-				}
-				count = 0; // initialize counter
+
+	for(i = 0; i < count; i++) {
+		is_sync = samples[i] <= ns->treshold;
+
+		if(is_sync == ns->is_sync) {
+			ns->run++;
+			continue;
+		}
+
+		length = ns->run - 1; // samples since the last transition
+		ns->run = 1;
+		ns->is_sync = is_sync;
+
+		if(!is_sync) // only HSYNC and VSYNC starts matter
+			continue;
+
+		position = ns->position + i;
+
+		switch(ns->state) {
+		case ST_WAIT_NORMAL:
+			if(length > ns->screen_width) // last scanline was normal
+				ns->state++;
+			break;
+		case ST_WAIT_BLANK:
+			if(length < ns->screen_width) { // first vsync period
+				ns->state++;
+				ns->longs = (length > ns->long_high) ? 1 : 0;
 			}
-			count++;
-		} else { // signal high
-			if(low) { // just went up
-				low = 0;
-				/*
-				if(vsync) { // only display low lengths on vsync period
-					if(count > long_low)
-						printf("_ ", count);
-					else
-						printf(". ", count);
-				}
-				*/
-				count = 0;
+			break;
+		case ST_COUNT_LONGS:
+			if(length > ns->long_high) // another long
+				ns->longs++;
+			else // longs counted
+				ns->state++;
+			break;
+		case ST_WAIT_NON_BLANK:
+			if(length > ns->screen_width) { // first scanline of the field
+				ns->state++;
+				ns->start = position;
+				ns->line = 0; // counted like the PC decoder's extract_field
+				emit(ns, NTSC_LINE, 0, 0, position);
 			}
-			count++;
+			break;
+		case ST_DRAW:
+			if(length < ns->screen_width) { // VSYNC ends the field
+				emit(ns, NTSC_FIELD, (ns->line < 252) ? -1 : ((ns->longs == 7) ? 0 : 1), ns->line + 1, position);
+
+				// this was the first vsync period of the next field
+				ns->state = ST_COUNT_LONGS;
+				ns->longs = (length > ns->long_high) ? 1 : 0;
+			} else if(ns->line + 1 >= NTSC_MAX_LINES) { // lost sync, drop the field
+				emit(ns, NTSC_LOST, -1, ns->line + 1, position);
+				ns->state = ST_WAIT_NORMAL;
+			} else
+				emit(ns, NTSC_LINE, 0, ++ns->line, position);
+			break;
+		}
+	}
+
+	ns->position += count;
+}
+
+#ifdef NTSC_HOST
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Fields the PC decoder found, as listed by color <ini> -fields <capture>
+static FILE *reference;
+static unsigned long checked, mismatches;
+
+static void check_event(const ntsc_event *e) {
+	int field, lines;
+	unsigned long start, end;
+
+	if(e->type == NTSC_LOST) {
+		printf("lost %d start %lu at %lu\n", e->line, e->start, e->position);
+		return;
+	}
+	if(e->type != NTSC_FIELD)
+		return;
+
+	if(reference == NULL) {
+		printf("field %d lines %d start %lu end %lu\n", e->field, e->line, e->start, e->position);
+		return;
+	}
+
+	checked++;
+	if(fscanf(reference, " field %d lines %d start %lu end %lu", &field, &lines, &start, &end) != 4) {
+		printf("field %d lines %d start %lu end %lu: not found by the PC decoder\n", e->field, e->line, e->start, e->position);
+		mismatches++;
+	} else if(field != e->field || lines != e->line || start != e->start || end != e->position) {
+		printf("field %d lines %d start %lu end %lu: PC decoder has field %d lines %d start %lu end %lu\n",
+			e->field, e->line, e->start, e->position, field, lines, start, end);
+		mismatches++;
+	}
+}
+
+// ntsc <capture> <treshold> <interval_ns>: list the fields in a raw capture
+// of 16-bit samples, fed to the detector a block at a time like the ADC does
+// ntsc <capture> <fields>: check them against what the PC decoder found, the
+// listing from color -fields gives the treshold and interval to use.
+// Returns 0 when every field matches.
+int main(int argc, char *argv[]) {
+	short block[NTSC_BLOCK_SAMPLES];
+	int treshold, interval, field, lines;
+	unsigned long start, end;
+	ntsc_sync ns;
+	size_t got;
+	FILE *in;
+
+	if(argc == 3) {
+		reference = fopen(argv[2], "r");
+		if(reference == NULL || fscanf(reference, " sync treshold %d interval %d", &treshold, &interval) != 2) {
+			printf("Could not read field listing %s\n", argv[2]);
+			return 1;
 		}
+	} else if(argc == 4) {
+		treshold = atoi(argv[2]);
+		interval = atoi(argv[3]);
+	} else {
+		printf("Usage: %s <capture> <treshold> <interval_ns>\n", argv[0]);
+		printf("       %s <capture> <fields from color -fields>\n", argv[0]);
+		return 1;
+	}
+
+	in = fopen(argv[1], "rb");
+	if(in == NULL) {
+		printf("Could not open %s\n", argv[1]);
+		return 1;
+	}
+
+	ntsc_sync_init(&ns, (short)treshold, interval, check_event);
+
+	while((got = fread(block, sizeof(short), NTSC_BLOCK_SAMPLES, in)) > 0)
+		ntsc_sync_block(&ns, block, (int)got);
+
+	fclose(in);
+
+	if(reference == NULL)
+		return 0;
+
+	// the PC decoder may still have fields the detector never ended
+	while(fscanf(reference, " field %d lines %d start %lu end %lu", &field, &lines, &start, &end) == 4) {
+		printf("field %d lines %d start %lu end %lu: not found by the detector\n", field, lines, start, end);
+		mismatches++;
 	}
 
-	// Cleanup and die
-	return;
+	fclose(reference);
+
+	printf("%lu fields checked, %lu mismatches\n", checked, mismatches);
+
+	return (mismatches > 0 || checked == 0) ? 1 : 0;
+}
+
+#else // NTSC_HOST
+
+#define NTSC_SAMPLE_RATE 1000000 // as fast as the ADC converts
+
+// What the detector has seen, for the rest of the firmware to look at
+volatile unsigned long ntsc_fields, ntsc_partial, ntsc_lost, ntsc_lines, ntsc_dropped;
+
+static ntsc_sync detector;
+static unsigned long next_sequence;
+
+static void count_event(const ntsc_event *e) {
+	if(e->type == NTSC_LINE)
+		ntsc_lines++;
+	else if(e->type == NTSC_LOST)
+		ntsc_lost++;
+	else if(e->field < 0)
+		ntsc_partial++;
+	else
+		ntsc_fields++;
 }
 
+// Called by acq_poll with each filled block. Samples are 12 bits, so they
+// fit a short as they are.
+static void sync_block(const unsigned short *samples, int count, unsigned long sequence) {
+	if(sequence != next_sequence) { // blocks were dropped, wait for the next field
+		ntsc_dropped += sequence - next_sequence;
+		ntsc_sync_skip(&detector, (sequence - next_sequence) * count);
+	}
+	next_sequence = sequence + 1;
+
+	ntsc_sync_block(&detector, (const short *)samples, count);
+}
+
+void
+decodeNTSC(unsigned char onPin){
+	unsigned long rate;
+	short treshold = 2048;
+
+	// ADC_CTL_CH0 to ADC_CTL_CH11 are the channel numbers themselves
+	rate = acq_init(NTSC_SAMPLE_RATE, onPin, sync_block);
+
+	next_sequence = 0;
+	ntsc_sync_init(&detector, treshold, (int)(1000000000UL / rate), count_event);
+
+	acq_start();
+
+	// Stream in data, uDMA fills the next blocks while the detector runs
+	while(1)
+		acq_poll();
+}
+
+#endif // NTSC_HOST
+
 /*
 // Color subcarrier frequency in MHz
 #define COLOR_SUBCARRIER  3.579545
@@ -0,0 +1,54 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Streaming NTSC sync detector: finds scanlines and fields in ADC blocks as
+ * they arrive, without keeping the samples around. */
+
+#ifndef NTSC_H
+#define NTSC_H
+
+#define NTSC_BLOCK_SAMPLES 256 // samples the host check feeds at a time, as acquire.h's blocks
+#define NTSC_MAX_LINES 1024 // a field with more scanlines than this has lost sync
+
+// Events, passed to the event function as they happen
+#define NTSC_LINE 0 // HSYNC: scanline line starts at position
+#define NTSC_FIELD 1 // VSYNC: field of lines scanlines ended at position
+#define NTSC_LOST 2 // sync lost after lines scanlines, waiting for the next VSYNC
+
+typedef struct {
+	unsigned char type; // NTSC_LINE, NTSC_FIELD or NTSC_LOST
+	signed char field; // NTSC_FIELD: 0 first, 1 second, -1 partial
+	unsigned short line; // scanline number from 0, or scanlines in the field
+	unsigned long start; // NTSC_FIELD: sample where the first scanline started
+	unsigned long position; // sample where the sync pulse starts
+} ntsc_event;
+
+typedef void (*ntsc_event_func)(const ntsc_event *event);
+
+// Everything the detector carries from one block to the next. Positions
+// count samples since ntsc_sync_init and wrap around after 2^32 of them.
+typedef struct {
+	short treshold; // samples at or below this are sync
+	unsigned int screen_width; // a low shorter than this is part of blanking
+	unsigned int long_high; // a VSYNC low longer than this is a long pulse
+	unsigned char state, is_sync;
+	unsigned short line, longs;
+	unsigned long run; // samples since the last edge, including it
+	unsigned long position; // of the next sample to come in
+	unsigned long start; // first scanline of the field being drawn
+	ntsc_event_func event;
+} ntsc_sync;
+
+// interval_ns is the time between samples
+void ntsc_sync_init(ntsc_sync *ns, short treshold, int interval_ns, ntsc_event_func event);
+
+// Run the state machine over the next count samples, any amount at a time
+void ntsc_sync_block(ntsc_sync *ns, const short *samples, int count);
+
+// count samples were lost: ends the field in progress with NTSC_LOST and
+// waits for the next one, positions go on after the lost samples
+void ntsc_sync_skip(ntsc_sync *ns, unsigned long count);
+
+// Acquire ADC channel onPin (0 for AIN0) through acquire.h and run the
+// detector over the blocks as they are filled, never returns
+void decodeNTSC(unsigned char onPin);
+
+#endif // NTSC_H
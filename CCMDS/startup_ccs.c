@@ -54,6 +54,7 @@ extern unsigned long __STACK_TOP;
 //*****************************************************************************
 extern void SysTickIntHandler(void);
 extern void UARTStdioIntHandler(void);
+extern void ADC0Seq0IntHandler(void);
 
 //*****************************************************************************
 //
@@ -96,7 +97,7 @@ void (* const g_pfnVectors[])(void) =
     IntDefaultHandler,                      // PWM Generator 1
     IntDefaultHandler,                      // PWM Generator 2
     IntDefaultHandler,                      // Quadrature Encoder 0
-    IntDefaultHandler,                      // ADC Sequence 0
+    ADC0Seq0IntHandler,                     // ADC Sequence 0
     IntDefaultHandler,                      // ADC Sequence 1
     IntDefaultHandler,                      // ADC Sequence 2
     IntDefaultHandler,                      // ADC Sequence 3
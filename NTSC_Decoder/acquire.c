@@ -0,0 +1,396 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Timer paced ADC acquisition: Timer0 triggers ADC0 sequencer 0 and uDMA
+ * moves the samples into a ring of blocks, ping-ponging between two. */
+
+//#define ACQUIRE_HOST // build a PC program that runs the block ring against a model of the hardware
+
+#ifndef ACQUIRE_HOST
+#include "inc/hw_adc.h"
+#include "inc/hw_ints.h"
+#include "inc/hw_memmap.h"
+#include "inc/hw_types.h"
+#include "driverlib/adc.h"
+#include "driverlib/interrupt.h"
+#include "driverlib/rom.h"
+#include "driverlib/sysctl.h"
+#include "driverlib/timer.h"
+#include "driverlib/udma.h"
+#endif
+
+#include "acquire.h"
+
+#if ACQ_BLOCKS & (ACQ_BLOCKS - 1)
+#error ACQ_BLOCKS must be a power of two
+#endif
+
+// Indices of blocks travel between the interrupt and acq_poll through two
+// queues with a single writer each: filled blocks one way and emptied ones
+// back. The two blocks in neither are being filled by uDMA.
+typedef struct {
+	volatile unsigned char slot[ACQ_BLOCKS];
+	volatile unsigned int head, tail; // free running, head is the writer's and tail the reader's
+} block_queue;
+
+static unsigned short block[ACQ_BLOCKS][ACQ_BLOCK_SAMPLES];
+static unsigned long sequence[ACQ_BLOCKS];
+static block_queue filled, empty;
+static unsigned char filling[2]; // blocks of the primary and alternate transfer
+static unsigned char next; // transfer that finishes next
+static acq_block_func block_callback;
+
+volatile acq_stats acq_counters;
+
+static void push(block_queue *q, unsigned char slot) {
+	q->slot[q->head % ACQ_BLOCKS] = slot;
+	q->head++; // after the slot, the reader may take it right away
+}
+
+static unsigned char pop(block_queue *q) {
+	unsigned char slot = q->slot[q->tail % ACQ_BLOCKS];
+
+	q->tail++;
+
+	return slot;
+}
+
+// Hardware access, there is a model of it further down for ACQUIRE_HOST
+static void arm(int alt, unsigned short *dst);
+static int finished(int alt);
+static void acknowledge();
+static int overflowed();
+static void resume();
+
+#ifndef ACQUIRE_HOST
+
+// uDMA control structures, 1024 aligned so the alternate ones fit too
+#pragma DATA_ALIGN(control_table, 1024)
+static unsigned char control_table[1024];
+
+static void arm(int alt, unsigned short *dst) {
+	ROM_uDMAChannelTransferSet(UDMA_CHANNEL_ADC0 | (alt ? UDMA_ALT_SELECT : UDMA_PRI_SELECT),
+			UDMA_MODE_PINGPONG, (void *)(ADC0_BASE + ADC_O_SSFIFO0), dst, ACQ_BLOCK_SAMPLES);
+}
+
+static int finished(int alt) {
+	return ROM_uDMAChannelModeGet(UDMA_CHANNEL_ADC0 | (alt ? UDMA_ALT_SELECT : UDMA_PRI_SELECT)) == UDMA_MODE_STOP;
+}
+
+static void acknowledge() {
+	ROM_ADCIntClear(ADC0_BASE, 0);
+}
+
+// Did the ADC FIFO overflow since the last call
+static int overflowed() {
+	if(!ROM_ADCSequenceOverflow(ADC0_BASE, 0))
+		return 0;
+
+	ROM_ADCSequenceOverflowClear(ADC0_BASE, 0);
+	return 1;
+}
+
+// uDMA disables the channel when it switches to a transfer that is not set up
+static void resume() {
+	if(!ROM_uDMAChannelIsEnabled(UDMA_CHANNEL_ADC0))
+		ROM_uDMAChannelEnable(UDMA_CHANNEL_ADC0);
+}
+
+unsigned long acq_init(unsigned long rate, unsigned long channel, acq_block_func callback) {
+	unsigned long load;
+
+	block_callback = callback;
+
+	ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_TIMER0);
+	ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_ADC0);
+	ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_UDMA);
+	ROM_SysCtlADCSpeedSet(SYSCTL_ADCSPEED_1MSPS);
+
+	if(rate > ACQ_MAX_RATE)
+		rate = ACQ_MAX_RATE;
+	if(rate < 1)
+		rate = 1;
+	load = (ROM_SysCtlClockGet() + rate / 2) / rate;
+
+	// Timer0 only triggers conversions, it doesn't interrupt
+	ROM_TimerConfigure(TIMER0_BASE, TIMER_CFG_32_BIT_PER);
+	ROM_TimerLoadSet(TIMER0_BASE, TIMER_A, load - 1);
+	ROM_TimerControlTrigger(TIMER0_BASE, TIMER_A, true);
+
+	// One sample per trigger, uDMA empties the FIFO
+	ROM_ADCSequenceDisable(ADC0_BASE, 0);
+	ROM_ADCSequenceConfigure(ADC0_BASE, 0, ADC_TRIGGER_TIMER, 0);
+	ROM_ADCSequenceStepConfigure(ADC0_BASE, 0, 0, channel | ADC_CTL_IE | ADC_CTL_END);
+	ADCSequenceDMAEnable(ADC0_BASE, 0);
+	ROM_ADCSequenceEnable(ADC0_BASE, 0);
+
+	ROM_uDMAEnable();
+	ROM_uDMAControlBaseSet(control_table);
+	ROM_uDMAChannelAttributeDisable(UDMA_CHANNEL_ADC0,
+			UDMA_ATTR_ALTSELECT | UDMA_ATTR_USEBURST | UDMA_ATTR_REQMASK);
+	ROM_uDMAChannelAttributeEnable(UDMA_CHANNEL_ADC0, UDMA_ATTR_HIGH_PRIORITY);
+	ROM_uDMAChannelControlSet(UDMA_CHANNEL_ADC0 | UDMA_PRI_SELECT,
+			UDMA_SIZE_16 | UDMA_SRC_INC_NONE | UDMA_DST_INC_16 | UDMA_ARB_1);
+	ROM_uDMAChannelControlSet(UDMA_CHANNEL_ADC0 | UDMA_ALT_SELECT,
+			UDMA_SIZE_16 | UDMA_SRC_INC_NONE | UDMA_DST_INC_16 | UDMA_ARB_1);
+
+	// Finished transfers raise the sequencer's interrupt
+	ROM_ADCIntEnable(ADC0_BASE, 0);
+	ROM_IntEnable(INT_ADC0SS0);
+
+	return ROM_SysCtlClockGet() / load;
+}
+
+#endif // ACQUIRE_HOST
+
+static void start_ring() {
+	unsigned char i;
+
+	filled.head = filled.tail = 0;
+	empty.head = empty.tail = 0;
+	for(i = 2; i < ACQ_BLOCKS; i++)
+		push(&empty, i);
+
+	filling[0] = 0;
+	filling[1] = 1;
+	next = 0;
+
+	acq_counters.blocks = 0;
+	acq_counters.overruns = 0;
+	acq_counters.fifo_overflows = 0;
+
+	arm(0, block[0]);
+	arm(1, block[1]);
+}
+
+// Hand the block transfer alt filled to acq_poll and set it up again with an
+// empty one. When there are none the ring is full and the block is filled
+// again instead, dropping what was in it.
+static void rearm(int alt) {
+	unsigned char slot = filling[alt];
+
+	sequence[slot] = acq_counters.blocks++;
+
+	if(empty.head == empty.tail)
+		acq_counters.overruns++;
+	else {
+		push(&filled, slot);
+		filling[alt] = slot = pop(&empty);
+	}
+
+	arm(alt, block[slot]);
+}
+
+void ADC0Seq0IntHandler(void) {
+	acknowledge();
+
+	if(overflowed())
+		acq_counters.fifo_overflows++;
+
+	// both can be done if the interrupt was held up
+	while(finished(next)) {
+		rearm(next);
+		next ^= 1;
+	}
+
+	resume();
+}
+
+int acq_poll(void) {
+	unsigned char slot;
+	int passed = 0;
+
+	while(filled.tail != filled.head) {
+		slot = filled.slot[filled.tail % ACQ_BLOCKS];
+		block_callback(block[slot], ACQ_BLOCK_SAMPLES, sequence[slot]);
+		filled.tail++;
+
+		push(&empty, slot);
+		passed++;
+	}
+
+	return passed;
+}
+
+#ifndef ACQUIRE_HOST
+
+void acq_start(void) {
+	ROM_IntDisable(INT_ADC0SS0);
+	start_ring();
+	ROM_uDMAChannelEnable(UDMA_CHANNEL_ADC0);
+	ROM_IntEnable(INT_ADC0SS0);
+
+	ROM_TimerEnable(TIMER0_BASE, TIMER_A);
+}
+
+void acq_stop(void) {
+	ROM_TimerDisable(TIMER0_BASE, TIMER_A);
+	ROM_uDMAChannelDisable(UDMA_CHANNEL_ADC0);
+}
+
+#else // ACQUIRE_HOST
+
+#include <stdio.h>
+#include <string.h>
+
+#define FIFO_DEPTH 8 // of ADC0 sequencer 0
+
+// Model of the hardware, advanced one timer period at a time: the ADC puts a
+// 12-bit sample in its FIFO, uDMA moves the FIFO into the transfer it is on
+// and switches to the other one at the end of a block, raising the interrupt.
+static struct {
+	unsigned short *dst[2];
+	int left[2]; // samples to go in each transfer, 0 once finished
+	int active, enabled;
+	int fifo, overflow; // samples in the FIFO and its overflow flag
+	unsigned long sample; // conversions so far
+	int pending; // interrupt raised and not yet serviced
+} hw;
+
+static unsigned short fifo_data[FIFO_DEPTH];
+
+static void arm(int alt, unsigned short *dst) {
+	hw.dst[alt] = dst;
+	hw.left[alt] = ACQ_BLOCK_SAMPLES;
+}
+
+static int finished(int alt) {
+	return hw.left[alt] == 0;
+}
+
+static void acknowledge() {
+	hw.pending = 0;
+}
+
+static int overflowed() {
+	int overflow = hw.overflow;
+
+	hw.overflow = 0;
+	return overflow;
+}
+
+static void resume() {
+	hw.enabled = 1;
+}
+
+unsigned long acq_init(unsigned long rate, unsigned long channel, acq_block_func callback) {
+	(void)channel; // the simulated ADC has a single input
+	block_callback = callback;
+
+	return rate > ACQ_MAX_RATE ? ACQ_MAX_RATE : rate;
+}
+
+void acq_start(void) {
+	hw.active = 0;
+	hw.fifo = 0;
+	hw.overflow = 0;
+	hw.sample = 0;
+	hw.pending = 0;
+
+	start_ring();
+	hw.enabled = 1;
+}
+
+void acq_stop(void) {
+	hw.enabled = 0;
+}
+
+static void timer_tick() {
+	int i;
+
+	if(hw.fifo == FIFO_DEPTH)
+		hw.overflow = 1; // the conversion is lost
+	else
+		fifo_data[hw.fifo++] = (unsigned short)(hw.sample & 0xfff);
+	hw.sample++;
+
+	for(i = 0; i < hw.fifo && hw.enabled; i++) {
+		*hw.dst[hw.active]++ = fifo_data[i];
+
+		if(--hw.left[hw.active] == 0) {
+			hw.pending = 1;
+			hw.active ^= 1;
+			if(hw.left[hw.active] == 0)
+				hw.enabled = 0;
+		}
+	}
+
+	hw.fifo -= i;
+	if(hw.fifo > 0 && i > 0)
+		memmove(fifo_data, fifo_data + i, sizeof(unsigned short) * hw.fifo);
+}
+
+// What the test saw come out of acq_poll
+static struct {
+	unsigned long blocks, next_sequence, gaps, bad;
+	int check; // samples can be checked until the first FIFO overflow
+} seen;
+
+static void check_block(const unsigned short *samples, int count, unsigned long sequence) {
+	int i;
+
+	if(sequence < seen.next_sequence)
+		seen.bad++; // out of order
+	seen.gaps += sequence - seen.next_sequence;
+	seen.next_sequence = sequence + 1;
+	seen.blocks++;
+
+	if(!seen.check || acq_counters.fifo_overflows)
+		seen.check = 0;
+	else
+		for(i = 0; i < count; i++)
+			if(samples[i] != ((sequence * ACQ_BLOCK_SAMPLES + i) & 0xfff)) {
+				seen.bad++;
+				break;
+			}
+}
+
+// Run the model for ticks timer periods with the interrupt serviced latency
+// periods after it's raised and acq_poll called every poll periods
+static int run(const char *name, unsigned long ticks, int latency, int poll, int overruns, int overflows) {
+	unsigned long tick;
+	int waited = 0, ok;
+
+	memset(&seen, 0, sizeof(seen));
+	seen.check = 1;
+
+	acq_init(ACQ_MAX_RATE, 0, check_block);
+	acq_start();
+
+	for(tick = 1; tick <= ticks; tick++) {
+		timer_tick();
+
+		if(hw.pending && ++waited > latency) {
+			ADC0Seq0IntHandler();
+			waited = 0;
+		}
+
+		if(tick % poll == 0)
+			acq_poll();
+	}
+
+	acq_stop();
+	acq_poll();
+
+	ok = seen.bad == 0 && seen.gaps == acq_counters.overruns
+		&& seen.blocks + acq_counters.overruns == acq_counters.blocks
+		&& (acq_counters.overruns > 0) == overruns
+		&& (acq_counters.fifo_overflows > 0) == overflows
+		&& seen.blocks > 0;
+
+	printf("%-16s %6lu blocks %6lu passed %6lu overruns %6lu fifo overflows %s\n", name,
+		acq_counters.blocks, seen.blocks, acq_counters.overruns, acq_counters.fifo_overflows, ok ? "ok" : "FAILED");
+
+	return ok ? 0 : 1;
+}
+
+int main() {
+	int failed = 0;
+
+	failed += run("keeping up", 1000000, 10, 100, 0, 0);
+	failed += run("slow poll", 1000000, 10, 3000, 1, 0);
+	failed += run("full ring", 1000000, 0, ACQ_BLOCK_SAMPLES * (ACQ_BLOCKS - 2) - 1, 0, 0);
+	failed += run("late interrupt", 1000000, ACQ_BLOCK_SAMPLES + FIFO_DEPTH + 1, 100, 0, 1);
+
+	return failed;
+}
+
+#endif // ACQUIRE_HOST
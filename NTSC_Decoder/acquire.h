@@ -0,0 +1,39 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Timer paced ADC acquisition: Timer0 triggers ADC0 sequencer 0 and uDMA
+ * moves the samples into a ring of blocks, ping-ponging between two. */
+
+#ifndef ACQUIRE_H
+#define ACQUIRE_H
+
+#define ACQ_BLOCK_SAMPLES 256 // samples per uDMA transfer, at most 1024
+#define ACQ_BLOCKS 8 // blocks in the ring, two of them are always being filled
+#define ACQ_MAX_RATE 1000000 // the ADC can't convert faster than 1 MSPS
+
+// Called from acq_poll for every filled block, in order. sequence counts
+// filled blocks since acq_start, so a gap means blocks were dropped.
+typedef void (*acq_block_func)(const unsigned short *samples, int count, unsigned long sequence);
+
+typedef struct {
+	unsigned long blocks; // filled by uDMA, including dropped ones
+	unsigned long overruns; // dropped because acq_poll did not keep up
+	unsigned long fifo_overflows; // samples lost because uDMA was not rearmed in time
+} acq_stats;
+
+extern volatile acq_stats acq_counters;
+
+// Set up Timer0, ADC0 sequencer 0 on channel (ADC_CTL_CH0 etc.) and uDMA for
+// rate samples per second. Returns the rate actually used, which is the
+// closest the system clock divides to.
+unsigned long acq_init(unsigned long rate, unsigned long channel, acq_block_func callback);
+
+void acq_start(void);
+void acq_stop(void);
+
+// Pass filled blocks to the callback and give them back to uDMA. Call often
+// enough that the ring does not fill up. Returns the amount of blocks passed.
+int acq_poll(void);
+
+// ADC0 sequence 0 interrupt, raised when uDMA has filled a block
+void ADC0Seq0IntHandler(void);
+
+#endif // ACQUIRE_H
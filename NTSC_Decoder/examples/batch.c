@@ -0,0 +1,399 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Decoding archives of captures with a pool of worker processes. */
+
+#include "windows.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "batch.h"
+
+#define LINE_LENGTH (MAX_PATH + 128)
+
+// The decoder keeps its state in globals, so workers are processes rather
+// than threads. The driver runs one thread per worker, which feeds it a
+// capture at a time and waits for the result line.
+typedef struct batch batch;
+
+typedef struct {
+	int id;
+	batch *job;
+	HANDLE process, thread;
+	HANDLE input, output; // our ends of the worker's stdin and stdout
+	char buffer[LINE_LENGTH]; // unread output of the worker
+	int buffered;
+} batch_worker;
+
+struct batch {
+	char **names; // captures not yet decoded
+	int count;
+	volatile LONG next; // first capture not handed out
+	const char *command;
+	FILE *journal;
+	CRITICAL_SECTION lock; // journal, console and totals
+	int done, failed;
+	long frames;
+	long long samples;
+};
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Captures the journal in outdir lists as decoded, sorted, or NULL if none
+static char ** read_journal(const char *name, int *count) {
+	char line[LINE_LENGTH], path[MAX_PATH], status[16], **done = NULL, **grown;
+	int allocated = 0;
+	size_t length;
+	FILE *journal;
+
+	*count = 0;
+
+	journal = fopen(name, "r");
+	if(journal == NULL)
+		return NULL;
+
+	while(fgets(line, sizeof(line), journal) != NULL) {
+		length = strlen(line);
+		while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+			line[--length] = '\0';
+
+		// status frames fields partial samples seconds path, the path can have spaces
+		if(sscanf(line, "%15s %*s %*s %*s %*s %*s %259[^\n]", status, path) != 2 || strcmp(status, "ok")) // MAX_PATH - 1
+			continue;
+
+		if(*count == allocated) {
+			allocated = allocated ? 2 * allocated : 64;
+			grown = (char **)realloc(done, sizeof(char *) * allocated);
+			if(grown == NULL)
+				break;
+			done = grown;
+		}
+
+		// a shorter list only redoes some captures
+		if((done[*count] = strdup(path)) == NULL)
+			break;
+		(*count)++;
+	}
+
+	fclose(journal);
+
+	qsort(done, *count, sizeof(char *), compare_names);
+
+	return done;
+}
+
+static int start_worker(batch_worker *w) {
+	SECURITY_ATTRIBUTES inherit = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+	STARTUPINFOA startup;
+	PROCESS_INFORMATION info;
+	HANDLE child_input, child_output;
+	char command[LINE_LENGTH];
+
+	if(!CreatePipe(&child_input, &w->input, &inherit, 0))
+		return -1;
+	if(!CreatePipe(&w->output, &child_output, &inherit, 0)) {
+		CloseHandle(child_input);
+		CloseHandle(w->input);
+		return -1;
+	}
+
+	// only the worker's ends are inherited
+	SetHandleInformation(w->input, HANDLE_FLAG_INHERIT, 0);
+	SetHandleInformation(w->output, HANDLE_FLAG_INHERIT, 0);
+
+	memset(&startup, 0, sizeof(STARTUPINFOA));
+	startup.cb = sizeof(STARTUPINFOA);
+	startup.dwFlags = STARTF_USESTDHANDLES;
+	startup.hStdInput = child_input;
+	startup.hStdOutput = child_output;
+	startup.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+	strncpy(command, w->job->command, sizeof(command) - 1);
+	command[sizeof(command) - 1] = '\0';
+
+	if(!CreateProcessA(NULL, command, NULL, NULL, TRUE, 0, NULL, NULL, &startup, &info)) {
+		printf("Could not start worker %d: %s\n", w->id, command);
+		CloseHandle(child_input);
+		CloseHandle(child_output);
+		CloseHandle(w->input);
+		CloseHandle(w->output);
+		return -1;
+	}
+
+	CloseHandle(child_input);
+	CloseHandle(child_output);
+	CloseHandle(info.hThread);
+
+	w->process = info.hProcess;
+	w->buffered = 0;
+
+	return 0;
+}
+
+// Close the worker's stdin, which makes it quit, and wait for it
+static void stop_worker(batch_worker *w) {
+	if(w->process == NULL)
+		return;
+
+	CloseHandle(w->input);
+	WaitForSingleObject(w->process, INFINITE);
+	CloseHandle(w->process);
+	CloseHandle(w->output);
+
+	w->process = NULL;
+}
+
+// Next line of worker output without the line end. Returns -1 when the
+// worker has gone away.
+static int read_line(batch_worker *w, char *line, int size) {
+	DWORD got;
+	char *end;
+	int length;
+
+	for(;;) {
+		end = (char *)memchr(w->buffer, '\n', w->buffered);
+
+		// a line too long for the buffer comes out in pieces
+		if(end != NULL || w->buffered == sizeof(w->buffer)) {
+			length = (end != NULL) ? (int)(end - w->buffer) : w->buffered;
+			if(length >= size)
+				length = size - 1;
+
+			memcpy(line, w->buffer, length);
+			line[length] = '\0';
+			if(length > 0 && line[length - 1] == '\r')
+				line[length - 1] = '\0';
+
+			if(end != NULL)
+				length = (int)(end - w->buffer) + 1;
+			w->buffered -= length;
+			memmove(w->buffer, w->buffer + length, w->buffered);
+
+			return 0;
+		}
+
+		if(!ReadFile(w->output, w->buffer + w->buffered, sizeof(w->buffer) - w->buffered, &got, NULL) || got == 0)
+			return -1;
+
+		w->buffered += got;
+	}
+}
+
+// Hand path to the worker and wait for its result, passing on what it prints.
+// Returns 0 when the worker reported back and -1 when it died.
+static int decode_one(batch_worker *w, const char *path, batch_result *result) {
+	char line[LINE_LENGTH];
+	DWORD written;
+	int length;
+
+	length = snprintf(line, sizeof(line), "%s\n", path);
+	if(!WriteFile(w->input, line, length, &written, NULL) || (int)written != length)
+		return -1;
+
+	while(!read_line(w, line, sizeof(line))) {
+		if(!strncmp(line, "@done ", 6)) {
+			if(sscanf(line + 6, "%ld %ld %ld %lld", &result->frames, &result->fields,
+					&result->partial, &result->samples) == 4)
+				return 0;
+			continue;
+		}
+
+		EnterCriticalSection(&w->job->lock);
+		printf("[w%d] %s\n", w->id, line);
+		LeaveCriticalSection(&w->job->lock);
+	}
+
+	return -1;
+}
+
+static void record(batch_worker *w, const char *path, const batch_result *result, double seconds) {
+	batch *job = w->job;
+	int ok = result->samples >= 0 && result->fields > 0; // a capture without a picture failed too
+
+	EnterCriticalSection(&job->lock);
+
+	job->done++;
+	if(ok) {
+		job->frames += result->frames;
+		job->samples += result->samples;
+	} else
+		job->failed++;
+
+	// flushed every time, so an interruption loses at most the captures in progress
+	fprintf(job->journal, "%s %ld %ld %ld %lld %.3f %s\n", ok ? "ok" : "failed",
+		result->frames, result->fields, result->partial, result->samples, seconds, path);
+	fflush(job->journal);
+
+	if(ok)
+		printf("[%d/%d] %s: %ld frames, %ld partial fields in %.2f s (%.1f Msamples/s)\n",
+			job->done, job->count, path, result->frames, result->partial, seconds,
+			seconds > 0 ? result->samples / seconds / 1e6 : 0.0);
+	else
+		printf("[%d/%d] %s: failed after %.2f s\n", job->done, job->count, path, seconds);
+
+	LeaveCriticalSection(&job->lock);
+}
+
+static DWORD WINAPI worker_thread(LPVOID param) {
+	batch_worker *w = (batch_worker *)param;
+	batch *job = w->job;
+	batch_result result;
+	DWORD started;
+	LONG index;
+
+	while((index = InterlockedIncrement(&job->next) - 1) < job->count) {
+		memset(&result, 0, sizeof(batch_result));
+		result.samples = -1;
+		started = GetTickCount();
+
+		if(w->process == NULL && start_worker(w)) {
+			record(w, job->names[index], &result, 0.0);
+			break; // leave the rest to the others, or to the next run
+		}
+
+		if(decode_one(w, job->names[index], &result)) {
+			// died on this capture, count it as failed and start afresh
+			EnterCriticalSection(&job->lock);
+			printf("[w%d] Worker exited while decoding %s\n", w->id, job->names[index]);
+			LeaveCriticalSection(&job->lock);
+
+			stop_worker(w);
+			result.samples = -1;
+		}
+
+		record(w, job->names[index], &result, (GetTickCount() - started) / 1000.0);
+	}
+
+	stop_worker(w);
+
+	return 0;
+}
+
+int batch_run(char **names, int count, const char *outdir, const char *command, int workers) {
+	batch_worker pool[BATCH_MAX_WORKERS];
+	char journal[MAX_PATH], **done;
+	int done_count, i, skipped = 0;
+	DWORD started;
+	double seconds;
+	batch job;
+
+	memset(&job, 0, sizeof(batch));
+	memset(pool, 0, sizeof(pool));
+
+	sprintf(journal, "%s\\%s", outdir, BATCH_JOURNAL);
+	done = read_journal(journal, &done_count);
+
+	job.names = (char **)malloc(sizeof(char *) * (count + 1));
+	if(job.names == NULL)
+		return -1;
+
+	for(i = 0; i < count; i++) {
+		if(done != NULL && bsearch(&names[i], done, done_count, sizeof(char *), compare_names) != NULL)
+			skipped++;
+		else
+			job.names[job.count++] = names[i];
+	}
+
+	for(i = 0; i < done_count; i++)
+		free(done[i]);
+	free(done);
+
+	if(skipped)
+		printf("Skipping %d captures already decoded according to %s\n", skipped, journal);
+
+	job.journal = fopen(journal, "a");
+	if(job.journal == NULL) {
+		printf("Could not open %s\n", journal);
+		free(job.names);
+		return -1;
+	}
+
+	if(workers > job.count)
+		workers = job.count;
+	if(workers > BATCH_MAX_WORKERS)
+		workers = BATCH_MAX_WORKERS;
+	if(workers < 1)
+		workers = 1;
+
+	printf("Decoding %d captures with %d workers\n", job.count, workers);
+
+	job.command = command;
+	InitializeCriticalSection(&job.lock);
+	started = GetTickCount();
+
+	for(i = 0; i < workers && job.count > 0; i++) {
+		pool[i].id = i;
+		pool[i].job = &job;
+		pool[i].thread = CreateThread(NULL, 0, worker_thread, &pool[i], 0, NULL);
+
+		if(pool[i].thread == NULL) {
+			printf("Could only start %d workers\n", i);
+			break;
+		}
+	}
+
+	// the first thread always starts, and any thread finishes the whole list if need be
+	for(i = 0; i < workers && pool[i].thread != NULL; i++) {
+		WaitForSingleObject(pool[i].thread, INFINITE);
+		CloseHandle(pool[i].thread);
+	}
+
+	seconds = (GetTickCount() - started) / 1000.0;
+	printf("Decoded %d captures, %d failed, %lld samples into %ld frames in %.2f s (%.1f Msamples/s)\n",
+		job.done - job.failed, job.failed, job.samples, job.frames, seconds,
+		seconds > 0 ? job.samples / seconds / 1e6 : 0.0);
+
+	DeleteCriticalSection(&job.lock);
+	fclose(job.journal);
+	free(job.names);
+
+	return job.failed + (job.count - job.done); // those never handed out failed too
+}
+
+int batch_next(char *path, int size) {
+	size_t length;
+
+	if(fgets(path, size, stdin) == NULL)
+		return -1;
+
+	length = strlen(path);
+	while(length > 0 && (path[length - 1] == '\n' || path[length - 1] == '\r'))
+		path[--length] = '\0';
+
+	return length > 0 ? 0 : batch_next(path, size);
+}
+
+void batch_done(const batch_result *result) {
+	printf("@done %ld %ld %ld %lld\n", result->frames, result->fields, result->partial, result->samples);
+	fflush(stdout);
+}
+
+int batch_output_dir(const char *outdir, const char *path, char *dir, int size) {
+	const char *name = path, *p, *dot = NULL;
+	unsigned int hash = 2166136261u; // FNV-1a
+	int length, c;
+
+	for(p = path; *p; p++) {
+		if(*p == '\\' || *p == '/' || *p == ':') {
+			name = p + 1;
+			dot = NULL;
+		} else if(*p == '.')
+			dot = p;
+
+		// paths differing only in case or slashes are the same file
+		c = (*p == '/') ? '\\' : tolower((unsigned char)*p);
+		hash = (hash ^ (unsigned int)c) * 16777619u;
+	}
+
+	length = (dot != NULL && dot > name) ? (int)(dot - name) : (int)strlen(name);
+	snprintf(dir, size, "%s\\%.*s-%08x", outdir, length, name, hash);
+
+	if(!CreateDirectoryA(dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+		printf("Could not create %s\n", dir);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,44 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Decoding archives of captures with a pool of worker processes. */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#define BATCH_JOURNAL "batch_journal.txt" // in the output directory
+#define BATCH_MAX_WORKERS 64
+
+// The driver starts workers worker processes and hands out captures to
+// them one at a time over their stdin, so a fast worker just takes more.
+// A worker is started once and keeps its color waveforms and buffers from
+// one capture to the next, only the signal levels and the lookup tables
+// built from them are redone for every capture. Memory use depends on the
+// amount of workers only, not on the size of the archive.
+//
+// Every decoded capture gets a line in the journal in the output
+// directory. When the batch is started again, captures the journal lists
+// as ok are skipped, so an interrupted batch carries on where it was.
+// A worker that dies is restarted and its capture counted as failed.
+typedef struct {
+	long frames, fields, partial; // partial fields skipped
+	long long samples; // decoded, < 0 when the capture could not be read
+} batch_result;
+
+// Driver: decode count captures from names with workers processes, each
+// started with the command line command. Returns the amount of failed
+// captures, or -1 if the journal can't be written.
+int batch_run(char **names, int count, const char *outdir, const char *command, int workers);
+
+// Worker: next capture to decode into path, from the driver. Returns 0, or
+// -1 when there are no more.
+int batch_next(char *path, int size);
+
+// Worker: report the capture from batch_next as done
+void batch_done(const batch_result *result);
+
+// Directory in outdir for the frames of capture path, named after it and a
+// hash of the whole path, so captures of the same name in different
+// folders don't share one. Returns 0 when it exists or was created and -1
+// on failure.
+int batch_output_dir(const char *outdir, const char *path, char *dir, int size);
+
+#endif // BATCH_H
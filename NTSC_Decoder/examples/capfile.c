@@ -0,0 +1,380 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Read-only access to 16-bit capture files: raw ones are memory mapped and
+ * compressed ones (capz.h) decoded a block at a time. */
+
+#include "windows.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capfile.h"
+
+// Map bytes [offset, offset + size) of the file. *base gets the start of the
+// view to unmap, as views must start at allocation granularity (usually 64 kB).
+static char * map_bytes(capfile *cf, long long offset, long long size, char **base) {
+	SYSTEM_INFO info;
+	long long aligned;
+
+	GetSystemInfo(&info);
+	aligned = offset - offset % info.dwAllocationGranularity;
+
+	*base = (char *)MapViewOfFile(cf->mapping, FILE_MAP_READ,
+		(DWORD)(aligned >> 32), (DWORD)(aligned & 0xFFFFFFFF),
+		(SIZE_T)(offset - aligned + size));
+	if(*base == NULL)
+		return NULL;
+
+	return *base + (offset - aligned);
+}
+
+// Check the header and load the block index of a compressed capture
+static int open_compressed(capfile *cf, const char *filename) {
+	capz_header *header;
+	char *header_base, *base, *index;
+	int n;
+
+	header = (capz_header *)map_bytes(cf, 0, sizeof(capz_header), &header_base);
+	if(header == NULL)
+		return -1;
+
+	cf->samples = header->samples;
+	cf->blocks = header->blocks;
+	cf->block_samples = header->block_samples;
+
+	if(cf->samples < 1 || cf->block_samples < 1 || header->index_offset < (long long)sizeof(capz_header) ||
+			cf->blocks != (cf->samples + cf->block_samples - 1) / cf->block_samples ||
+			header->index_offset + (long long)sizeof(capz_block) * cf->blocks > cf->file_size) {
+		printf("Compressed capture %s is damaged\n", filename);
+		UnmapViewOfFile(header_base);
+		return -1;
+	}
+
+	index = map_bytes(cf, header->index_offset, sizeof(capz_block) * cf->blocks, &base);
+	UnmapViewOfFile(header_base);
+
+	cf->index = (capz_block *)malloc(sizeof(capz_block) * cf->blocks);
+	if(index == NULL || cf->index == NULL) {
+		printf("Could not read the block index of %s\n", filename);
+		if(index != NULL)
+			UnmapViewOfFile(base);
+		return -1;
+	}
+
+	memcpy(cf->index, index, sizeof(capz_block) * cf->blocks);
+	UnmapViewOfFile(base);
+
+	for(n = 0; n < cf->blocks; n++)
+		if(cf->index[n].offset < (n ? cf->index[n - 1].offset + cf->index[n - 1].size : (long long)sizeof(capz_header)) ||
+				cf->index[n].offset + cf->index[n].size > cf->file_size) {
+			printf("Compressed capture %s is damaged\n", filename);
+			return -1;
+		}
+
+	cf->compressed = 1;
+
+	return 0;
+}
+
+int capfile_open(capfile *cf, const char *filename) {
+	LARGE_INTEGER size;
+	FILETIME written;
+	char *base, *magic;
+
+	memset(cf, 0, sizeof(capfile));
+
+	cf->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(cf->file == INVALID_HANDLE_VALUE) {
+		printf("Could not open capture %s\n", filename);
+		return -1;
+	}
+
+	if(!GetFileSizeEx(cf->file, &size) || size.QuadPart < (LONGLONG)sizeof(short)) {
+		printf("Capture %s is empty\n", filename);
+		CloseHandle(cf->file);
+		return -1;
+	}
+
+	cf->file_size = size.QuadPart;
+	cf->samples = size.QuadPart / sizeof(short);
+	if(GetFileTime(cf->file, NULL, NULL, &written))
+		cf->modified = ((long long)written.dwHighDateTime << 32) | written.dwLowDateTime;
+
+	cf->mapping = CreateFileMappingA(cf->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(cf->mapping == NULL) {
+		printf("Could not map capture %s\n", filename);
+		CloseHandle(cf->file);
+		return -1;
+	}
+
+	if(cf->file_size >= (long long)sizeof(capz_header)) {
+		magic = map_bytes(cf, 0, sizeof(capz_header), &base);
+
+		if(magic != NULL && !memcmp(magic, CAPZ_MAGIC, 8)) {
+			UnmapViewOfFile(base);
+
+			if(open_compressed(cf, filename)) {
+				capfile_close(cf);
+				return -1;
+			}
+		} else if(magic != NULL)
+			UnmapViewOfFile(base);
+	}
+
+	return 0;
+}
+
+// Decode the blocks samples [first, first + length) are in. Blocks the
+// previous view already decoded are moved to the front of the buffer rather
+// than decoded again, as consecutive windows overlap a little.
+static short * view_compressed(capfile *cf, long long first, long length) {
+	long long block = first / cf->block_samples, last = (first + length - 1) / cf->block_samples, n, start;
+	long needed = (long)(last - block + 1) * cf->block_samples, count;
+	const capz_block *b;
+	char *base, *data;
+	short *grown;
+
+	if(block < cf->buffer_block || last >= cf->buffer_block + cf->buffer_blocks) {
+		if(needed > cf->buffer_size) {
+			grown = (short *)realloc(cf->buffer, sizeof(short) * needed);
+			if(grown == NULL) {
+				printf("Could not decode %ld samples at %lld\n", length, first);
+				return NULL;
+			}
+			cf->buffer = grown;
+			cf->buffer_size = needed;
+		}
+
+		n = block;
+		if(block >= cf->buffer_block && block < cf->buffer_block + cf->buffer_blocks) {
+			n = cf->buffer_block + cf->buffer_blocks;
+			memmove(cf->buffer, cf->buffer + (block - cf->buffer_block) * cf->block_samples,
+				sizeof(short) * (n - block) * cf->block_samples);
+		}
+
+		cf->buffer_block = block;
+		cf->buffer_blocks = 0; // until decoded
+
+		start = cf->index[n].offset;
+		data = map_bytes(cf, start, cf->index[last].offset + cf->index[last].size - start, &base);
+		if(data == NULL) {
+			printf("Could not map %ld samples at %lld\n", length, first);
+			return NULL;
+		}
+
+		for(; n <= last; n++) {
+			b = cf->index + n;
+			count = (long)((cf->samples - n * cf->block_samples < cf->block_samples) ?
+				cf->samples - n * cf->block_samples : cf->block_samples);
+
+			if(capz_checksum((unsigned char *)data + (b->offset - start), b->size) != b->checksum ||
+					capz_unpack((unsigned char *)data + (b->offset - start), b->size,
+						cf->buffer + (n - block) * cf->block_samples, count)) {
+				printf("Block %lld of the capture is damaged\n", n);
+				UnmapViewOfFile(base);
+				return NULL;
+			}
+		}
+
+		UnmapViewOfFile(base);
+		cf->buffer_blocks = last - block + 1;
+	}
+
+	cf->view_first = first;
+	cf->view_length = length;
+
+	return cf->buffer + (first - block * cf->block_samples);
+}
+
+short * capfile_view(capfile *cf, long long first, long length) {
+	short *view;
+
+	if(cf->view_base != NULL) {
+		UnmapViewOfFile(cf->view_base);
+		cf->view_base = NULL;
+	}
+
+	if(first < 0 || first >= cf->samples)
+		return NULL;
+
+	if(first + length > cf->samples)
+		length = (long)(cf->samples - first);
+
+	if(cf->compressed)
+		return view_compressed(cf, first, length);
+
+	view = (short *)map_bytes(cf, first * sizeof(short), length * sizeof(short), &cf->view_base);
+	if(view == NULL) {
+		printf("Could not map %ld samples at %lld\n", length, first);
+		return NULL;
+	}
+
+	cf->view_first = first;
+	cf->view_length = length;
+
+	return view;
+}
+
+void capfile_close(capfile *cf) {
+	if(cf->view_base != NULL)
+		UnmapViewOfFile(cf->view_base);
+	if(cf->mapping != NULL)
+		CloseHandle(cf->mapping);
+	if(cf->file != NULL && cf->file != INVALID_HANDLE_VALUE)
+		CloseHandle(cf->file);
+
+	free(cf->index);
+	free(cf->buffer);
+
+	memset(cf, 0, sizeof(capfile));
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int has_extension(const char *name, const char *extension) {
+	size_t length = strlen(name), ext = strlen(extension);
+
+	return length > ext && !strcmp(name + length - ext, extension);
+}
+
+// Make room for one more name. On failure the list is freed and *names set
+// to NULL.
+static int grow_list(char ***names, int count, int *allocated) {
+	char **grown;
+
+	if(count < *allocated)
+		return 0;
+
+	grown = (char **)realloc(*names, sizeof(char *) * *allocated * 2);
+	if(grown == NULL) {
+		printf("Could not allocate capture list\n");
+		capfile_free_list(*names, count);
+		*names = NULL;
+		return -1;
+	}
+
+	*names = grown;
+	*allocated *= 2;
+
+	return 0;
+}
+
+// Names listed in a text file one per line, in the order given. Empty lines
+// and lines starting with # are skipped.
+static int read_list(const char *path, char ***names, int allocated) {
+	char line[MAX_PATH];
+	int count = 0;
+	size_t length;
+	FILE *list;
+
+	list = fopen(path, "r");
+	if(list == NULL) {
+		printf("Could not open capture list %s\n", path);
+		free(*names);
+		*names = NULL;
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), list) != NULL) {
+		length = strlen(line);
+		while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+			line[--length] = '\0';
+
+		if(length == 0 || line[0] == '#')
+			continue;
+
+		if(grow_list(names, count, &allocated)) {
+			fclose(list);
+			return -1;
+		}
+
+		(*names)[count] = strdup(line);
+		if((*names)[count] == NULL) {
+			fclose(list);
+			capfile_free_list(*names, count);
+			*names = NULL;
+			return -1;
+		}
+		count++;
+	}
+
+	fclose(list);
+
+	return count;
+}
+
+int capfile_list(const char *path, char ***names) {
+	WIN32_FIND_DATAA found;
+	HANDLE search;
+	DWORD attributes;
+	char pattern[MAX_PATH];
+	int count = 0, allocated = 16;
+
+	attributes = GetFileAttributesA(path);
+	if(attributes == INVALID_FILE_ATTRIBUTES) {
+		printf("No such capture file or directory: %s\n", path);
+		return -1;
+	}
+
+	*names = (char **)malloc(sizeof(char *) * allocated);
+	if(*names == NULL)
+		return -1;
+
+	if(!(attributes & FILE_ATTRIBUTE_DIRECTORY) && has_extension(path, ".lst"))
+		return read_list(path, names, allocated);
+
+	if(!(attributes & FILE_ATTRIBUTE_DIRECTORY)) { // single file
+		(*names)[0] = strdup(path);
+		if((*names)[0] == NULL) {
+			free(*names);
+			*names = NULL;
+			return -1;
+		}
+		return 1;
+	}
+
+	snprintf(pattern, sizeof(pattern), "%s\\*", path);
+	search = FindFirstFileA(pattern, &found);
+	if(search == INVALID_HANDLE_VALUE)
+		return 0;
+
+	do {
+		if(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			continue;
+
+		// skip scanline index sidecars
+		if(has_extension(found.cFileName, ".idx"))
+			continue;
+
+		if(grow_list(names, count, &allocated)) {
+			FindClose(search);
+			return -1;
+		}
+
+		(*names)[count] = (char *)malloc(strlen(path) + strlen(found.cFileName) + 2);
+		if((*names)[count] == NULL) {
+			FindClose(search);
+			capfile_free_list(*names, count);
+			*names = NULL;
+			return -1;
+		}
+		sprintf((*names)[count], "%s\\%s", path, found.cFileName);
+		count++;
+	} while(FindNextFileA(search, &found));
+
+	FindClose(search);
+
+	qsort(*names, count, sizeof(char *), compare_names);
+
+	return count;
+}
+
+void capfile_free_list(char **names, int count) {
+	int i;
+
+	for(i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+}
@@ -0,0 +1,47 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Read-only access to 16-bit capture files: raw ones are memory mapped and
+ * compressed ones (capz.h) decoded a block at a time. */
+
+#ifndef CAPFILE_H
+#define CAPFILE_H
+
+#include "windows.h"
+
+#include "capz.h"
+
+typedef struct {
+	HANDLE file, mapping;
+	long long samples; // total amount of samples in the file
+	long long file_size; // in bytes
+	long long modified; // last write time in FILETIME units
+	char * view_base; // start of the mapped window, aligned to allocation granularity
+	long long view_first; // first sample visible in the current view
+	long view_length; // amount of samples visible in the current view
+
+	// Compressed captures are decoded into buffer instead of being mapped
+	int compressed, blocks, block_samples;
+	capz_block *index;
+	short *buffer; // decoded blocks, starting at block buffer_block
+	long buffer_size; // in samples
+	long long buffer_block, buffer_blocks;
+} capfile;
+
+// Open a raw or compressed capture file, returns 0 on success and -1 on failure
+int capfile_open(capfile *cf, const char *filename);
+
+// Map samples [first, first+length) of the capture, clipped to end of file.
+// Returns pointer to sample "first" or NULL on failure. The previous view is
+// unmapped, so only one view is valid at a time. Compressed blocks are checked
+// against their checksums as they are decoded, and blocks still decoded from
+// the previous view are reused.
+short * capfile_view(capfile *cf, long long first, long length);
+
+void capfile_close(capfile *cf);
+
+// List capture files: a plain file yields itself, a directory yields its
+// files in name order, except .idx scanline indices, and a .lst text file
+// yields the names it lists one per line. Returns the amount of names or -1 on failure.
+int capfile_list(const char *path, char ***names);
+void capfile_free_list(char **names, int count);
+
+#endif // CAPFILE_H
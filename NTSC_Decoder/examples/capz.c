@@ -0,0 +1,383 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Compressed capture container: delta coded, bit packed blocks of samples
+ * with a seekable block index and a checksum per block. */
+
+#include "windows.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capfile.h"
+#include "capz.h"
+
+#define COMPRESS_WINDOW 256 // blocks mapped at a time while compressing
+#define ADLER_BASE 65521
+#define ADLER_RUN 5552 // bytes that can be summed before b can overflow
+
+// Zigzag coding keeps small differences of either sign small
+#define ZIGZAG(d) ((unsigned short)(((d) << 1) ^ (((d) & 0x8000) ? 0xFFFF : 0)))
+
+#define MODE_SAMPLES 0 // differences between samples
+#define MODE_LEVELS 1 // differences between indices to a table of the levels used
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_CAPZ
+#include <immintrin.h>
+#endif
+
+// Distinct values of the samples in ascending order, or 0 if there are more
+// than CAPZ_LEVELS. A scope with an 8-bit ADC only ever produces 256 levels,
+// however they are scaled to 16 bits.
+static int find_levels(const short *samples, int count, short *levels) {
+	unsigned long long seen[65536 / 64], bits;
+	int i, v, n = 0;
+
+	memset(seen, 0, sizeof(seen));
+
+	for(i = 0; i < count; i++) {
+		v = samples[i] + 32768;
+		if(!(seen[v >> 6] & (1ULL << (v & 63)))) {
+			if(++n > CAPZ_LEVELS)
+				return 0;
+			seen[v >> 6] |= 1ULL << (v & 63);
+		}
+	}
+
+	for(i = 0, n = 0; i < 65536 / 64; i++)
+		for(bits = seen[i]; bits; bits &= bits - 1) {
+			for(v = 0; !(bits & (1ULL << v)); v++)
+				;
+			levels[n++] = (short)(i * 64 + v - 32768);
+		}
+
+	return n;
+}
+
+static unsigned short level_index(const short *levels, int count, short sample) {
+	int low = 0, high = count - 1, middle;
+
+	while(low < high) {
+		middle = (low + high) / 2;
+		if(levels[middle] < sample)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return (unsigned short)low;
+}
+
+int capz_pack(const short *samples, int count, unsigned char *out) {
+	unsigned short zz[CAPZ_GROUP], previous, code, delta;
+	short levels[CAPZ_LEVELS];
+	unsigned long long bits;
+	unsigned int all;
+	unsigned char *p = out;
+	int n, i, last, width, have, used;
+
+	used = find_levels(samples, count, levels);
+	if(used) {
+		*p++ = MODE_LEVELS;
+		*p++ = (unsigned char)(used - 1);
+		for(i = 0; i < used; i++) {
+			*p++ = (unsigned char)(levels[i] & 0xFF);
+			*p++ = (unsigned char)((unsigned short)levels[i] >> 8);
+		}
+		previous = level_index(levels, used, samples[0]);
+	} else {
+		*p++ = MODE_SAMPLES;
+		previous = (unsigned short)samples[0];
+	}
+
+	*p++ = (unsigned char)(previous & 0xFF);
+	*p++ = (unsigned char)(previous >> 8);
+
+	for(n = 0; n < count; n += CAPZ_GROUP) {
+		last = (count - n < CAPZ_GROUP) ? count - n : CAPZ_GROUP;
+
+		for(i = 0, all = 0; i < CAPZ_GROUP; i++) {
+			if(i < last) {
+				code = used ? level_index(levels, used, samples[n + i]) : (unsigned short)samples[n + i];
+				delta = code - previous;
+				previous = code;
+				zz[i] = ZIGZAG(delta);
+			} else
+				zz[i] = 0; // the last group is padded
+			all |= zz[i];
+		}
+
+		for(width = 0; all; width++)
+			all >>= 1;
+		*p++ = (unsigned char)width;
+
+		// CAPZ_GROUP values of width bits are always whole bytes
+		for(i = 0, bits = 0, have = 0; i < CAPZ_GROUP && width; i++) {
+			bits |= (unsigned long long)zz[i] << have;
+			for(have += width; have >= 8; have -= 8) {
+				*p++ = (unsigned char)bits;
+				bits >>= 8;
+			}
+		}
+	}
+
+	memset(p, 0, CAPZ_PADDING);
+
+	return (int)(p - out) + CAPZ_PADDING;
+}
+
+// Unpack a group of values of a constant width, eight values (width bytes)
+// at a time from 64-bit little endian reads, so every shift and mask is known
+// at compile time. Reads go up to 7 bytes past the group, into the next one
+// or the padding after the block.
+#define FIELD(lo, hi, j, w) ((unsigned short)(((j) * (w) + (w) <= 64 ? (lo) >> (((j) * (w)) & 63) : \
+	(j) * (w) >= 64 ? (hi) >> (((j) * (w) - 64) & 63) : \
+	((lo) >> (((j) * (w)) & 63)) | ((hi) << ((64 - (j) * (w)) & 63))) & ((1u << (w)) - 1)))
+
+#define UNPACK_GROUP(w) \
+	static void unpack_##w(const unsigned char *in, unsigned short *z) { \
+		unsigned long long lo, hi = 0; \
+		int k; \
+		for(k = 0; k < CAPZ_GROUP / 8; k++, in += (w), z += 8) { \
+			memcpy(&lo, in, sizeof(lo)); \
+			if((w) > 8) \
+				memcpy(&hi, in + 8, sizeof(hi)); \
+			z[0] = FIELD(lo, hi, 0, w); z[1] = FIELD(lo, hi, 1, w); \
+			z[2] = FIELD(lo, hi, 2, w); z[3] = FIELD(lo, hi, 3, w); \
+			z[4] = FIELD(lo, hi, 4, w); z[5] = FIELD(lo, hi, 5, w); \
+			z[6] = FIELD(lo, hi, 6, w); z[7] = FIELD(lo, hi, 7, w); \
+		} \
+	}
+
+UNPACK_GROUP(1) UNPACK_GROUP(2) UNPACK_GROUP(3) UNPACK_GROUP(4)
+UNPACK_GROUP(5) UNPACK_GROUP(6) UNPACK_GROUP(7) UNPACK_GROUP(8)
+UNPACK_GROUP(9) UNPACK_GROUP(10) UNPACK_GROUP(11) UNPACK_GROUP(12)
+UNPACK_GROUP(13) UNPACK_GROUP(14) UNPACK_GROUP(15) UNPACK_GROUP(16)
+
+static void (* const unpack_group[17])(const unsigned char *, unsigned short *) = {
+	NULL, unpack_1, unpack_2, unpack_3, unpack_4, unpack_5, unpack_6, unpack_7, unpack_8,
+	unpack_9, unpack_10, unpack_11, unpack_12, unpack_13, unpack_14, unpack_15, unpack_16
+};
+
+// Turn a full group of zigzag coded differences back into values, carrying
+// the last value over in previous
+static void sum_scalar(const unsigned short *zz, unsigned short *out, unsigned short *previous) {
+	unsigned short value = *previous;
+	int i;
+
+	for(i = 0; i < CAPZ_GROUP; i++) {
+		value += (unsigned short)((zz[i] >> 1) ^ (0u - (zz[i] & 1)));
+		out[i] = value;
+	}
+
+	*previous = value;
+}
+
+#ifdef SIMD_CAPZ
+
+// Eight differences at a time: undo the zigzag, then a prefix sum in three
+// shifted adds, plus the last value of the previous eight in every lane
+__attribute__((target("sse2")))
+static void sum_sse2(const unsigned short *zz, unsigned short *out, unsigned short *previous) {
+	__m128i one = _mm_set1_epi16(1), zero = _mm_setzero_si128(), x;
+	__m128i carry = _mm_set1_epi16((short)*previous);
+	int i;
+
+	for(i = 0; i < CAPZ_GROUP; i += 8) {
+		x = _mm_loadu_si128((const __m128i *)(zz + i));
+		x = _mm_xor_si128(_mm_srli_epi16(x, 1), _mm_sub_epi16(zero, _mm_and_si128(x, one)));
+
+		x = _mm_add_epi16(x, _mm_slli_si128(x, 2));
+		x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+		x = _mm_add_epi16(x, _mm_slli_si128(x, 8));
+		x = _mm_add_epi16(x, carry);
+		_mm_storeu_si128((__m128i *)(out + i), x);
+
+		carry = _mm_shufflehi_epi16(x, _MM_SHUFFLE(3, 3, 3, 3));
+		carry = _mm_unpackhi_epi64(carry, carry);
+	}
+
+	*previous = out[CAPZ_GROUP - 1];
+}
+
+#endif // SIMD_CAPZ
+
+static void (*sum_group)(const unsigned short *, unsigned short *, unsigned short *) = NULL;
+
+const char * capz_setup(int simd) {
+	sum_group = &sum_scalar;
+
+#ifdef SIMD_CAPZ
+	if(simd) {
+		__builtin_cpu_init();
+
+		if(__builtin_cpu_supports("sse2"))
+			sum_group = &sum_sse2;
+	}
+
+	if(sum_group == &sum_sse2)
+		return "SSE2";
+#endif
+
+	return "scalar";
+}
+
+int capz_unpack(const unsigned char *in, int size, short *samples, int count) {
+	const unsigned char *end = in + size - CAPZ_PADDING;
+	unsigned short previous, zz[CAPZ_GROUP], *out = (unsigned short *)samples;
+	short levels[CAPZ_LEVELS];
+	int n, i, last, width, mode, used = 0;
+
+	if(sum_group == NULL)
+		capz_setup(1);
+
+	if(size < 3 + CAPZ_PADDING)
+		return -1;
+
+	mode = *in++;
+	if(mode == MODE_LEVELS) {
+		used = *in++ + 1;
+		if(in + 2 * used + 2 > end)
+			return -1;
+
+		for(i = 0; i < used; i++, in += 2)
+			levels[i] = (short)(in[0] | (in[1] << 8));
+		for(; i < CAPZ_LEVELS; i++) // a damaged block can't index past the table
+			levels[i] = levels[used - 1];
+	} else if(mode != MODE_SAMPLES)
+		return -1;
+
+	previous = (unsigned short)(in[0] | (in[1] << 8));
+	in += 2;
+
+	for(n = 0; n < count; n += CAPZ_GROUP, out += CAPZ_GROUP) {
+		last = (count - n < CAPZ_GROUP) ? count - n : CAPZ_GROUP;
+
+		if(in >= end)
+			return -1;
+		width = *in++;
+		if(width > 16 || in + width * CAPZ_GROUP / 8 > end)
+			return -1;
+
+		if(width == 0) // no change over the whole group
+			memset(zz, 0, sizeof(zz));
+		else
+			unpack_group[width](in, zz);
+		in += width * CAPZ_GROUP / 8;
+
+		if(last == CAPZ_GROUP)
+			sum_group(zz, out, &previous);
+		else
+			for(i = 0; i < last; i++) {
+				previous += (unsigned short)((zz[i] >> 1) ^ (0u - (zz[i] & 1)));
+				out[i] = previous;
+			}
+
+		if(used) // indices to levels
+			for(i = 0; i < last; i++)
+				out[i] = (unsigned short)levels[out[i] & (CAPZ_LEVELS - 1)];
+	}
+
+	return 0;
+}
+
+// Adler-32, with the modulo taken once per ADLER_RUN bytes
+unsigned int capz_checksum(const unsigned char *data, int size) {
+	unsigned int a = 1, b = 0;
+	int n, i;
+
+	while(size > 0) {
+		n = (size < ADLER_RUN) ? size : ADLER_RUN;
+
+		for(i = 0; i < n; i++) {
+			a += data[i];
+			b += a;
+		}
+
+		a %= ADLER_BASE;
+		b %= ADLER_BASE;
+		data += n;
+		size -= n;
+	}
+
+	return (b << 16) | a;
+}
+
+long long capz_compress(const char *in, const char *out) {
+	capfile cf;
+	capz_header header;
+	capz_block *index;
+	unsigned char *packed;
+	short *view;
+	long long offset, first;
+	FILE *file;
+	int n, count;
+
+	if(capfile_open(&cf, in))
+		return -1;
+
+	memset(&header, 0, sizeof(capz_header));
+	memcpy(header.magic, CAPZ_MAGIC, sizeof(header.magic));
+	header.samples = cf.samples;
+	header.block_samples = CAPZ_BLOCK_SAMPLES;
+	header.blocks = (int)((cf.samples + CAPZ_BLOCK_SAMPLES - 1) / CAPZ_BLOCK_SAMPLES);
+
+	index = (capz_block *)malloc(sizeof(capz_block) * header.blocks);
+	packed = (unsigned char *)malloc(CAPZ_BOUND(CAPZ_BLOCK_SAMPLES));
+	file = fopen(out, "wb");
+	if(index == NULL || packed == NULL || file == NULL) {
+		printf("Could not create %s\n", out);
+		goto fail;
+	}
+
+	// the header is written again at the end, when the index is in place
+	if(fwrite(&header, sizeof(capz_header), 1, file) != 1)
+		goto write_fail;
+	offset = sizeof(capz_header);
+
+	for(n = 0, view = NULL; n < header.blocks; n++) {
+		first = (long long)n * CAPZ_BLOCK_SAMPLES;
+
+		if(n % COMPRESS_WINDOW == 0) {
+			view = capfile_view(&cf, first, (long)COMPRESS_WINDOW * CAPZ_BLOCK_SAMPLES);
+			if(view == NULL)
+				goto fail;
+		}
+
+		count = (cf.samples - first < CAPZ_BLOCK_SAMPLES) ? (int)(cf.samples - first) : CAPZ_BLOCK_SAMPLES;
+
+		index[n].offset = offset;
+		index[n].size = (unsigned int)capz_pack(view + (first - cf.view_first), count, packed);
+		index[n].checksum = capz_checksum(packed, index[n].size);
+
+		if(fwrite(packed, 1, index[n].size, file) != index[n].size)
+			goto write_fail;
+		offset += index[n].size;
+	}
+
+	header.index_offset = offset;
+	if(fwrite(index, sizeof(capz_block), header.blocks, file) != (size_t)header.blocks)
+		goto write_fail;
+	offset += sizeof(capz_block) * header.blocks;
+
+	if(fseek(file, 0, SEEK_SET) || fwrite(&header, sizeof(capz_header), 1, file) != 1 || fclose(file)) {
+		file = NULL;
+		goto write_fail;
+	}
+
+	free(packed);
+	free(index);
+	capfile_close(&cf);
+
+	return offset;
+
+write_fail:
+	printf("Could not write %s\n", out);
+fail:
+	if(file != NULL)
+		fclose(file);
+	free(packed);
+	free(index);
+	capfile_close(&cf);
+
+	return -1;
+}
@@ -0,0 +1,58 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Compressed capture container: delta coded, bit packed blocks of samples
+ * with a seekable block index and a checksum per block. */
+
+#ifndef CAPZ_H
+#define CAPZ_H
+
+#define CAPZ_MAGIC "NTSCCAPZ"
+#define CAPZ_BLOCK_SAMPLES 65536 // a field at 16 ns is about four blocks
+#define CAPZ_GROUP 32 // samples sharing a bit width
+#define CAPZ_LEVELS 256 // blocks with at most this many distinct sample values code them as indices
+#define CAPZ_PADDING 8 // zero bytes after every block, so unpacking can read 64 bits at a time
+
+// Largest block count samples can compress to: the mode byte, a level table
+// of up to CAPZ_LEVELS samples and its size byte, the first sample, and a
+// width byte and up to 16 bits a sample for every group. Index differences
+// are narrower than that, so a table never adds more than its own size.
+#define CAPZ_BOUND(count) (3 + 1 + 2 * CAPZ_LEVELS + ((count) + CAPZ_GROUP - 1) / CAPZ_GROUP * (1 + 2 * CAPZ_GROUP) + CAPZ_PADDING)
+
+// File layout: header, blocks, index. Samples of block n start at
+// n * block_samples, so any field can be read by decoding only the blocks
+// it spans.
+typedef struct {
+	char magic[8];
+	long long samples; // in the whole capture
+	int block_samples, blocks;
+	long long index_offset; // of the blocks capz_block entries
+} capz_header;
+
+typedef struct {
+	long long offset; // of the block in the file
+	unsigned int size; // compressed bytes, padding included
+	unsigned int checksum; // Adler-32 of those bytes
+} capz_block;
+
+// A block is the first sample followed by groups of CAPZ_GROUP differences
+// between consecutive samples, zigzag coded and packed with the smallest
+// bit width that fits the group, given in a byte before it. When the block
+// uses at most CAPZ_LEVELS distinct values, a table of them comes first and
+// the differences are between indices to it, which are much smaller for
+// 8-bit scope data. Returns the compressed size, at most CAPZ_BOUND(count).
+int capz_pack(const short *samples, int count, unsigned char *out);
+
+// Decode count samples from a block. Returns 0 on success and -1 if the
+// block is corrupt.
+int capz_unpack(const unsigned char *in, int size, short *samples, int count);
+
+unsigned int capz_checksum(const unsigned char *data, int size);
+
+// Select the decoding kernel: simd = 0 forces the portable one. Called
+// automatically with simd = 1 on first use. Returns the kernel name.
+const char * capz_setup(int simd);
+
+// Compress the raw capture in to the container out. Returns the size of out
+// in bytes or -1 on failure.
+long long capz_compress(const char *in, const char *out);
+
+#endif // CAPZ_H
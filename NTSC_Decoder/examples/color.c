@@ -5,6 +5,7 @@
 #include "windows.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include <conio.h>
 #include <math.h>
 #include <time.h>
@@ -12,6 +13,21 @@
 #include "draw.h"
 #include "util.h"
 #include "picoutil.h"
+#include "capfile.h"
+#include "threadpool.h"
+#include "sync.h"
+#include "scanidx.h"
+#include "ring.h"
+#include "present.h"
+#include "ntscgen.h"
+#include "stats.h"
+#include "levels.h"
+#include "fieldshm.h"
+#include "vidout.h"
+#include "deint.h"
+#include "resample.h"
+#include "denoise.h"
+#include "batch.h"
 
 #include "SDL/SDL.h"
 
@@ -27,12 +43,25 @@
 #define CALC_RGB(r,g,b) (((r)<<16) + ((g)<<8) + (b))
 #define SCALE(c, min, max) MIN(1.0, MAX(0.0, ((c)-(min))/((max)-(min))))
 
+// latency histogram stages
 #define TP_FRAME 0
-#define TP_PICO 10
-#define TP_FIELD 20
-#define TP_SCANLINE 25
-#define TP_BURST 26
-#define TP_DRAW 30
+#define TP_PICO 1
+#define TP_FIELD 2
+#define TP_SCANLINE 3
+#define TP_LINE 4
+#define TP_DRAW 5
+#define TP_BURST 6
+#define TP_PRESENT 7
+
+// event counters
+#define CT_BLOCKS 0
+#define CT_FAILED 1
+#define CT_FIELDS 2
+#define CT_PARTIAL 3
+#define CT_SHOWN 4
+#define CT_DROPPED 5
+#define CT_REBUILDS 6
+#define CT_UNWRITTEN 7
 
 // using .8 fixed point here
 #define MUL_WAVE 256
@@ -59,12 +88,23 @@ int wave_before, wave_after; // integer values, before + after = i_wavelength -
 
 // Crop values for nicer display
 int crop_left, copy_width, crop_top, crop_bottom;
+int out_width; // > 0 when scanlines are resampled to this width
+
+resampler scaler; // copy_width to out_width, rebuilt between fields when the crop changes
+denoiser field_denoise; // temporal noise reduction of decoded scanlines when shift > 0
 
 // rough scanline timings from HSYNC start:
 // sync length 4.3 us
 // colourburst area ends 9.0 us
 // visible area ends 61.9 us
 // scanline ends 63.3 us
+// Horizontal crop from percentages of the scanline cut from the left and
+// the right. Doesn't read the settings, so the decoder thread can use it.
+void set_crop(int left, int right) {
+	crop_left = scanline_w * left / 100;
+	copy_width = scanline_w - crop_left - scanline_w * right / 100;
+}
+
 void calculate_parameters(long timeInterval) {
 	// calculate approximate values for signal parameters based on capture interval (ns)
 	scanline_w = 63556/timeInterval; // 1s / 29.97 / 525 = ca. 63.5556 us
@@ -87,9 +127,21 @@ void calculate_parameters(long timeInterval) {
 	crop_top = get_setting_or("crop_top", 0);
 	crop_bottom = get_setting_or("crop_bottom", 0);
 
-	// calculate horizontal crop values
-	crop_left = scanline_w * get_setting_or("crop_left", 0) / 100;
-	copy_width = scanline_w - crop_left - scanline_w * get_setting_or("crop_right", 0) / 100;
+	set_crop(get_setting_or("crop_left", 0), get_setting_or("crop_right", 0));
+	
+	// decode the cropped scanlines straight to this many pixels, 0 keeps one per sample
+	out_width = get_setting_or("out_width", 0);
+}
+
+// Width of the shown and saved frames
+static int frame_width(int scale_x) {
+	return out_width > 0 ? out_width : copy_width >> (-scale_x);
+}
+
+// Width of the field surfaces, wide enough for full rate scanlines even when
+// they are resampled, should the resampler not be available
+static int field_width() {
+	return MAX(scanline_w, out_width);
 }
 
 // Lookup tables are used for YIQ -> RGB conversion, but values need to be shifted
@@ -101,6 +153,15 @@ void calculate_parameters(long timeInterval) {
 int * lookup_Y = NULL, * lookup_I = NULL, * lookup_Q = NULL;
 int min_Y, min_I, min_Q, max_Y, max_I, max_Q;
 
+// Packed copy of the same tables for the SIMD kernels: every entry holds the
+// B, G and R contributions as 16-bit lanes (top lane zero), so one 64-bit load
+// gives a whole pixel term and three terms add up with a single 16-bit add.
+// Y entries come first, then I and Q interleaved (I at 2*i, Q at 2*q+1)
+// starting at lookup_IQ, all in one 64-byte aligned block that fits in L1.
+long long * lookup_packed = NULL, * lookup_IQ = NULL;
+
+#define PACK_RGB(r,g,b) ((long long)(unsigned short)(b) | ((long long)(unsigned short)(g) << 16) | ((long long)(unsigned short)(r) << 32))
+
 #ifdef COLOR_COMP
 
 #define MAX_AMP 32768 // actually max amp is 32767, but we need 1 more in arrays
@@ -108,38 +169,181 @@ int min_Y, min_I, min_Q, max_Y, max_I, max_Q;
 int * comp_I = NULL, * comp_Q = NULL;
 short amp_histogram[MAX_AMP];
 short amps_measured = 0;
+int color_amp; // most common color burst amplitude
 
 #endif // COLOR_COMP
 
+// Y/I/Q extremes and the lowest sync level seen by analyze_scanline
+typedef struct {
+	int min_Y, max_Y, min_I, max_I, min_Q, max_Q;
+	int sync;
+} level_range;
+
+static void reset_levels(level_range *levels) {
+	levels->max_Y = levels->max_I = levels->max_Q = -1000000000;
+	levels->min_Y = levels->min_I = levels->min_Q = levels->sync = 1000000000;
+}
+
+// Burst phase: the reference waveform is fitted to the color burst by the
+// sum of products of the burst and the waveform shifted by adj samples.
+// Trying every adj costs i_wavelength times the burst per scanline, so
+// instead the burst is projected once on the two quadrature waveforms and
+// the best shift follows from atan2. Only the shifts around that are scored.
+// Within a field the subcarrier runs on continuously, so the phase of every
+// scanline can also be predicted from the previous ones, see track_burst.
+int burst_lock = 1; // 0 tries every adj for every scanline
+
+#define BURST_GAIN 0.25 // share of the phase error corrected on each scanline
+#define BURST_SEARCH_WAVE 7 // up to this many adjs trying each one is cheaper than the projection
+
+// Fit of the reference waveform shifted by adj to the burst
+static int burst_score(short * samples, int adj) {
+	int count, sum = 0;
+	
+	for(count = color_burst_start; count < color_burst_start + color_burst_len; count++)
+		sum += (color_wave1[count - adj] * samples[count]) >> 4; // drop a bit of accuracy
+	
+	return sum;
+}
+
+// Try every adj, it's not least squares, but maximum products :)
+static int burst_search(short * samples) {
+	int adj, sum, bestSum = -1000000000, bestAdj = 0;
+	
+	for(adj = 0; adj < i_wavelength; adj++) {
+		sum = burst_score(samples, adj);
+		
+		if(sum > bestSum) {
+			bestAdj = adj;
+			bestSum = sum;
+		}
+	}
+	
+	return bestAdj;
+}
+
+// Shift in samples [0, f_wavelength) at which the fit peaks. The score is
+// S cos(a) + C sin(a) for a shift of a radians, which peaks at atan2(C, S).
+static double burst_phase(short * samples) {
+	long long S = 0, C = 0;
+	int count;
+	double phase;
+	
+	for(count = color_burst_start; count < color_burst_start + color_burst_len; count++) {
+		S += color_wave1[count] * samples[count];
+		C += color_wave2[count] * samples[count];
+	}
+	
+	phase = atan2((double)C, (double)S) * f_wavelength / (2.0 * M_PI);
+	
+	return phase < 0 ? phase + f_wavelength : phase;
+}
+
+// Best of the adjs next to the shift estimate. *peak is set to where the fit
+// peaks from a parabola through the three scores, or to -1 if the best adj
+// is not the closest one and the estimate can't be trusted.
+static int refine_burst(short * samples, double estimate, double *peak) {
+	int center = (int)floor(estimate + 0.5), left, right, s_left, s_center, s_right;
+	
+	if(center >= i_wavelength) // between the last adj and a whole wavelength
+		center = (estimate - (i_wavelength - 1) < f_wavelength - estimate) ? i_wavelength - 1 : 0;
+	
+	left = center > 0 ? center - 1 : i_wavelength - 1;
+	right = center < i_wavelength - 1 ? center + 1 : 0;
+	
+	s_left = burst_score(samples, left);
+	s_center = burst_score(samples, center);
+	s_right = burst_score(samples, right);
+	
+	if(s_left > s_center && s_left >= s_right) {
+		*peak = -1;
+		return left;
+	}
+	if(s_right > s_center) {
+		*peak = -1;
+		return right;
+	}
+	
+	*peak = center;
+	if(s_left + s_right - 2 * s_center < 0)
+		*peak += 0.5 * (s_left - s_right) / (double)(s_left + s_right - 2 * s_center);
+	
+	return center;
+}
+
+// Waveform adjustment for a single scanline
+int burst_adjustment(short * samples) {
+	double peak;
+	
+	if(!burst_lock || i_wavelength <= BURST_SEARCH_WAVE)
+		return burst_search(samples);
+	
+	return refine_burst(samples, burst_phase(samples), &peak);
+}
+
+// Subcarrier phase lock over the scanlines of a field
+typedef struct {
+	double phase; // shift in samples relative to sample 0 of the field
+	int locked;
+} burst_tracker;
+
+// Waveform adjustment for the scanline at samples + start. While locked the
+// phase is predicted from the previous scanlines and only corrected by the
+// scores around it; a scanline that doesn't fit is measured on its own.
+int track_burst_line(burst_tracker *bt, short * samples, int start) {
+	double predicted, peak, error;
+	int adj;
+	
+	if(bt->locked) {
+		predicted = fmod(bt->phase - start, f_wavelength);
+		if(predicted < 0)
+			predicted += f_wavelength;
+		
+		adj = refine_burst(samples + start, predicted, &peak);
+		
+		if(peak >= -0.5) {
+			error = fmod(peak - predicted + 1.5 * f_wavelength, f_wavelength) - 0.5 * f_wavelength;
+			bt->phase += BURST_GAIN * error;
+			return adj;
+		}
+	}
+	
+	adj = refine_burst(samples + start, burst_phase(samples + start), &peak);
+	bt->phase = start + (peak >= -0.5 ? peak : adj);
+	bt->locked = 1;
+	
+	return adj;
+}
+
 // Analyze potential scanline to find Y/I/Q min/max values
-void analyze_scanline(short * samples, int scanline_start) {
+void analyze_scanline(short * samples, int scanline_start, level_range *levels) {
+	sync_slicer slicer;
 	int sync_end, next_sync;
 	int count;
-	int adj; // color waveform adjustment, best fit
-	int sum, bestSum = -1000000000, bestAdj = 0;
+	int bestAdj; // color waveform adjustment, best fit
 	int Y, run_I, run_Q;
-		
+	
+	slicer_init(&slicer, samples + scanline_start, 0, scanline_w, treshold, 1);
+	
 	// find sync end
-	for(count = 0; count < scanline_w; count++)
-		if(samples[scanline_start + count] > treshold)
-			break;
+	sync_end = slicer_next(&slicer);
 	
-	if(count < 1) { // way too short sync
+	if(sync_end < 1) { // way too short sync
 		return; // don't process as normal scanline
-	} else if(count > color_burst_start) { // way too long sync
+	} else if(sync_end > color_burst_start) { // way too long sync
 		return; // don't process as normal scanline
-	} else
-		sync_end = count;
+	}
 		
-	// find next sync start
-	for(next_sync = sync_end; next_sync < scanline_w; next_sync++)
-		if(samples[scanline_start + next_sync] <= treshold)
-			break;
+	// find next sync start, the slicer continues from sync end
+	next_sync = slicer_next(&slicer);
 	
 	if(next_sync < 9 * scanline_w / 10) { // seems like a VSYNC
 		//printf("%7d: Too short non-sync (%d)!\n", scanline_start, next_sync);
 		return; // don't process as normal scanline
 	}
+	
+	for(count = 0; count < sync_end; count++)
+		levels->sync = MIN(levels->sync, samples[scanline_start + count]);
 
 #ifdef COLOR_COMP
 	short min, max;
@@ -151,17 +355,7 @@ void analyze_scanline(short * samples, int scanline_start) {
 #endif // COLOR_COMP
 
 	// fit reference waveform to data
-	for(adj = 0; adj < i_wavelength; adj++) { // it's not least squares, but maximum products :)
-		sum = 0;
-		
-		for(count = color_burst_start; count < color_burst_start + color_burst_len; count++)
-			sum += (color_wave1[count - adj] * samples[scanline_start + count]) >> 4; // drop a bit of accuracy
-		
-		if(sum > bestSum) {
-			bestAdj = adj;
-			bestSum = sum;
-		}
-	}
+	bestAdj = burst_adjustment(samples + scanline_start);
 	
 	// to avoid accessing values beyond the scanline, we'll start a bit before color burst end
 	run_I = run_Q = 0;
@@ -178,70 +372,51 @@ void analyze_scanline(short * samples, int scanline_start) {
 
 		Y = samples[scanline_start + count];	
 		
-		min_Y = MIN(min_Y, Y);
-		max_Y = MAX(max_Y, Y);		
-		min_I = MIN(min_I, run_I);
-		max_I = MAX(max_I, run_I);
-		min_Q = MIN(min_Q, run_Q);
-		max_Q = MAX(max_Q, run_Q);
+		levels->min_Y = MIN(levels->min_Y, Y);
+		levels->max_Y = MAX(levels->max_Y, Y);		
+		levels->min_I = MIN(levels->min_I, run_I);
+		levels->max_I = MAX(levels->max_I, run_I);
+		levels->min_Q = MIN(levels->min_Q, run_Q);
+		levels->max_Q = MAX(levels->max_Q, run_Q);
 		
 		run_I -= samples[scanline_start + count - wave_before] * color_wave1[count - wave_before - bestAdj];
 		run_Q -= samples[scanline_start + count - wave_before] * color_wave2[count - wave_before - bestAdj];
 	}
 }
 
-void analyze_samples(short * samples, long length) {
-	int offset, is_sync = 1, is_transition = 0, range;
-	float comp;
+// Build lookup_packed from lookup_Y, lookup_I and lookup_Q
+void pack_lookup_tables() {
+	int offset, range_Y = (max_Y - min_Y) >> SHIFT_Y, range_I = (max_I - min_I) >> SHIFT_I, range_Q = (max_Q - min_Q) >> SHIFT_Q;
+	int iq_start = (range_Y + 8) & ~7; // I/Q part starts on a cache line too
+	size_t size = sizeof(long long) * (iq_start + 2 * (MAX(range_I, range_Q) + 1));
 	
-	// Try to guess a good treshold value
-	treshold = get_min(samples, length);
-	treshold = get_next(samples, length, treshold);
+	lookup_packed = (long long *)_aligned_realloc(lookup_packed, size, 64);
+	if(lookup_packed == NULL) {
+		printf("Couldn't allocate memory for packed lookup table (%d bytes)!\n", (int)size);
+		quit(-1);
+	}
 	
-	// initialize min/max Y/I/Q values
-	max_Y = max_I = max_Q = -1000000000;
-	min_Y = min_I = min_Q = 1000000000;
-
-#ifdef COLOR_COMP
-	int color_amp, max_amps;
-	int color_comp = get_setting_or("color_compensation", 4);
+	memset(lookup_packed, 0, size);
+	lookup_IQ = lookup_packed + iq_start;
 	
-	// Reset color burst amplitude histogram
-	memset(amp_histogram, 0, sizeof(amp_histogram));
-#endif
+	for(offset = 0; offset <= range_Y; offset++)
+		lookup_packed[offset] = PACK_RGB(lookup_Y[offset], lookup_Y[offset], lookup_Y[offset]);
 	
-	for(offset=0; offset < length; offset++) { // loop through data
-		// set is_sync, is_transition
-		if(samples[offset] <= treshold) { // low
-			is_transition = is_sync ? 0 : 1;
-			is_sync = 1;
-		} else { // high
-			is_transition = is_sync ? 1 : 0;
-			is_sync = 0;
-		}
-		
-		if(is_transition && is_sync && offset + scanline_w < length) // potential scanline start
-			analyze_scanline(samples, offset);
-	}
+	for(offset = 0; offset <= range_I; offset++)
+		lookup_IQ[2 * offset] = PACK_RGB(lookup_I[offset * 4 + 0], lookup_I[offset * 4 + 1], lookup_I[offset * 4 + 2]);
 	
-	printf("Y: %d - %d (%d)  I: %d - %d (%d)  Q: %d - %d (%d)\n",
-		min_Y, max_Y, max_Y - min_Y,
-		min_I, max_I, max_I - min_I,
-		min_Q, max_Q, max_Q - min_Q);
+	for(offset = 0; offset <= range_Q; offset++)
+		lookup_IQ[2 * offset + 1] = PACK_RGB(lookup_Q[offset * 4 + 0], lookup_Q[offset * 4 + 1], lookup_Q[offset * 4 + 2]);
+}
+
+// (Re)build the YIQ -> RGB lookup tables for the current min/max values
+void build_lookup_tables() {
+	int offset, range;
+	float comp;
 	
 #ifdef COLOR_COMP
-	// find the most common color burst amplitude to use in compensation calculations
-	color_amp = 0;
-	max_amps = amp_histogram[0];
+	int color_comp = get_setting_or("color_compensation", 4);
 	
-	for(offset=1; offset<MAX_AMP; offset++) {
-		if(amp_histogram[offset] > max_amps) {
-			printf("%3d x color amplitude %4d\n", amp_histogram[offset], offset);
-			max_amps = amp_histogram[offset];
-			color_amp = offset;
-		}
-	}
-
 	if(comp_I == NULL)
 		comp_I = (int *)malloc(sizeof(int) * (((max_I - min_I) >> SHIFT_I) + 1));
 	else
@@ -308,7 +483,181 @@ void analyze_samples(short * samples, long length) {
 #ifdef COLOR_COMP
 		comp_Q[offset] = (int)(color_amp * color_comp * (2*comp-1)); // Y compensation for Q
 #endif
-	}	
+	}
+	
+	if(get_setting_or("packed_lookup", 1))
+		pack_lookup_tables();
+}
+
+
+// Level tracking: rather than running analyze_samples again, the pipeline
+// passes every decoded field to track_levels, which analyzes only a sparse
+// subset of its scanlines. Bounds widen at once, so nothing gets clipped, but
+// shrink back slowly. Tables are rebuilt only after a bound has moved by more
+// than level_slack percent of its range.
+typedef struct {
+	double min_Y, max_Y, min_I, max_I, min_Q, max_Q, sync;
+	int sync_margin; // treshold above the sync level
+	int fields; // 0 snaps to the next field instead of decaying
+	int stride; // analyze every stride'th scanline
+	int lines; // scanlines sampled for the sync level when relocking
+	double decay, slack;
+} level_tracker;
+
+level_tracker tracker;
+level_hist signal_hist;
+
+// Find the sync level from an amplitude histogram of lines evenly spaced
+// scanlines, or all samples if lines is 0
+static void find_sync_level(short * samples, long length, int lines) {
+	signal_levels levels;
+	
+	if(signal_hist.count == NULL && level_hist_init(&signal_hist))
+		quit(-1);
+	
+	level_hist_clear(&signal_hist);
+	level_hist_lines(&signal_hist, samples, length, lines, scanline_w);
+	if(signal_hist.total == 0)
+		return;
+	
+	level_hist_levels(&signal_hist, &levels);
+	
+	treshold = levels.treshold;
+	tracker.sync_margin = levels.treshold - levels.sync_tip;
+}
+
+void analyze_samples(short * samples, long length) {
+	sync_slicer slicer;
+	level_range levels;
+	int offset;
+	
+	// Try to guess a good treshold value
+	find_sync_level(samples, length, 0);
+	
+	// initialize min/max Y/I/Q values
+	reset_levels(&levels);
+	
+#ifdef COLOR_COMP
+	int max_amps;
+	
+	// Reset color burst amplitude histogram
+	memset(amp_histogram, 0, sizeof(amp_histogram));
+#endif
+	
+	slicer_init(&slicer, samples, 0, length, treshold, 1);
+	
+	while((offset = slicer_next(&slicer)) < length) // loop through sync edges
+		if(slicer.is_sync && offset + scanline_w < length) // potential scanline start
+			analyze_scanline(samples, offset, &levels);
+	
+	min_Y = levels.min_Y; max_Y = levels.max_Y;
+	min_I = levels.min_I; max_I = levels.max_I;
+	min_Q = levels.min_Q; max_Q = levels.max_Q;
+	
+	printf("Y: %d - %d (%d)  I: %d - %d (%d)  Q: %d - %d (%d)\n",
+		min_Y, max_Y, max_Y - min_Y,
+		min_I, max_I, max_I - min_I,
+		min_Q, max_Q, max_Q - min_Q);
+	
+#ifdef COLOR_COMP
+	// find the most common color burst amplitude to use in compensation calculations
+	color_amp = 0;
+	max_amps = amp_histogram[0];
+	
+	for(offset=1; offset<MAX_AMP; offset++) {
+		if(amp_histogram[offset] > max_amps) {
+			printf("%3d x color amplitude %4d\n", amp_histogram[offset], offset);
+			max_amps = amp_histogram[offset];
+			color_amp = offset;
+		}
+	}
+#endif // COLOR_COMP
+
+	build_lookup_tables();
+	
+	// tracking continues from the analyzed levels
+	tracker.min_Y = min_Y; tracker.max_Y = max_Y;
+	tracker.min_I = min_I; tracker.max_I = max_I;
+	tracker.min_Q = min_Q; tracker.max_Q = max_Q;
+	tracker.sync = treshold - tracker.sync_margin;
+	tracker.fields = 1;
+}
+
+void init_level_tracker() {
+	tracker.stride = MAX(1, get_setting_or("level_stride", 8));
+	tracker.lines = get_setting_or("level_lines", 32);
+	tracker.decay = 1.0 / MAX(1, get_setting_or("level_decay", 64)); // about how many fields a shrink takes
+	tracker.slack = get_setting_or("level_slack", 5) / 100.0;
+	tracker.fields = 0;
+}
+
+// Sync was lost, so there are no fields to track levels from: find the sync
+// level again from the samples and snap to the next field that decodes
+void relock_levels(short * samples, long length) {
+	find_sync_level(samples, length, tracker.lines);
+	tracker.fields = 0;
+}
+
+// Move a tracked bound toward the level seen in the latest field
+static double track_bound(double tracked, int seen, int upper) {
+	if(tracker.fields == 0 || (upper ? seen > tracked : seen < tracked))
+		return seen;
+	
+	return tracked + (seen - tracked) * tracker.decay;
+}
+
+// Has a tracked bound moved far enough from the table bound to rebuild
+static int bound_moved(double tracked, int bound, int range) {
+	return fabs(tracked - bound) > range * tracker.slack;
+}
+
+// Update levels from a decoded field and rebuild the lookup tables if they
+// have moved. The tables are shared with the decode pool, so only call this
+// between fields. Returns 1 if the tables were rebuilt.
+int track_levels(short * samples, long length) {
+	sync_slicer slicer;
+	level_range levels;
+	int offset, line = 0, stride = tracker.fields ? tracker.stride : 1;
+	
+	reset_levels(&levels);
+	slicer_init(&slicer, samples, 0, length, treshold, 1);
+	
+	while((offset = slicer_next(&slicer)) < length)
+		if(slicer.is_sync && offset + scanline_w < length && line++ % stride == 0)
+			analyze_scanline(samples, offset, &levels);
+	
+	if(levels.max_Y < levels.min_Y) // no normal scanlines
+		return 0;
+	
+	tracker.min_Y = track_bound(tracker.min_Y, levels.min_Y, 0);
+	tracker.max_Y = track_bound(tracker.max_Y, levels.max_Y, 1);
+	tracker.min_I = track_bound(tracker.min_I, levels.min_I, 0);
+	tracker.max_I = track_bound(tracker.max_I, levels.max_I, 1);
+	tracker.min_Q = track_bound(tracker.min_Q, levels.min_Q, 0);
+	tracker.max_Q = track_bound(tracker.max_Q, levels.max_Q, 1);
+	tracker.sync = track_bound(tracker.sync, levels.sync, 0);
+	
+	// treshold moves in whole steps of the margin, like get_next would pick it
+	if(fabs(tracker.sync + tracker.sync_margin - treshold) >= tracker.sync_margin)
+		treshold = (int)(tracker.sync + 0.5) + tracker.sync_margin;
+	
+	if(tracker.fields++ > 0 &&
+			!bound_moved(tracker.min_Y, min_Y, max_Y - min_Y) && !bound_moved(tracker.max_Y, max_Y, max_Y - min_Y) &&
+			!bound_moved(tracker.min_I, min_I, max_I - min_I) && !bound_moved(tracker.max_I, max_I, max_I - min_I) &&
+			!bound_moved(tracker.min_Q, min_Q, max_Q - min_Q) && !bound_moved(tracker.max_Q, max_Q, max_Q - min_Q))
+		return 0;
+	
+	if(tracker.max_Y - tracker.min_Y < (1 << SHIFT_Y) || tracker.max_I - tracker.min_I < (1 << SHIFT_I) ||
+			tracker.max_Q - tracker.min_Q < (1 << SHIFT_Q))
+		return 0; // too flat to build tables from, like a blank screen
+	
+	min_Y = (int)tracker.min_Y; max_Y = (int)tracker.max_Y;
+	min_I = (int)tracker.min_I; max_I = (int)tracker.max_I;
+	min_Q = (int)tracker.min_Q; max_Q = (int)tracker.max_Q;
+	
+	build_lookup_tables();
+	
+	return 1;
 }
 
 #define ST_WAIT_NORMAL 0
@@ -321,29 +670,9 @@ void analyze_samples(short * samples, long length) {
 int dumpLine = -1;
 #endif
 
-void extract_color(Uint32 *buffer, short *samples, int dump) {
-	int adj, bestAdj = 0, sum, bestSum = -1000000000; // color waveform adjustment, best fit
-	int start, end, count, Y, I, Q, run_I, run_Q, r, g, b;
-	
-	start_timeprofile(TP_SCANLINE);
-	
-	for(adj = 0; adj < i_wavelength; adj++) { // it's not least squares, but maximum products :)
-		sum = 0;
-		
-		for(count = color_burst_start; count < color_burst_start + color_burst_len; count++)
-			sum += (color_wave1[count - adj] * samples[count]) >> 4; // drop a bit of accuracy
-		
-		if(sum > bestSum) {
-			bestAdj = adj;
-			bestSum = sum;
-		}
-	}
-	
-	// to avoid accessing values beyond the scanline, we'll start a bit before color burst end
-	run_I = run_Q = 0;
-	
-	start = MAX(color_burst_start, MAX(crop_left, wave_before)); // start as late as possible
-	end = MIN(scanline_w - wave_after, crop_left + copy_width); // end as early as possible
+// Reference pixel loop, color components are estimated using running averages
+void color_pixels(Uint32 *buffer, short *samples, int bestAdj, int start, int end, int dump) {
+	int count, Y, I, Q, run_I = 0, run_Q = 0, r, g, b;
 	
 	// count initial running average values
 	for(count = start - wave_before; count < start + wave_after; count++) {
@@ -351,8 +680,6 @@ void extract_color(Uint32 *buffer, short *samples, int dump) {
 		run_Q += samples[count] * color_wave2[count - bestAdj];
 	}
 	
-	start_timeprofile(TP_BURST);
-	
 #ifdef DEBUG	
 	FILE * out;
 	
@@ -364,7 +691,6 @@ void extract_color(Uint32 *buffer, short *samples, int dump) {
 	}
 #endif
 
-	// color components are estimated using running averages
 	for(count = start; count < end; count++) {	
 		run_I += samples[count + wave_after] * color_wave1[count + wave_after - bestAdj];
 		run_Q += samples[count + wave_after] * color_wave2[count + wave_after - bestAdj];
@@ -408,151 +734,2231 @@ void extract_color(Uint32 *buffer, short *samples, int dump) {
 		fclose(out);
 	}
 #endif
+}
+
+// Pixel loops specialised for the color waveform length of the PicoScope
+// timebases of 2 to 64 ns. With the window a compile time constant the loops
+// below get unrolled and the offsets folded into the addressing. Short
+// windows are summed directly, which leaves no dependency from one pixel to
+// the next, longer ones still use running sums. Wave 0 is the generic loop
+// reading i_wavelength at run time.
+#ifndef COLOR_COMP
+#define FIXED_KERNELS
+
+#ifdef __GNUC__
+#define KERNEL_INLINE inline __attribute__((always_inline))
+#else
+#define KERNEL_INLINE inline
+#endif
+
+#define FIXED_DIRECT_WAVE 4 // longest window summed directly, one pixel at a time
+#define KERNEL_DIRECT_WAVE 9 // and in the SIMD kernels, several pixels at a time
 
-	end_timeprofile(TP_BURST);
-	end_timeprofile(TP_SCANLINE);	
+// Turn window sums into a pixel exactly like color_pixels does
+static inline Uint32 color_pixel(int run_I, int run_Q, int Y) {
+	int I, Q, r, g, b;
+	
+	I = ((MAX(MIN(run_I, max_I), min_I) - min_I) >> SHIFT_I) << 2;
+	Q = ((MAX(MIN(run_Q, max_Q), min_Q) - min_Q) >> SHIFT_Q) << 2;
+	Y = (MAX(MIN(Y, max_Y), min_Y) - min_Y) >> SHIFT_Y;
+	
+	r = lookup_Y[Y] + lookup_I[I + 0] + lookup_Q[Q + 0];
+	g = lookup_Y[Y] + lookup_I[I + 1] + lookup_Q[Q + 1];
+	b = lookup_Y[Y] + lookup_I[I + 2] + lookup_Q[Q + 2];
+	
+	return CALC_RGB(MAX(MIN(r, 255), 0), MAX(MIN(g, 255), 0), MAX(MIN(b, 255), 0));
 }
 
-void extract_bw(Uint32 *buffer, short *samples, int dump) {
-	int start, end, count, Y;
+static KERNEL_INLINE void color_pixels_fixed(Uint32 *buffer, short *samples, int adj, int start, int end, const int wave) {
+	const int before = wave / 2, after = wave - before - 1;
+	int *wave1 = color_wave1 - adj, *wave2 = color_wave2 - adj;
+	unsigned int run_I = 0, run_Q = 0;
+	int count, j;
 	
-	start_timeprofile(TP_SCANLINE);
+	if(wave <= FIXED_DIRECT_WAVE) {
+		for(count = start; count < end; count++) {
+			run_I = run_Q = 0;
+			
+			for(j = count - before; j <= count + after; j++) {
+				run_I += (unsigned int)(samples[j] * wave1[j]);
+				run_Q += (unsigned int)(samples[j] * wave2[j]);
+			}
+			
+			buffer[count] = color_pixel((int)run_I, (int)run_Q, samples[count]);
+		}
 		
-	start = MAX(color_burst_start, MAX(crop_left, wave_before)); // start as late as possible
-	end = MIN(scanline_w - wave_after, crop_left + copy_width); // end as early as possible
+		return;
+	}
+	
+	for(count = start - before; count < start + after; count++) {
+		run_I += (unsigned int)(samples[count] * wave1[count]);
+		run_Q += (unsigned int)(samples[count] * wave2[count]);
+	}
 	
-	start_timeprofile(TP_BURST);
+	for(count = start; count < end; count++) {
+		run_I += (unsigned int)(samples[count + after] * wave1[count + after]);
+		run_Q += (unsigned int)(samples[count + after] * wave2[count + after]);
+		
+		buffer[count] = color_pixel((int)run_I, (int)run_Q, samples[count]);
+		
+		run_I -= (unsigned int)(samples[count - before] * wave1[count - before]);
+		run_Q -= (unsigned int)(samples[count - before] * wave2[count - before]);
+	}
+}
 
-	// color components are estimated using running averages
-	for(count = start; count < end; count++) {	
-		Y = samples[count];
+#define FIXED_KERNEL(wave) \
+static void color_pixels_w##wave(Uint32 *buffer, short *samples, int adj, int start, int end) { \
+	color_pixels_fixed(buffer, samples, adj, start, end, wave); \
+}
 
-#ifdef COLOR_COMP
-		Y -= (color_wave1[count - bestAdj] * comp_I[I] + color_wave2[count - bestAdj] * comp_Q[Q]) >> SHIFT_WAVE;
-#endif
+FIXED_KERNEL(140) // 2 ns
+FIXED_KERNEL(70) // 4 ns
+FIXED_KERNEL(35) // 8 ns
+FIXED_KERNEL(17) // 16 ns
+FIXED_KERNEL(9) // 32 ns
+FIXED_KERNEL(4) // 64 ns
 
-		Y = (MAX(MIN(Y, max_Y), min_Y) - min_Y) >> SHIFT_Y; // scale Y
-				
-		Y = MAX(MIN(lookup_Y[Y], 255), 0);
+#endif // COLOR_COMP
 
-		buffer[count] = CALC_RGB(Y, Y, Y);
-	}	
+// SIMD versions of color_pixels. Instead of running sums they take window sums
+// as differences of a running total of sample * wave products, computed in
+// chunks so the totals stay on stack. Output is bit for bit the same as
+// color_pixels, color <ini> -verify checks them against it.
 
-	end_timeprofile(TP_BURST);
-	end_timeprofile(TP_SCANLINE);	
-}
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && !defined(COLOR_COMP)
+#define SIMD_KERNELS
 
-// Extract NTSC field from samples, and determine if it's partial, first, or second field
-// returns the amount of samples processed
-// sets fieldtype to -1 for partial field, 0 for first field and 1 for second field
-int extract_field(SDL_Surface *surface, short * samples, int length, int *field_type, void (*extract_func)(Uint32 *, short *, int)) {
-	Uint32 *buffer;
+#include <immintrin.h>
+
+#define KERNEL_CHUNK 512 // pixels per chunk
+#define KERNEL_MAX_WAVE 256 // longest color waveform supported (2 ns timebase needs 140)
+
+// Window of wave products for the pixel at k, from running totals or for
+// short fixed windows straight from the products
+static inline int window_sum(const unsigned int *sum, int k, const int wave, const int direct) {
+	unsigned int total = 0;
+	int j;
 	
-	int line = 0, offset, scanline_start = 0, longs = 0;
-	int state = ST_WAIT_NORMAL;
-	int is_sync = 0, count = 0, is_transition = 0;
+	if(!direct)
+		return (int)(sum[k + wave] - sum[k]);
+	
+	for(j = 1; j <= wave; j++)
+		total += sum[k + j];
+	
+	return (int)total;
+}
 
-	if(min_I == max_I || min_Q == max_Q)
-		return -1; // TODO: Run B/W if no I/Q variance
+// Turn products at sum[1..n] into running totals starting from sum[0] = 0.
+// Unsigned arithmetic wraps, but window sums taken as differences stay exact.
+static inline void running_totals(unsigned int *sum_I, unsigned int *sum_Q, int n) {
+	int k;
 	
-	if ( SDL_LockSurface(surface) < 0 ) {
-		fprintf(stderr, "Couldn't lock the display surface: %s\n",
-				SDL_GetError());
-		quit(2);
+	sum_I[0] = sum_Q[0] = 0;
+	
+	for(k = 1; k <= n; k++) {
+		sum_I[k] += sum_I[k - 1];
+		sum_Q[k] += sum_Q[k - 1];
 	}
+}
+
+// Two pixels from the packed table, lanes saturate to 0..255 in the final pack
+#define PACKED_PAIR(Y0, I0, Q0, Y1, I1, Q1) \
+	_mm_add_epi16(_mm_set_epi64x(lookup_packed[Y1], lookup_packed[Y0]), \
+		_mm_add_epi16(_mm_set_epi64x(lookup_IQ[I1], lookup_IQ[I0]), _mm_set_epi64x(lookup_IQ[Q1], lookup_IQ[Q0])))
+
+// packed and wave are constants in the wrappers below, so each gets its own loop
+__attribute__((target("sse4.1"), always_inline))
+static inline void color_pixels_sse41_body(Uint32 *buffer, short *samples, int adj, int start, int end, const int packed, const int wave) {
+	unsigned int sum_I[KERNEL_CHUNK + KERNEL_MAX_WAVE], sum_Q[KERNEL_CHUNK + KERNEL_MAX_WAVE];
+	const int length = wave ? wave : i_wavelength, direct = wave && wave <= KERNEL_DIRECT_WAVE;
+	int c0, c1, first, n, k, c, j;
+	int Y[4], I[4], Q[4], r[4], g[4], b[4];
+	__m128i s, run_I, run_Q, v;
+	__m128i lo_I = _mm_set1_epi32(min_I), hi_I = _mm_set1_epi32(max_I);
+	__m128i lo_Q = _mm_set1_epi32(min_Q), hi_Q = _mm_set1_epi32(max_Q);
+	__m128i lo_Y = _mm_set1_epi32(min_Y), hi_Y = _mm_set1_epi32(max_Y);
+	__m128i zero = _mm_setzero_si128(), full = _mm_set1_epi32(255);
 	
-	buffer=(Uint32 *)surface->pixels;
+	for(c0 = start; c0 < end; c0 = c1) {
+		c1 = MIN(c0 + KERNEL_CHUNK, end);
+		first = c0 - length / 2;
+		n = c1 - c0 + length - 1; // products needed for the chunk
 		
-	// loop through data
-	for(offset=0; offset < length; offset++) {
-		// set is_sync, is_transition
-		if(samples[offset] <= treshold) { // low
-			is_transition = is_sync ? 0 : 1;
-			is_sync = 1;
-		} else { // high
-			is_transition = is_sync ? 1 : 0;
-			is_sync = 0;
+		for(k = 0; k + 4 <= n; k += 4) {
+			s = _mm_cvtepi16_epi32(_mm_loadl_epi64((__m128i *)(samples + first + k)));
+			v = _mm_loadu_si128((__m128i *)(color_wave1 + first + k - adj));
+			_mm_storeu_si128((__m128i *)(sum_I + k + 1), _mm_mullo_epi32(s, v));
+			v = _mm_loadu_si128((__m128i *)(color_wave2 + first + k - adj));
+			_mm_storeu_si128((__m128i *)(sum_Q + k + 1), _mm_mullo_epi32(s, v));
 		}
-		
-		if(!is_transition) { // only handle state changes on transitions
-			count++;
-			continue;
+		for(; k < n; k++) {
+			sum_I[k + 1] = (unsigned int)(samples[first + k] * color_wave1[first + k - adj]);
+			sum_Q[k + 1] = (unsigned int)(samples[first + k] * color_wave2[first + k - adj]);
 		}
-			
-		switch(state) {
+		
+		if(!direct)
+			running_totals(sum_I, sum_Q, n);
+		
+		for(c = c0; c + 4 <= c1; c += 4) {
+			k = c - c0;
+			if(direct) {
+				run_I = _mm_loadu_si128((__m128i *)(sum_I + k + 1));
+				run_Q = _mm_loadu_si128((__m128i *)(sum_Q + k + 1));
+				
+				for(j = 2; j <= wave; j++) {
+					run_I = _mm_add_epi32(run_I, _mm_loadu_si128((__m128i *)(sum_I + k + j)));
+					run_Q = _mm_add_epi32(run_Q, _mm_loadu_si128((__m128i *)(sum_Q + k + j)));
+				}
+			} else {
+				run_I = _mm_sub_epi32(_mm_loadu_si128((__m128i *)(sum_I + k + length)), _mm_loadu_si128((__m128i *)(sum_I + k)));
+				run_Q = _mm_sub_epi32(_mm_loadu_si128((__m128i *)(sum_Q + k + length)), _mm_loadu_si128((__m128i *)(sum_Q + k)));
+			}
+			s = _mm_cvtepi16_epi32(_mm_loadl_epi64((__m128i *)(samples + c)));
+			
+			run_I = _mm_srli_epi32(_mm_sub_epi32(_mm_max_epi32(_mm_min_epi32(run_I, hi_I), lo_I), lo_I), SHIFT_I);
+			run_Q = _mm_srli_epi32(_mm_sub_epi32(_mm_max_epi32(_mm_min_epi32(run_Q, hi_Q), lo_Q), lo_Q), SHIFT_Q);
+			s = _mm_srli_epi32(_mm_sub_epi32(_mm_max_epi32(_mm_min_epi32(s, hi_Y), lo_Y), lo_Y), SHIFT_Y);
+			
+			if(packed) {
+				_mm_storeu_si128((__m128i *)I, _mm_slli_epi32(run_I, 1));
+				_mm_storeu_si128((__m128i *)Q, _mm_add_epi32(_mm_slli_epi32(run_Q, 1), _mm_set1_epi32(1)));
+				_mm_storeu_si128((__m128i *)Y, s);
+				
+				v = _mm_packus_epi16(PACKED_PAIR(Y[0], I[0], Q[0], Y[1], I[1], Q[1]), PACKED_PAIR(Y[2], I[2], Q[2], Y[3], I[3], Q[3]));
+				_mm_storeu_si128((__m128i *)(buffer + c), v);
+				continue;
+			}
+			
+			_mm_storeu_si128((__m128i *)I, _mm_slli_epi32(run_I, 2));
+			_mm_storeu_si128((__m128i *)Q, _mm_slli_epi32(run_Q, 2));
+			_mm_storeu_si128((__m128i *)Y, s);
+			
+			for(j = 0; j < 4; j++) { // no gathers before AVX2
+				r[j] = lookup_Y[Y[j]] + lookup_I[I[j] + 0] + lookup_Q[Q[j] + 0];
+				g[j] = lookup_Y[Y[j]] + lookup_I[I[j] + 1] + lookup_Q[Q[j] + 1];
+				b[j] = lookup_Y[Y[j]] + lookup_I[I[j] + 2] + lookup_Q[Q[j] + 2];
+			}
+			
+			v = _mm_slli_epi32(_mm_max_epi32(_mm_min_epi32(_mm_loadu_si128((__m128i *)r), full), zero), 16);
+			v = _mm_or_si128(v, _mm_slli_epi32(_mm_max_epi32(_mm_min_epi32(_mm_loadu_si128((__m128i *)g), full), zero), 8));
+			v = _mm_or_si128(v, _mm_max_epi32(_mm_min_epi32(_mm_loadu_si128((__m128i *)b), full), zero));
+			_mm_storeu_si128((__m128i *)(buffer + c), v);
+		}
+		for(; c < c1; c++) {
+			k = c - c0;
+			buffer[c] = color_pixel(window_sum(sum_I, k, length, direct), window_sum(sum_Q, k, length, direct), samples[c]);
+		}
+	}
+}
+
+// Plain and packed lookup kernels for a window of wave samples
+#define SIMD_KERNEL(isa, target_isa, wave) \
+__attribute__((target(target_isa))) \
+static void color_pixels_##isa##_w##wave(Uint32 *buffer, short *samples, int adj, int start, int end) { \
+	color_pixels_##isa##_body(buffer, samples, adj, start, end, 0, wave); \
+} \
+__attribute__((target(target_isa))) \
+static void color_pixels_##isa##_packed_w##wave(Uint32 *buffer, short *samples, int adj, int start, int end) { \
+	color_pixels_##isa##_body(buffer, samples, adj, start, end, 1, wave); \
+}
+
+SIMD_KERNEL(sse41, "sse4.1", 140)
+SIMD_KERNEL(sse41, "sse4.1", 70)
+SIMD_KERNEL(sse41, "sse4.1", 35)
+SIMD_KERNEL(sse41, "sse4.1", 17)
+SIMD_KERNEL(sse41, "sse4.1", 9)
+SIMD_KERNEL(sse41, "sse4.1", 4)
+SIMD_KERNEL(sse41, "sse4.1", 0)
+
+// Four pixels from the packed table with 64-bit gathers, index is 4 x 32 bits
+#define PACKED_QUAD(Y, I, Q) \
+	_mm256_add_epi16(_mm256_i32gather_epi64(lookup_packed, Y, 8), \
+		_mm256_add_epi16(_mm256_i32gather_epi64(lookup_IQ, I, 8), _mm256_i32gather_epi64(lookup_IQ, Q, 8)))
+
+__attribute__((target("avx2"), always_inline))
+static inline void color_pixels_avx2_body(Uint32 *buffer, short *samples, int adj, int start, int end, const int packed, const int wave) {
+	unsigned int sum_I[KERNEL_CHUNK + KERNEL_MAX_WAVE], sum_Q[KERNEL_CHUNK + KERNEL_MAX_WAVE];
+	const int length = wave ? wave : i_wavelength, direct = wave && wave <= KERNEL_DIRECT_WAVE;
+	int c0, c1, first, n, k, c, j;
+	__m256i s, run_I, run_Q, v, y, r, g, b;
+	__m256i lo_I = _mm256_set1_epi32(min_I), hi_I = _mm256_set1_epi32(max_I);
+	__m256i lo_Q = _mm256_set1_epi32(min_Q), hi_Q = _mm256_set1_epi32(max_Q);
+	__m256i lo_Y = _mm256_set1_epi32(min_Y), hi_Y = _mm256_set1_epi32(max_Y);
+	__m256i zero = _mm256_setzero_si256(), full = _mm256_set1_epi32(255);
+	
+	for(c0 = start; c0 < end; c0 = c1) {
+		c1 = MIN(c0 + KERNEL_CHUNK, end);
+		first = c0 - length / 2;
+		n = c1 - c0 + length - 1; // products needed for the chunk
+		
+		for(k = 0; k + 8 <= n; k += 8) {
+			s = _mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *)(samples + first + k)));
+			v = _mm256_loadu_si256((__m256i *)(color_wave1 + first + k - adj));
+			_mm256_storeu_si256((__m256i *)(sum_I + k + 1), _mm256_mullo_epi32(s, v));
+			v = _mm256_loadu_si256((__m256i *)(color_wave2 + first + k - adj));
+			_mm256_storeu_si256((__m256i *)(sum_Q + k + 1), _mm256_mullo_epi32(s, v));
+		}
+		for(; k < n; k++) {
+			sum_I[k + 1] = (unsigned int)(samples[first + k] * color_wave1[first + k - adj]);
+			sum_Q[k + 1] = (unsigned int)(samples[first + k] * color_wave2[first + k - adj]);
+		}
+		
+		if(!direct)
+			running_totals(sum_I, sum_Q, n);
+		
+		for(c = c0; c + 8 <= c1; c += 8) {
+			k = c - c0;
+			if(direct) {
+				run_I = _mm256_loadu_si256((__m256i *)(sum_I + k + 1));
+				run_Q = _mm256_loadu_si256((__m256i *)(sum_Q + k + 1));
+				
+				for(j = 2; j <= wave; j++) {
+					run_I = _mm256_add_epi32(run_I, _mm256_loadu_si256((__m256i *)(sum_I + k + j)));
+					run_Q = _mm256_add_epi32(run_Q, _mm256_loadu_si256((__m256i *)(sum_Q + k + j)));
+				}
+			} else {
+				run_I = _mm256_sub_epi32(_mm256_loadu_si256((__m256i *)(sum_I + k + length)), _mm256_loadu_si256((__m256i *)(sum_I + k)));
+				run_Q = _mm256_sub_epi32(_mm256_loadu_si256((__m256i *)(sum_Q + k + length)), _mm256_loadu_si256((__m256i *)(sum_Q + k)));
+			}
+			s = _mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *)(samples + c)));
+			
+			run_I = _mm256_srli_epi32(_mm256_sub_epi32(_mm256_max_epi32(_mm256_min_epi32(run_I, hi_I), lo_I), lo_I), SHIFT_I);
+			run_Q = _mm256_srli_epi32(_mm256_sub_epi32(_mm256_max_epi32(_mm256_min_epi32(run_Q, hi_Q), lo_Q), lo_Q), SHIFT_Q);
+			s = _mm256_srli_epi32(_mm256_sub_epi32(_mm256_max_epi32(_mm256_min_epi32(s, hi_Y), lo_Y), lo_Y), SHIFT_Y);
+			
+			if(packed) {
+				run_I = _mm256_slli_epi32(run_I, 1);
+				run_Q = _mm256_add_epi32(_mm256_slli_epi32(run_Q, 1), _mm256_set1_epi32(1));
+				
+				// pack works within 128-bit halves, leaving pixels in order 0 1 4 5 2 3 6 7
+				r = PACKED_QUAD(_mm256_castsi256_si128(s), _mm256_castsi256_si128(run_I), _mm256_castsi256_si128(run_Q));
+				g = PACKED_QUAD(_mm256_extracti128_si256(s, 1), _mm256_extracti128_si256(run_I, 1), _mm256_extracti128_si256(run_Q, 1));
+				v = _mm256_permute4x64_epi64(_mm256_packus_epi16(r, g), _MM_SHUFFLE(3, 1, 2, 0));
+				_mm256_storeu_si256((__m256i *)(buffer + c), v);
+				continue;
+			}
+			
+			run_I = _mm256_slli_epi32(run_I, 2);
+			run_Q = _mm256_slli_epi32(run_Q, 2);
+			
+			y = _mm256_i32gather_epi32(lookup_Y, s, 4);
+			r = _mm256_add_epi32(y, _mm256_add_epi32(_mm256_i32gather_epi32(lookup_I, run_I, 4), _mm256_i32gather_epi32(lookup_Q, run_Q, 4)));
+			g = _mm256_add_epi32(y, _mm256_add_epi32(_mm256_i32gather_epi32(lookup_I + 1, run_I, 4), _mm256_i32gather_epi32(lookup_Q + 1, run_Q, 4)));
+			b = _mm256_add_epi32(y, _mm256_add_epi32(_mm256_i32gather_epi32(lookup_I + 2, run_I, 4), _mm256_i32gather_epi32(lookup_Q + 2, run_Q, 4)));
+			
+			v = _mm256_slli_epi32(_mm256_max_epi32(_mm256_min_epi32(r, full), zero), 16);
+			v = _mm256_or_si256(v, _mm256_slli_epi32(_mm256_max_epi32(_mm256_min_epi32(g, full), zero), 8));
+			v = _mm256_or_si256(v, _mm256_max_epi32(_mm256_min_epi32(b, full), zero));
+			_mm256_storeu_si256((__m256i *)(buffer + c), v);
+		}
+		for(; c < c1; c++) {
+			k = c - c0;
+			buffer[c] = color_pixel(window_sum(sum_I, k, length, direct), window_sum(sum_Q, k, length, direct), samples[c]);
+		}
+	}
+}
+
+SIMD_KERNEL(avx2, "avx2", 140)
+SIMD_KERNEL(avx2, "avx2", 70)
+SIMD_KERNEL(avx2, "avx2", 35)
+SIMD_KERNEL(avx2, "avx2", 17)
+SIMD_KERNEL(avx2, "avx2", 9)
+SIMD_KERNEL(avx2, "avx2", 4)
+SIMD_KERNEL(avx2, "avx2", 0)
+
+#endif // SIMD_KERNELS
+
+typedef void (*color_kernel_func)(Uint32 *buffer, short *samples, int adj, int start, int end);
+
+// Pixel loops built for one window length, wave 0 for any
+typedef struct {
+	int wave;
+	color_kernel_func plain, packed; // packed is NULL if there's no packed lookup version
+} kernel_set;
+
+#define KERNEL_SET(name, wave) { wave, &name##_w##wave, NULL }
+#define SIMD_KERNEL_SET(isa, wave) { wave, &color_pixels_##isa##_w##wave, &color_pixels_##isa##_packed_w##wave }
+
+#ifdef FIXED_KERNELS
+static const kernel_set scalar_kernels[] = {
+	KERNEL_SET(color_pixels, 140), KERNEL_SET(color_pixels, 70), KERNEL_SET(color_pixels, 35),
+	KERNEL_SET(color_pixels, 17), KERNEL_SET(color_pixels, 9), KERNEL_SET(color_pixels, 4),
+	{ 0, NULL, NULL } // reference color_pixels
+};
+#endif
+
+#ifdef SIMD_KERNELS
+static const kernel_set sse41_kernels[] = {
+	SIMD_KERNEL_SET(sse41, 140), SIMD_KERNEL_SET(sse41, 70), SIMD_KERNEL_SET(sse41, 35),
+	SIMD_KERNEL_SET(sse41, 17), SIMD_KERNEL_SET(sse41, 9), SIMD_KERNEL_SET(sse41, 4),
+	SIMD_KERNEL_SET(sse41, 0)
+};
+
+static const kernel_set avx2_kernels[] = {
+	SIMD_KERNEL_SET(avx2, 140), SIMD_KERNEL_SET(avx2, 70), SIMD_KERNEL_SET(avx2, 35),
+	SIMD_KERNEL_SET(avx2, 17), SIMD_KERNEL_SET(avx2, 9), SIMD_KERNEL_SET(avx2, 4),
+	SIMD_KERNEL_SET(avx2, 0)
+};
+#endif
+
+// Kernels for the current i_wavelength, or the generic ones ending the list
+static const kernel_set * pick_kernels(const kernel_set *sets, int fixed) {
+	while(sets->wave != 0 && (!fixed || sets->wave != i_wavelength))
+		sets++;
+	
+	return sets;
+}
+
+// Pixel loop in use, NULL for the reference color_pixels
+color_kernel_func color_kernel = NULL;
+
+// Pick the fastest pixel loop this CPU supports, setting simd = 0 disables
+// the SIMD ones and fixed_kernels = 0 the ones built for a single timebase.
+// Depends on i_wavelength, so call after calculate_parameters.
+void init_color_kernel() {
+	int packed = get_setting_or("packed_lookup", 1); // one interleaved table instead of three
+	int fixed = get_setting_or("fixed_kernels", 1);
+	const kernel_set *set = NULL;
+	const char *isa = "scalar";
+	
+	burst_lock = get_setting_or("burst_lock", 1);
+	
+	color_kernel = NULL;
+	
+#ifdef FIXED_KERNELS
+	set = pick_kernels(scalar_kernels, fixed);
+#endif
+	
+#ifdef SIMD_KERNELS
+	if(get_setting_or("simd", 1) && i_wavelength <= KERNEL_MAX_WAVE) {
+		__builtin_cpu_init();
+		
+		if(__builtin_cpu_supports("avx2")) {
+			set = pick_kernels(avx2_kernels, fixed);
+			isa = "AVX2";
+		} else if(__builtin_cpu_supports("sse4.1")) {
+			set = pick_kernels(sse41_kernels, fixed);
+			isa = "SSE4.1";
+		}
+	}
+#endif
+	
+	if(set != NULL)
+		color_kernel = packed && set->packed != NULL ? set->packed : set->plain;
+	
+	if(set != NULL && set->wave)
+		printf("Color kernel: %s%s, %d sample window\n", isa, color_kernel == set->packed ? ", packed lookup" : "", set->wave);
+	else
+		printf("Color kernel: %s%s\n", isa, set != NULL && color_kernel != NULL && color_kernel == set->packed ? ", packed lookup" : "");
+	
+	printf("Sync slicer: %s\n", slicer_setup(get_setting_or("simd", 1)));
+	printf("Level histogram: %s\n", level_hist_setup(get_setting_or("simd", 1)));
+	printf("Capture decompression: %s\n", capz_setup(get_setting_or("simd", 1)));
+}
+
+// Rebuild the resampler after the crop has changed. Called between fields,
+// when no scanline is being decoded with it.
+static void update_scaler() {
+	if(out_width <= 0 || (scaler.in_width == copy_width && scaler.out_width == out_width))
+		return;
+	
+	resampler_free(&scaler);
+	if(resampler_init(&scaler, copy_width, out_width)) {
+		out_width = 0; // back to full rate fields
+		return;
+	}
+	
+	printf("Resampler: %d to %d pixels, %d taps, %s\n", copy_width, out_width, scaler.taps, 
+		resample_setup(get_setting_or("simd", 1)));
+}
+
+// Follow the decoded width, also between fields
+static void update_denoiser() {
+	if(field_denoise.shift > 0 && denoise_resize(&field_denoise, out_width > 0 ? out_width : copy_width, 252))
+		field_denoise.shift = 0; // out of memory, decode without
+}
+
+// Averaging fields is set with denoise = n for 2^n fields of the same
+// parity, 0 to turn it off. Where a pixel changes by more than
+// denoise_threshold (0..255) the average starts over.
+static void init_denoiser() {
+	int shift = get_setting_or("denoise", 0);
+	
+	if(shift <= 0 || denoise_init(&field_denoise, shift, get_setting_or("denoise_threshold", 24)))
+		return;
+	
+	printf("Noise reduction: %d field average, %s\n", 1 << shift, denoise_setup(get_setting_or("simd", 1)));
+}
+
+// Decode the cropped scanline straight to scaler.out_width pixels. Each run
+// of outputs is filtered from a chunk of full rate pixels decoded into a
+// buffer that stays in L1, so the whole scanline is never stored. Pixels
+// outside start..end can't be decoded and are black.
+static void resample_scanline(Uint32 *row, short *samples, int adj, int start, int end, int dump,
+		void (*span_func)(Uint32 *, short *, int, int, int, int)) {
+	Uint32 chunk[RESAMPLE_CHUNK];
+	int from, to, first, last, lo, hi, i;
+	
+	for(from = 0; from < scaler.out_width; from = to) {
+		to = resample_run(&scaler, from, &first, &last);
+		
+		// input pixel i is sample crop_left + i of the scanline
+		lo = MIN(MAX(first + crop_left, start), last + crop_left);
+		hi = MAX(MIN(last + crop_left, end), lo);
+		
+		for(i = first + crop_left; i < lo; i++)
+			chunk[i - crop_left - first] = 0;
+		for(i = hi; i < last + crop_left; i++)
+			chunk[i - crop_left - first] = 0;
+		
+		if(lo < hi)
+			span_func(chunk - crop_left - first, samples, adj, lo, hi, dump);
+		
+		resample_line(&scaler, row, chunk - first, from, to);
+	}
+}
+
+// Pixels start..end of a scanline, samples indexing buffer one to one
+static void color_span(Uint32 *buffer, short *samples, int bestAdj, int start, int end, int dump) {
+	if(color_kernel != NULL && !dump)
+		color_kernel(buffer, samples, bestAdj, start, end);
+	else
+		color_pixels(buffer, samples, bestAdj, start, end, dump);
+}
+
+// Decode a scanline with color waveform adjustment bestAdj, or if it's
+// negative, with the adjustment fitted to the burst of this scanline alone
+void extract_color(Uint32 *buffer, short *samples, int bestAdj, int dump) {
+	int start, end;
+	
+	if(bestAdj < 0)
+		bestAdj = burst_adjustment(samples);
+	
+	// to avoid accessing values beyond the scanline, we'll start a bit before color burst end
+	start = MAX(color_burst_start, MAX(crop_left, wave_before)); // start as late as possible
+	end = MIN(scanline_w - wave_after, crop_left + copy_width); // end as early as possible
+	
+	if(scaler.out_width > 0)
+		resample_scanline(buffer, samples, bestAdj, start, end, dump, &color_span);
+	else
+		color_span(buffer, samples, bestAdj, start, end, dump);
+}
+
+static void bw_span(Uint32 *buffer, short *samples, int bestAdj, int start, int end, int dump) {
+	int count, Y;
+	
+	// color components are estimated using running averages
+	for(count = start; count < end; count++) {	
+		Y = samples[count];
+
+#ifdef COLOR_COMP
+		Y -= (color_wave1[count - bestAdj] * comp_I[I] + color_wave2[count - bestAdj] * comp_Q[Q]) >> SHIFT_WAVE;
+#endif
+
+		Y = (MAX(MIN(Y, max_Y), min_Y) - min_Y) >> SHIFT_Y; // scale Y
+				
+		Y = MAX(MIN(lookup_Y[Y], 255), 0);
+
+		buffer[count] = CALC_RGB(Y, Y, Y);
+	}	
+}
+
+void extract_bw(Uint32 *buffer, short *samples, int bestAdj, int dump) {
+	int start, end;
+	
+	start = MAX(color_burst_start, MAX(crop_left, wave_before)); // start as late as possible
+	end = MIN(scanline_w - wave_after, crop_left + copy_width); // end as early as possible
+	
+	if(scaler.out_width > 0)
+		resample_scanline(buffer, samples, bestAdj, start, end, dump, &bw_span);
+	else
+		bw_span(buffer, samples, bestAdj, start, end, dump);
+}
+
+// Scanline found by the sync pass of extract_field
+typedef struct {
+	int line; // row in the field surface
+	int start; // offset of HSYNC start in samples
+	int adj; // color waveform adjustment from track_burst
+	int dump;
+} scanline_pos;
+
+typedef struct {
+	Uint32 *buffer;
+	int pitch; // in pixels
+	int left; // first decoded pixel of a row
+	int field_num;
+	short *samples;
+	scanline_pos *lines;
+	void (*extract_func)(Uint32 *, short *, int, int);
+} field_job;
+
+threadpool *decode_pool = NULL; // NULL decodes scanlines on the calling thread
+
+static void decode_scanline(void *context, int index) {
+	field_job *job = (field_job *)context;
+	scanline_pos *pos = job->lines + index;
+	stats_time started = stats_now();
+	
+	job->extract_func(job->buffer + pos->line * job->pitch, job->samples + pos->start, pos->adj, pos->dump);
+	
+	if(field_denoise.shift > 0) // while the row is still in the cache
+		denoise_line(&field_denoise, job->buffer + pos->line * job->pitch + job->left, job->field_num, pos->line);
+	
+	stats_record(TP_LINE, started); // runs on the pool threads, each has its own histogram
+}
+
+// Color waveform adjustments of the scanlines of a field, in order so that
+// the phase lock can follow the subcarrier from one scanline to the next.
+// color <ini> -verify checks them against trying every adjustment.
+static void track_burst(short *samples, scanline_pos *lines, int count) {
+	burst_tracker bt;
+	stats_time started = stats_now();
+	int i;
+	
+	bt.locked = 0;
+	
+	for(i = 0; i < count; i++)
+		lines[i].adj = track_burst_line(&bt, samples, lines[i].start);
+	
+	stats_record(TP_BURST, started);
+}
+
+// Pixel pass of extract_field: every scanline is decoded independently, so
+// they can be spread over the decode pool in any order
+void decode_scanlines(SDL_Surface *surface, short *samples, scanline_pos *lines, int count, int field_num,
+		void (*extract_func)(Uint32 *, short *, int, int)) {
+	field_job job;
+	stats_time started = stats_now();
+	int i;
+	
+	update_scaler();
+	update_denoiser();
+	
+	job.buffer = (Uint32 *)surface->pixels;
+	job.pitch = surface->pitch / 4;
+	job.left = out_width > 0 ? 0 : crop_left;
+	job.field_num = field_num;
+	job.samples = samples;
+	job.lines = lines;
+	job.extract_func = extract_func;
+	
+	if(extract_func == &extract_color && burst_lock)
+		track_burst(samples, lines, count);
+	else // each scanline searches its own burst
+		for(i = 0; i < count; i++)
+			lines[i].adj = -1;
+	
+	if(decode_pool != NULL)
+		pool_run(decode_pool, &decode_scanline, &job, count);
+	else
+		for(i = 0; i < count; i++)
+			decode_scanline(&job, i);
+	
+	if(field_denoise.shift > 0)
+		denoise_field_done(&field_denoise, field_num);
+	
+	stats_record(TP_SCANLINE, started);
+}
+
+// Sync pass of a field: the state machine jumps from edge to edge and
+// collects the scanlines of the field. All of its state is kept here, so
+// it can stop where the samples run out and go on when more arrive.
+typedef struct {
+	int state, line, longs, found;
+	int begin; // offset where the field's samples start
+	int previous; // offset of the last transition, -1 before the first one
+	int scanline_start;
+	int field_start; // offset of scanline 0
+	int count; // samples between the last two transitions
+	int scanned; // samples already sliced
+	int is_sync; // level at scanned
+	scanline_pos lines[252];
+} field_sync;
+
+// Start looking for a field from offset, in state
+static void sync_reset(field_sync *fs, int offset, int state, int longs) {
+	fs->state = state;
+	fs->longs = longs;
+	fs->line = fs->found = fs->scanline_start = 0;
+	fs->begin = fs->scanned = offset;
+	fs->previous = offset - 1;
+	fs->is_sync = 0;
+}
+
+// Go on with the next field from the VSYNC at offset that ended the last one.
+// Its first short period has been seen already, so that is where the state
+// machine continues, without slicing any sample twice.
+static void sync_next(field_sync *fs, int offset) {
+	sync_reset(fs, offset, ST_COUNT_LONGS, (fs->count > long_high) ? 1 : 0);
+	fs->previous = offset;
+	fs->is_sync = 1;
+}
+
+// Move the samples of the field in progress from offset to the start of a
+// new buffer
+static void sync_rebase(field_sync *fs, int offset) {
+	int i;
+	
+	fs->begin = MAX(fs->begin - offset, 0);
+	fs->previous -= offset;
+	fs->scanline_start -= offset;
+	fs->field_start -= offset;
+	fs->scanned -= offset;
+	for(i = 0; i < fs->found; i++)
+		fs->lines[i].start -= offset;
+}
+
+// Run the sync pass over samples[fs->scanned..length). Returns the offset of
+// the VSYNC that ends the field and sets *field_type to 0 or 1 for a first or
+// second field and to -1 for a partial one. When the samples run out first it
+// returns length with *field_type -1, and can be called again with more.
+static int sync_field(field_sync *fs, short *samples, int length, int *field_type) {
+	sync_slicer slicer;
+	int offset, is_sync, count;
+	
+	slicer_init(&slicer, samples, fs->scanned, length, treshold, fs->is_sync);
+	
+	while((offset = slicer_next(&slicer)) < length) {
+		is_sync = slicer.is_sync;
+		count = offset - fs->previous - 1; // samples since the last transition
+		fs->previous = offset;
+		fs->count = count;
+		
+		switch(fs->state) {
 		case ST_WAIT_NORMAL:
 			if(is_sync && count > screen_width) // start hsync, last scanline was normal
-				state++;
+				fs->state++;
 			break;
 		case ST_WAIT_BLANK:
 			if(is_sync && count < screen_width) { // first vsync period
-				state++;
-				longs = (count > long_high) ? 1 : 0; // should always be 1
+				fs->state++;
+				fs->longs = (count > long_high) ? 1 : 0; // should always be 1
 			}
 			break;
 		case ST_COUNT_LONGS:
 			if(is_sync) {
 				if(count > long_high) // another long
-					longs++;
+					fs->longs++;
 				else // longs counted
-					state++;
+					fs->state++;
 			}
 			break;
 		case ST_WAIT_NON_BLANK:
-			if(is_sync && count > screen_width) // start hsync, last scanline was normal
-				state++;
+			if(is_sync && count > screen_width) { // start hsync, last scanline was normal
+				fs->state++;
+				fs->scanline_start = fs->field_start = offset; // of line 0
+			}
 			break;
 		case ST_DRAW:
 			if(is_sync) { // start hsync
 				if(count < screen_width) { // start vsync
-					if(line < 252) { // not enough scanlines - partial field
-						SDL_UnlockSurface(surface);
+					fs->scanned = offset;
+					fs->is_sync = is_sync;
+					
+					if(fs->line < 252) // not enough scanlines - partial field
 						*field_type = -1;
-						return offset;
-					} else {
-						SDL_UnlockSurface(surface);
-						*field_type = (longs == 7) ? 0 : 1; // determine field number
-						return offset;
+					else
+						*field_type = (fs->longs == 7) ? 0 : 1; // determine field number
+					return offset;
+				} else { // next scanline
+					fs->line++;
+					fs->scanline_start = offset;
+				}
+			} else { // end hsync
+				if(fs->line >= crop_top && fs->line < 252-crop_bottom && fs->found < 252) {
+					fs->lines[fs->found].line = fs->line;
+					fs->lines[fs->found].start = fs->scanline_start;
+					fs->lines[fs->found].dump = 0;
+#ifdef DEBUG
+					if(fs->line == dumpLine) {
+						fs->lines[fs->found].dump = 1;
+						dumpLine = -1; // mark the line as printed
+					}
+#endif
+					fs->found++;
+				}
+			}
+			break;
+		}
+	}
+	
+	fs->scanned = length;
+	fs->is_sync = slicer.is_sync;
+	*field_type = -1;
+	
+	return length; // data ran out
+}
+
+// Pixel pass of a field found by sync_field, scanlines running past the
+// samples are left out
+static void decode_field(SDL_Surface *surface, short *samples, int length, field_sync *fs, int field_num,
+		void (*extract_func)(Uint32 *, short *, int, int)) {
+	int found = fs->found;
+	
+	while(found > 0 && fs->lines[found - 1].start + scanline_w >= length)
+		found--;
+	
+	if ( SDL_LockSurface(surface) < 0 ) {
+		fprintf(stderr, "Couldn't lock the display surface: %s\n",
+				SDL_GetError());
+		quit(2);
+	}
+	
+	decode_scanlines(surface, samples, fs->lines, found, field_num, extract_func);
+	
+	SDL_UnlockSurface(surface);
+}
+
+// Extract NTSC field from samples, and determine if it's partial, first, or second field
+// returns the amount of samples processed
+// sets fieldtype to -1 for partial field, 0 for first field and 1 for second field
+int extract_field(SDL_Surface *surface, short * samples, int length, int *field_type, void (*extract_func)(Uint32 *, short *, int, int)) {
+	field_sync fs;
+	int offset;
+	
+	if(min_I == max_I || min_Q == max_Q)
+		return -1; // TODO: Run B/W if no I/Q variance
+	
+	sync_reset(&fs, 0, ST_WAIT_NORMAL, 0);
+	offset = sync_field(&fs, samples, length, field_type);
+	
+	if(*field_type != -1)
+		decode_field(surface, samples, length, &fs, *field_type, extract_func);
+	
+	return offset;
+}
+
+// Decode field n of a scanline index without running the sync state machine,
+// samples point to the first scanline of the field and hold length samples
+void decode_indexed_field(SDL_Surface *surface, short *samples, long long length, scanidx *idx, int n,
+		void (*extract_func)(Uint32 *, short *, int, int)) {
+	scanline_pos lines[252];
+	unsigned int *start = idx->line + idx->field[n].first_line;
+	int line, found = 0;
+	
+	for(line = crop_top; line < 252-crop_bottom && line < idx->field[n].lines; line++) {
+		if(start[line] + scanline_w >= length)
+			break; // capture ends
+		
+		lines[found].line = line;
+		lines[found].start = start[line];
+		lines[found].dump = 0;
+		found++;
+	}
+	
+	if ( SDL_LockSurface(surface) < 0 ) {
+		fprintf(stderr, "Couldn't lock the display surface: %s\n",
+				SDL_GetError());
+		quit(2);
+	}
+	
+	decode_scanlines(surface, samples, lines, found, idx->field[n].type, extract_func);
+	
+	SDL_UnlockSurface(surface);
+}
+
+// Start the scanline decoding threads, setting threads = 0 uses all processors
+void init_decode_pool() {
+	int threads = get_setting_or("threads", 0);
+	
+	if(threads != 1)
+		decode_pool = pool_create(threads);
+	
+	printf("Decoding scanlines with %d threads\n", decode_pool != NULL ? pool_threads(decode_pool) : 1);
+}
+
+// Name the stages and counters shown in statistics snapshots
+void init_stats() {
+	stats_init();
+	
+	stats_stage(TP_FRAME, "frame");
+	stats_stage(TP_PICO, "capture");
+	stats_stage(TP_FIELD, "field");
+	stats_stage(TP_SCANLINE, "scanlines");
+	stats_stage(TP_LINE, "scanline");
+	stats_stage(TP_DRAW, "draw");
+	stats_stage(TP_BURST, "burst");
+	stats_stage(TP_PRESENT, "present"); // from a finished field to the screen
+	
+	stats_counter(CT_BLOCKS, "blocks");
+	stats_counter(CT_FAILED, "failed_captures");
+	stats_counter(CT_FIELDS, "fields");
+	stats_counter(CT_PARTIAL, "partial_fields");
+	stats_counter(CT_SHOWN, "shown_fields");
+	stats_counter(CT_DROPPED, "dropped_fields");
+	stats_counter(CT_REBUILDS, "table_rebuilds");
+	stats_counter(CT_UNWRITTEN, "unwritten_frames");
+}
+
+// Write a statistics snapshot to dir, as JSON or with stats_format=1 as CSV
+void save_stats(const char *dir) {
+	char name[MAX_PATH];
+	
+	sprintf(name, "%s\\color_stats.%s", dir, get_setting_or("stats_format", 0) ? "csv" : "json");
+	
+	if(!stats_write(name))
+		printf("Wrote statistics to %s\n", name);
+}
+
+// calculate reference color waveforms
+void init_color_waves() {
+	int i;
+	
+	color_wave1 = (int *)malloc(sizeof(int) * scanline_w * 2);
+	color_wave2 = (int *)malloc(sizeof(int) * scanline_w * 2);
+	if(color_wave1 == NULL || color_wave2 == NULL) {
+		printf("Could not allocate color buffers!");
+		quit(2);
+	}
+	
+	for(i = 0; i < scanline_w * 2; i++) {
+		color_wave1[i] = (int)(MUL_WAVE * sin(2.0 * M_PI * (float)i / f_wavelength));
+		color_wave2[i] = (int)(MUL_WAVE * sin(2.0 * M_PI * (float)i / f_wavelength - M_PI / 2.0));
+	}
+}
+
+vidout video; // frames are streamed here instead of saved when video.file is not NULL
+
+// Fields shown on screen or saved, and fields streamed. Each keeps its own
+// history, as the stream may skip frames the window shows or the other way.
+deinterlacer deint_frame, deint_video;
+
+static void init_deinterlacers() {
+	static const char *modes[] = { "weave", "bob", "motion adaptive" };
+	int mode = get_setting_or("deinterlace", DEINT_WEAVE); // 0 weave, 1 bob, 2 motion adaptive
+	int threshold = get_setting_or("deint_threshold", 24); // 0..255, larger changes are motion
+	
+	if(deint_init(&deint_frame, mode, threshold) || deint_init(&deint_video, mode, threshold)) {
+		mode = DEINT_WEAVE;
+		deint_init(&deint_frame, mode, threshold);
+		deint_init(&deint_video, mode, threshold);
+	}
+	
+	printf("Deinterlacer: %s, %s\n", modes[mode], deint_setup(get_setting_or("simd", 1)));
+}
+
+static void free_deinterlacers() {
+	deint_free(&deint_frame);
+	deint_free(&deint_video);
+}
+
+// The picture in a decoded field, as it was cropped when it was decoded
+typedef struct {
+	int left, width; // pixel columns
+	int top, bottom; // scanlines cut
+	int resampled; // already cropped and scaled to width
+} field_crop;
+
+// The crop fields are decoded with now, only valid on the decoding thread
+static void current_crop(field_crop *crop) {
+	crop->resampled = out_width > 0;
+	crop->left = crop->resampled ? 0 : crop_left;
+	crop->width = crop->resampled ? out_width : copy_width;
+	crop->top = crop_top;
+	crop->bottom = crop_bottom;
+}
+
+// Put a field into a frame of the window size. Unscaled and resampled
+// frames are written by the deinterlacer in one pass, scaled ones still go
+// through draw_screen. crop is where the picture is in the field, NULL if it
+// was decoded on this thread with the current crop.
+static void show_field(deinterlacer *di, SDL_Surface *frame, SDL_Surface *field, int field_num, 
+		const field_crop *crop, int scale_x, int scale_y, int blur, int sample) {
+	field_crop now;
+	int failed;
+	
+	if(crop == NULL) {
+		current_crop(&now);
+		crop = &now;
+	}
+	
+	if(crop->resampled)
+		scale_x = scale_y = 0;
+	
+	if(scale_x == 0 && scale_y == 0 && SDL_LockSurface(frame) == 0) {
+		failed = deint_field(di, (unsigned int *)frame->pixels, frame->pitch / 4, 
+			(unsigned int *)((char *)field->pixels + crop->top * field->pitch) + crop->left, field->pitch / 4, field_num, 
+			MIN(crop->width, MIN(frame->w, field->w - crop->left)), MIN(252 - crop->top - crop->bottom, frame->h / 2));
+		SDL_UnlockSurface(frame);
+		
+		if(!failed)
+			return;
+	}
+	
+	deint_reset(di); // the frame no longer follows its history
+	draw_screen(frame, field, field_num, scale_x, scale_y, blur, sample);
+}
+
+// Returns -1 if the video stream has been closed by its reader, 0 otherwise
+static int save_frame(SDL_Surface *frame, const char *outdir, int *frame_num) {
+	char name[MAX_PATH];
+	SDL_Surface *dest;
+	
+	if(video.file != NULL) {
+		if((dest = vidout_frame(&video, INFINITE)) == NULL)
+			return -1; // only fails when the writer has
+		
+		SDL_BlitSurface(frame, NULL, dest, NULL);
+		vidout_submit(&video);
+		(*frame_num)++;
+		return 0;
+	}
+	
+	sprintf(name, "%s\\frame%06d.bmp", outdir, (*frame_num)++);
+	if(SDL_SaveBMP(frame, name) < 0)
+		printf("Could not write %s: %s\n", name, SDL_GetError());
+	
+	return 0;
+}
+
+// Decode the complete fields of an indexed capture, seeking straight to
+// their scanlines. Mapped windows are reused as long as fields fit in them.
+// Returns 0 on success and -1 if the capture or the video stream failed.
+static int decode_indexed(capfile *cf, scanidx *idx, const char *outdir, long samples, 
+		SDL_Surface *field, SDL_Surface *frame, int scale_x, int scale_y, int *frame_num,
+		void (*extract_func)(Uint32 *, short *, int, int)) {
+	short *view = NULL;
+	scanidx_field *f;
+	stats_time started;
+	int n;
+	
+	for(n = 0; n < idx->fields; n++) {
+		f = idx->field + n;
+		
+		if(f->type == -1) { // partial field
+			stats_count(CT_PARTIAL, 1);
+			continue;
+		}
+		
+		if(view == NULL || f->start < cf->view_first || f->end + scanline_w > cf->view_first + cf->view_length) {
+			view = capfile_view(cf, f->start, MAX(samples, (long)(f->end - f->start) + scanline_w));
+			if(view == NULL)
+				return -1;
+		}
+		
+		started = stats_now();
+		decode_indexed_field(field, view + (f->start - cf->view_first), 
+			cf->view_first + cf->view_length - f->start, idx, n, extract_func);
+		stats_record(TP_FIELD, started);
+		stats_count(CT_FIELDS, 1);
+		
+		started = stats_now();
+		show_field(&deint_frame, frame, field, f->type, NULL, scale_x, scale_y, 0, 1);
+		stats_record(TP_DRAW, started);
+		
+		if(f->type == 1 && save_frame(frame, outdir, frame_num)) // second field completes the frame
+			return -1;
+	}
+	
+	return 0;
+}
+
+// Decode a raw 16-bit capture file without a scope or display. The file is
+// mapped one 1.5 frame window at a time and decoded straight from the mapping,
+// each completed frame is written to outdir as a BMP file. With setting
+// scan_index = 1 (default) the sync pass is done once and kept in a sidecar
+// index, so later runs with other crops or colour settings skip it.
+// Returns the amount of samples decoded or -1 on failure.
+long long decode_capture(const char *filename, const char *outdir, long samples, 
+		SDL_Surface *field, SDL_Surface *frame, int scale_x, int scale_y, int *frame_num,
+		int *first_run, void (*extract_func)(Uint32 *, short *, int, int)) {
+	capfile cf;
+	scanidx idx;
+	short *view;
+	long long pos = 0;
+	long length, last_field_end;
+	stats_time started;
+	int i, got, field_num, skip;
+	
+	if(capfile_open(&cf, filename))
+		return -1;
+	
+	if(*first_run) {
+		view = capfile_view(&cf, 0, samples);
+		if(view == NULL) {
+			capfile_close(&cf);
+			return -1;
+		}
+		
+		analyze_samples(view, cf.view_length);
+		*first_run = 0;
+	}
+	
+	if(min_I == max_I || min_Q == max_Q) { // no usable color information in the capture
+		capfile_close(&cf);
+		return -1;
+	}
+	
+	if(get_setting_or("scan_index", 1) && !scanidx_open(&idx, &cf, filename, treshold, screen_width, long_high)) {
+		pos = decode_indexed(&cf, &idx, outdir, samples, field, frame, scale_x, scale_y, frame_num, extract_func) ? -1 : cf.samples;
+		
+		scanidx_free(&idx);
+		capfile_close(&cf);
+		
+		return pos;
+	}
+	
+	while(pos < cf.samples) {
+		view = capfile_view(&cf, pos, samples);
+		if(view == NULL) {
+			capfile_close(&cf);
+			return -1;
+		}
+		length = cf.view_length;
+		
+		last_field_end = 0;
+		for(i=0, skip=0; i<length;) {
+			// skip a bit back for consecutive fields to allow VSYNC detection
+			if(i > skip)
+				i -= skip;
+			
+			started = stats_now();
+			got = extract_field(field, view+i, length-i, &field_num, extract_func);
+			stats_record(TP_FIELD, started);
+			
+			if(got < 0) { // no usable color information in the capture
+				capfile_close(&cf);
+				return -1;
+			}
+			
+			i += got;
+			// don't back up after a short run, it would find the same VSYNC forever
+			skip = (got > 2 * scanline_w) ? 2 * scanline_w : 0;
+			
+			if(field_num != -1) {
+				stats_count(CT_FIELDS, 1);
+				started = stats_now();
+				show_field(&deint_frame, frame, field, field_num, NULL, scale_x, scale_y, 0, 1);
+				stats_record(TP_DRAW, started);
+				last_field_end = i;
+				
+				if(field_num == 1 && save_frame(frame, outdir, frame_num)) { // second field completes the frame
+					capfile_close(&cf);
+					return -1;
+				}
+			} else if(i < length) // sync lost in the middle of the window
+				stats_count(CT_PARTIAL, 1);
+		}
+		
+		if(pos + length >= cf.samples)
+			break; // whole capture decoded
+		
+		// continue from the last complete field, or skip the window if none was found
+		if(last_field_end > 2 * scanline_w)
+			pos += last_field_end - 2 * scanline_w;
+		else
+			pos += length - 2 * scanline_w;
+	}
+	
+	pos = cf.samples;
+	capfile_close(&cf);
+	
+	return pos;
+}
+
+// Decode a capture file or a directory of them to BMP frames in outdir
+int run_headless(const char *path, const char *outdir, long samples, int scale_x, int scale_y, int bw) {
+	SDL_Surface *field, *frame;
+	char **names;
+	int count, i, first_run = 1, frame_num = 0, failed = 0;
+	long long decoded, total = 0;
+	clock_t started;
+	double seconds;
+	
+	count = capfile_list(path, &names);
+	if(count < 0)
+		return -1;
+	
+	field = SDL_CreateRGBSurface(SDL_SWSURFACE, field_width(), 252,
+		32, 0xFF0000, 0xFF00, 0xFF, 0);
+	frame = SDL_CreateRGBSurface(SDL_SWSURFACE, frame_width(scale_x), 2 * (252 - crop_top - crop_bottom),
+		32, 0xFF0000, 0xFF00, 0xFF, 0);
+	if(field == NULL || frame == NULL) {
+		printf("Could not allocate frame buffers!\n");
+		capfile_free_list(names, count);
+		return -1;
+	}
+	
+	init_color_waves();
+	init_color_kernel();
+	init_deinterlacers();
+	init_denoiser();
+	init_decode_pool();
+	
+	started = clock();
+	
+	for(i = 0; i < count; i++) {
+		decoded = decode_capture(names[i], outdir, samples, field, frame, scale_x, scale_y, 
+			&frame_num, &first_run, bw ? &extract_bw : &extract_color);
+		
+		if(decoded < 0) {
+			printf("Failed to decode %s\n", names[i]);
+			failed++;
+		} else
+			total += decoded;
+		
+		save_stats(outdir); // long batch jobs can be watched as they go
+		
+		if(video.failed) {
+			printf("Video stream closed, stopping\n");
+			failed += count - i - 1;
+			break;
+		}
+	}
+	
+	seconds = (double)(clock() - started) / CLOCKS_PER_SEC;
+	printf("Decoded %d files, %lld samples into %d frames in %.2f s (%.1f Msamples/s)\n",
+		count - failed, total, frame_num, seconds, seconds > 0 ? total / seconds / 1e6 : 0.0);
+	
+	capfile_free_list(names, count);
+	if(decode_pool != NULL)
+		pool_destroy(decode_pool);
+	SDL_FreeSurface(field);
+	SDL_FreeSurface(frame);
+	free_deinterlacers();
+	resampler_free(&scaler);
+	denoise_free(&field_denoise);
+	free(color_wave1);
+	free(color_wave2);
+	
+	return failed ? -1 : 0;
+}
+
+// Batch worker: decode the captures the driver sends on stdin, each into its
+// own directory in outdir. Buffers, colour waveforms, lookup tables and the
+// decoding threads are set up once and kept for all the captures.
+int run_worker(const char *outdir, long samples, int scale_x, int scale_y, int bw) {
+	SDL_Surface *field, *frame;
+	char path[MAX_PATH], dir[MAX_PATH];
+	int first_run, frame_num;
+	batch_result result;
+	
+	field = SDL_CreateRGBSurface(SDL_SWSURFACE, field_width(), 252,
+		32, 0xFF0000, 0xFF00, 0xFF, 0);
+	frame = SDL_CreateRGBSurface(SDL_SWSURFACE, frame_width(scale_x), 2 * (252 - crop_top - crop_bottom),
+		32, 0xFF0000, 0xFF00, 0xFF, 0);
+	if(field == NULL || frame == NULL) {
+		printf("Could not allocate frame buffers!\n");
+		return -1;
+	}
+	
+	init_color_waves();
+	init_color_kernel();
+	init_deinterlacers();
+	init_denoiser();
+	init_decode_pool();
+	
+	while(!batch_next(path, sizeof(path))) {
+		memset(&result, 0, sizeof(batch_result));
+		result.samples = -1;
+		
+		if(!batch_output_dir(outdir, path, dir, sizeof(dir))) {
+			frame_num = 0;
+			
+			// every capture starts from its own levels, clean fields and
+			// averages, and gets statistics of its own. The decode pool is
+			// idle between captures, so the histograms can be reset.
+			first_run = 1;
+			stats_reset();
+			deint_reset(&deint_frame);
+			field_denoise.valid[0] = field_denoise.valid[1] = 0;
+			
+			result.samples = decode_capture(path, dir, samples, field, frame, scale_x, scale_y, 
+				&frame_num, &first_run, bw ? &extract_bw : &extract_color);
+			
+			result.frames = frame_num;
+			result.fields = stats_value(CT_FIELDS);
+			result.partial = stats_value(CT_PARTIAL);
+			if(result.samples < 0)
+				stats_count(CT_FAILED, 1);
+			
+			save_stats(dir);
+		}
+		
+		batch_done(&result);
+	}
+	
+	if(decode_pool != NULL)
+		pool_destroy(decode_pool);
+	SDL_FreeSurface(field);
+	SDL_FreeSurface(frame);
+	free_deinterlacers();
+	resampler_free(&scaler);
+	denoise_free(&field_denoise);
+	free(color_wave1);
+	free(color_wave2);
+	
+	return 0;
+}
+
+// Decode a directory, capture or .lst list of captures with a pool of worker
+// processes running this program with -worker, see batch.h
+int run_batch(const char *inifile, const char *path, const char *outdir, int workers) {
+	char command[MAX_PATH * 2 + 64], program[MAX_PATH], **names;
+	SYSTEM_INFO info;
+	int count, failed;
+	
+	count = capfile_list(path, &names);
+	if(count < 0)
+		return -1;
+	
+	GetSystemInfo(&info);
+	if(workers <= 0)
+		workers = get_setting_or("batch_workers", info.dwNumberOfProcessors);
+	if(workers <= 0)
+		workers = 1;
+	
+	// the processors are shared out between the workers' decoding threads
+	GetModuleFileNameA(NULL, program, sizeof(program));
+	sprintf(command, "\"%s\" \"%s\" -worker \"%s\" %d", program, inifile, outdir,
+		MAX(1, (int)info.dwNumberOfProcessors / MIN(workers, MAX(count, 1))));
+	
+	failed = batch_run(names, count, outdir, command, workers);
+	
+	capfile_free_list(names, count);
+	
+	return failed ? -1 : 0;
+}
+
+// Compress a raw capture into the capz container, then read it back to check
+// it against the original and time the decompression
+int run_compress(const char *in, const char *out) {
+	LARGE_INTEGER frequency, start, end;
+	capfile raw, packed;
+	short *a, *b;
+	long long size, pos;
+	double seconds = 0;
+	long window = 256 * CAPZ_BLOCK_SAMPLES;
+
+	size = capz_compress(in, out);
+	if(size < 0)
+		return -1;
+
+	if(capfile_open(&raw, in))
+		return -1;
+	if(capfile_open(&packed, out)) {
+		capfile_close(&raw);
+		return -1;
+	}
+
+	QueryPerformanceFrequency(&frequency);
+
+	for(pos = 0; pos < raw.samples; pos += window) {
+		QueryPerformanceCounter(&start);
+		b = capfile_view(&packed, pos, window);
+		QueryPerformanceCounter(&end);
+		seconds += (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+
+		a = capfile_view(&raw, pos, window);
+		if(a == NULL || b == NULL || raw.view_length != packed.view_length ||
+				memcmp(a, b, sizeof(short) * raw.view_length)) {
+			printf("%s does not match %s at sample %lld\n", out, in, pos);
+			capfile_close(&raw);
+			capfile_close(&packed);
+			return -1;
+		}
+	}
+
+	printf("%lld samples in %lld bytes, %.2f bits per sample, decompressed at %.2f GB/s\n",
+		raw.samples, size, 8.0 * size / raw.samples,
+		seconds > 0 ? raw.samples * sizeof(short) / seconds / 1e9 : 0.0);
+
+	capfile_close(&raw);
+	capfile_close(&packed);
+
+	return 0;
+}
+
+// List the fields the sync pass finds in a capture, with the same numbers as
+// the NTSC_FIELD events of the MCU detector in CCMDS/ntsc.c, whose host build
+// checks itself against the listing. The capture is followed like a stream,
+// carrying the field in progress over from one window to the next.
+int run_fields(const char *filename, const char *listing, long timeInterval, long samples) {
+	field_sync fs;
+	capfile cf;
+	FILE *out;
+	short *view;
+	long long pos = 0;
+	long length, keep;
+	int got, field_num, fields = 0;
+	
+	if(capfile_open(&cf, filename))
+		return -1;
+	
+	view = capfile_view(&cf, 0, samples);
+	if(view == NULL) {
+		capfile_close(&cf);
+		return -1;
+	}
+	
+	find_sync_level(view, cf.view_length, 0); // sets treshold like analyze_samples
+	
+	out = fopen(listing, "w");
+	if(out == NULL) {
+		printf("Could not write %s\n", listing);
+		capfile_close(&cf);
+		return -1;
+	}
+	
+	fprintf(out, "sync treshold %d interval %ld\n", treshold, timeInterval);
+	
+	sync_reset(&fs, 0, ST_WAIT_NORMAL, 0);
+	
+	while(view != NULL) {
+		length = cf.view_length;
+	
+		while((got = sync_field(&fs, view, length, &field_num)) < length) {
+			fprintf(out, "field %d lines %d start %lld end %lld\n", field_num, fs.line + 1, pos + fs.field_start, pos + got);
+			fields++;
+			sync_next(&fs, got);
+		}
+	
+		if(pos + length >= cf.samples)
+			break; // whole capture listed
+	
+		if(fs.state == ST_DRAW || fs.previous < fs.begin)
+			keep = fs.begin;
+		else
+			keep = fs.previous;
+	
+		if(keep == 0) { // no sync for a whole window, start afresh
+			sync_reset(&fs, 0, ST_WAIT_NORMAL, 0);
+			keep = length;
+		} else
+			sync_rebase(&fs, keep);
+	
+		pos += keep;
+		view = capfile_view(&cf, pos, samples);
+	}
+	
+	fclose(out);
+	capfile_close(&cf);
+	
+	if(view == NULL)
+		return -1;
+	
+	printf("Listed %d fields of %s in %s\n", fields, filename, listing);
+	
+	return 0;
+}
+
+// FNV-1a hash of the pixels of a surface
+static unsigned int checksum_surface(SDL_Surface *surface, unsigned int hash) {
+	Uint32 *row;
+	int x, y;
+	
+	for(y = 0; y < surface->h; y++) {
+		row = (Uint32 *)((char *)surface->pixels + y * surface->pitch);
+		for(x = 0; x < surface->w; x++)
+			hash = (hash ^ row[x]) * 16777619;
+	}
+	
+	return hash;
+}
+
+static double seconds_since(LARGE_INTEGER *start) {
+	LARGE_INTEGER now, frequency;
+	
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	
+	return (double)(now.QuadPart - start->QuadPart) / frequency.QuadPart;
+}
+
+// Run the field loop of decode_capture over the whole buffer, returns the
+// amount of fields. Each field is hashed into hash unless it's NULL, which
+// the timed runs use so they only measure decoding.
+static int bench_fields(SDL_Surface *field, short *samples, long length, unsigned int *hash,
+		void (*extract_func)(Uint32 *, short *, int, int)) {
+	int i, got, skip, field_num, fields = 0;
+	
+	for(i=0, skip=0; i<length;) {
+		if(i > skip)
+			i -= skip;
+		
+		got = extract_field(field, samples+i, length-i, &field_num, extract_func);
+		if(got < 0)
+			break;
+		
+		i += got;
+		skip = (got > 2 * scanline_w) ? 2 * scanline_w : 0;
+		
+		if(field_num != -1) {
+			if(hash != NULL)
+				*hash = checksum_surface(field, *hash);
+			fields++;
+		}
+	}
+	
+	return fields;
+}
+
+// Decode every scanline in starts with extract_func into a single row, and
+// hash each one into hash unless it's NULL
+static void bench_scanlines(SDL_Surface *field, short *samples, int *starts, int lines, unsigned int *hash,
+		void (*extract_func)(Uint32 *, short *, int, int)) {
+	int i;
+	
+	for(i = 0; i < lines; i++) {
+		extract_func((Uint32 *)field->pixels, samples + starts[i], -1, 0);
+		if(hash != NULL)
+			*hash = checksum_surface(field, *hash);
+	}
+}
+
+// Normal scanlines, whose HSYNC starts a whole line away from the next one,
+// up to max of them. Returns the amount found.
+static int find_scanlines(short *samples, long length, int *starts, int max) {
+	sync_slicer slicer;
+	int offset, previous = -1, lines = 0;
+	
+	slicer_init(&slicer, samples, 0, length, treshold, 0);
+	while((offset = slicer_next(&slicer)) < length) {
+		if(!slicer.is_sync)
+			continue;
+		if(previous >= 0 && offset - previous > screen_width && lines < max)
+			starts[lines++] = previous;
+		previous = offset;
+	}
+	
+	return lines;
+}
+
+// Decode a synthetic signal of frames frames and report throughput and
+// checksums of the decoded output, so decoder changes can be compared
+// without a scope: color <ini> -b [frames]
+int run_benchmark(long timeInterval, int frames) {
+	SDL_Surface *field, *row;
+	ntscgen gen;
+	LARGE_INTEGER start;
+	short *samples;
+	long length;
+	int *starts, lines, fields, bw, repeat, repeats = get_setting_or("bench_repeat", 3);
+	unsigned int hash;
+	double best, seconds;
+	
+	length = (long)((long long)frames * 525 * 63556 / timeInterval);
+	samples = (short *)malloc(sizeof(short) * length);
+	starts = (int *)malloc(sizeof(int) * frames * 525);
+	field = SDL_CreateRGBSurface(SDL_SWSURFACE, field_width(), 252, 32, 0xFF0000, 0xFF00, 0xFF, 0);
+	row = SDL_CreateRGBSurface(SDL_SWSURFACE, field_width(), 1, 32, 0xFF0000, 0xFF00, 0xFF, 0);
+	if(samples == NULL || starts == NULL || field == NULL || row == NULL) {
+		printf("Ran out of memory while allocating %ld sample benchmark\n", length);
+		return -1;
+	}
+	
+	ntscgen_init(&gen, timeInterval, get_setting_or("bench_noise", 0));
+	ntscgen_fill(&gen, samples, length);
+	
+	printf("Benchmark: %d frames at %ld ns, %ld samples\n", frames, timeInterval, length);
+	
+	init_color_waves();
+	init_color_kernel();
+	init_decode_pool();
+	update_scaler(); // extract_bw and extract_color are also timed without decode_scanlines
+	
+	for(best = 1e9, repeat = 0; repeat < repeats; repeat++) {
+		QueryPerformanceCounter(&start);
+		analyze_samples(samples, length);
+		seconds = seconds_since(&start);
+		best = MIN(best, seconds);
+	}
+	printf("%-16s %8.1f Msamples/s\n", "analyze_samples", length / best / 1e6);
+	
+	lines = find_scanlines(samples, length, starts, frames * 525);
+	
+	for(bw = 0; bw < 2; bw++) {
+		for(best = 1e9, repeat = 0; repeat < repeats; repeat++) {
+			QueryPerformanceCounter(&start);
+			fields = bench_fields(field, samples, length, NULL, bw ? &extract_bw : &extract_color);
+			seconds = seconds_since(&start);
+			best = MIN(best, seconds);
+		}
+		
+		// the checksum takes an untimed run of its own
+		hash = 2166136261u;
+		bench_fields(field, samples, length, &hash, bw ? &extract_bw : &extract_color);
+		printf("%-16s %8.1f Msamples/s %8.1f fields/s  %d fields  checksum %08x\n", bw ? "extract_field bw" : "extract_field",
+			length / best / 1e6, fields / best, fields, hash);
+	}
+	
+	for(bw = 0; bw < 2; bw++) {
+		for(best = 1e9, repeat = 0; repeat < repeats; repeat++) {
+			QueryPerformanceCounter(&start);
+			bench_scanlines(row, samples, starts, lines, NULL, bw ? &extract_bw : &extract_color);
+			seconds = seconds_since(&start);
+			best = MIN(best, seconds);
+		}
+		
+		hash = 2166136261u;
+		bench_scanlines(row, samples, starts, lines, &hash, bw ? &extract_bw : &extract_color);
+		printf("%-16s %8.1f Msamples/s %8.1f lines/s   %d lines  checksum %08x\n", bw ? "extract_bw" : "extract_color",
+			(double)lines * scanline_w / best / 1e6, lines / best, lines, hash);
+	}
+	
+	if(decode_pool != NULL)
+		pool_destroy(decode_pool);
+	SDL_FreeSurface(field);
+	SDL_FreeSurface(row);
+	resampler_free(&scaler);
+	free(starts);
+	free(samples);
+	free(color_wave1);
+	free(color_wave2);
+	
+	return 0;
+}
+
+// Burst adjustments of lines scanlines, measured on their own and tracked
+// over each field, against trying every adj. Returns the mismatches.
+static int verify_burst(short *samples, int *starts, int lines) {
+	scanline_pos *pos;
+	int i, first, search, single = 0, tracked = 0;
+	
+	pos = (scanline_pos *)malloc(sizeof(scanline_pos) * MAX(lines, 1));
+	if(pos == NULL) {
+		printf("Ran out of memory while verifying burst\n");
+		return 1;
+	}
+	
+	for(i = 0; i < lines; i++) {
+		pos[i].line = i;
+		pos[i].start = starts[i];
+		pos[i].dump = 0;
+	}
+	
+	// a field ends where VSYNC breaks the run of whole scanlines
+	for(first = 0, i = 1; i <= lines; i++) {
+		if(i == lines || starts[i] - starts[i - 1] > scanline_w + scanline_w / 2) {
+			track_burst(samples, pos + first, i - first);
+			first = i;
+		}
+	}
+	
+	for(i = 0; i < lines; i++) {
+		search = burst_search(samples + starts[i]);
+		if(burst_adjustment(samples + starts[i]) != search)
+			single++;
+		if(pos[i].adj != search)
+			tracked++;
+	}
+	
+	printf("%-16s %6d lines %6d untracked %6d tracked mismatches\n", "burst", lines, single, tracked);
+	
+	free(pos);
+	
+	return single + tracked;
+}
+
+// Every pixel loop built for the current i_wavelength and the generic ones
+// against color_pixels, on rounds scanlines of random samples decoded with
+// random adjustments. Returns the mismatches.
+static int verify_kernels(int rounds) {
+	static const char *isa[] = { "scalar", "SSE4.1", "AVX2" };
+	const kernel_set *sets[3] = { NULL, NULL, NULL }, *set;
+	color_kernel_func kernel;
+	Uint32 *expected, *got;
+	short *samples;
+	unsigned int seed = 12345;
+	int i, n, packed, round, adj, start, end, kernels = 0, mismatches = 0;
+	
+#ifdef FIXED_KERNELS
+	sets[0] = scalar_kernels;
+#endif
+#ifdef SIMD_KERNELS
+	__builtin_cpu_init();
+	if(i_wavelength <= KERNEL_MAX_WAVE && __builtin_cpu_supports("sse4.1"))
+		sets[1] = sse41_kernels;
+	if(i_wavelength <= KERNEL_MAX_WAVE && __builtin_cpu_supports("avx2"))
+		sets[2] = avx2_kernels;
+#endif
+	
+	samples = (short *)malloc(sizeof(short) * scanline_w);
+	expected = (Uint32 *)malloc(sizeof(Uint32) * scanline_w);
+	got = (Uint32 *)malloc(sizeof(Uint32) * scanline_w);
+	if(samples == NULL || expected == NULL || got == NULL) {
+		printf("Ran out of memory while verifying kernels\n");
+		free(samples);
+		free(expected);
+		free(got);
+		return 1;
+	}
+	
+	// same pixels as extract_color
+	start = MAX(color_burst_start, MAX(crop_left, wave_before));
+	end = MIN(scanline_w - wave_after, crop_left + copy_width);
+	
+	for(n = 0; n < 3; n++) {
+		for(set = sets[n]; set != NULL; set = set->wave ? set + 1 : NULL) {
+			if(set->wave && set->wave != i_wavelength)
+				continue;
+			
+			for(packed = 0; packed < 2; packed++) {
+				kernel = packed ? set->packed : set->plain;
+				if(kernel == NULL || (packed && lookup_packed == NULL))
+					continue;
+				kernels++;
+				
+				for(round = 0; round < rounds; round++) {
+					for(i = 0; i < scanline_w; i++) {
+						seed = seed * 1103515245 + 12345;
+						samples[i] = (short)(seed >> 16);
+					}
+					adj = (int)((seed >> 8) % i_wavelength);
+					
+					color_pixels(expected, samples, adj, start, end, 0);
+					kernel(got, samples, adj, start, end);
+					
+					for(i = start; i < end && got[i] == expected[i]; i++)
+						;
+					if(i < end) {
+						printf("%s kernel for wave %d%s: pixel %d is %06X instead of %06X\n", isa[n], set->wave,
+							packed ? ", packed lookup" : "", i, got[i], expected[i]);
+						mismatches++;
+						break;
 					}
-				} else { // next scanline
-					line++;
-					scanline_start = offset;
 				}
-			} else { // end hsync
-				if(line >= crop_top && line < 252-crop_bottom && scanline_start + scanline_w < length)
-#ifndef DEBUG
-					extract_func(buffer + line * surface->pitch/4, samples + scanline_start, 0);
-#else
-					extract_func(buffer + line * surface->pitch/4, samples + scanline_start, line == dumpLine);
-				
-				if(line == dumpLine)
-					dumpLine = -1; // mark the line as printed
-#endif
 			}
+		}
+	}
+	
+	printf("%-16s %6d kernels %6d scanlines each %6d mismatches\n", "color kernels", kernels, rounds, mismatches);
+	
+	free(samples);
+	free(expected);
+	free(got);
+	
+	return mismatches;
+}
+
+// Decode the signal into fields on the calling thread and with decoding
+// threads, color and black and white, the checksums have to be the same.
+// Returns the mismatches.
+static int verify_threads(short *samples, long length) {
+	static const int threads[] = { 2, 3, 0 }; // 0 is one per processor
+	SDL_Surface *field;
+	unsigned int single, hash;
+	int n = 0, bw, fields = 0, mismatches = 0;
+	
+	field = SDL_CreateRGBSurface(SDL_SWSURFACE, field_width(), 252, 32, 0xFF0000, 0xFF00, 0xFF, 0);
+	if(field == NULL) {
+		printf("Ran out of memory while verifying threads\n");
+		return 1;
+	}
+	
+	init_color_kernel();
+	update_scaler();
+	
+	for(bw = 0; bw < 2; bw++) {
+		single = 2166136261u;
+		fields = bench_fields(field, samples, length, &single, bw ? &extract_bw : &extract_color);
+		if(fields == 0) {
+			printf("No fields to compare\n");
+			mismatches++;
 			break;
 		}
-		count = 0;
+		
+		for(n = 0; n < (int)(sizeof(threads) / sizeof(threads[0])); n++) {
+			decode_pool = pool_create(threads[n]);
+			if(decode_pool == NULL) {
+				printf("Could not start %d decoding threads\n", threads[n]);
+				mismatches++;
+				continue;
+			}
+			
+			hash = 2166136261u;
+			bench_fields(field, samples, length, &hash, bw ? &extract_bw : &extract_color);
+			if(hash != single) {
+				printf("%s with %d threads: checksum %08x instead of %08x\n", bw ? "extract_bw" : "extract_color",
+					pool_threads(decode_pool), hash, single);
+				mismatches++;
+			}
+			
+			pool_destroy(decode_pool);
+			decode_pool = NULL;
+		}
+	}
+	
+	printf("%-16s %6d fields %6d thread counts %6d mismatches\n", "threads", fields, n, mismatches);
+	
+	SDL_FreeSurface(field);
+	
+	return mismatches;
+}
+
+// Check the fast paths against the reference code on a synthetic signal with
+// noise, at each timebase a fixed kernel is built for and one between them,
+// so changes can be verified without a scope: color <ini> -verify [frames]
+// Returns the amount of mismatches, 0 when everything agrees.
+int run_verify(int frames) {
+	static const long intervals[] = { 8, 16, 32, 48, 64 };
+	ntscgen gen;
+	short *samples;
+	long length, timeInterval;
+	int *starts, lines, n, failed = 0, noise = get_setting_or("verify_noise", 200);
+	
+	burst_lock = 1;
+	
+	for(n = 0; n < (int)(sizeof(intervals) / sizeof(intervals[0])); n++) {
+		timeInterval = intervals[n];
+		calculate_parameters(timeInterval);
+		
+		length = (long)((long long)frames * 525 * 63556 / timeInterval);
+		samples = (short *)malloc(sizeof(short) * length);
+		starts = (int *)malloc(sizeof(int) * frames * 525);
+		if(samples == NULL || starts == NULL) {
+			printf("Ran out of memory while allocating %ld sample check\n", length);
+			free(samples);
+			free(starts);
+			return -1;
+		}
+		
+		ntscgen_init(&gen, timeInterval, noise);
+		ntscgen_fill(&gen, samples, length);
+		
+		printf("Verify: %d frames at %ld ns, noise %d\n", frames, timeInterval, noise);
+		
+		init_color_waves();
+		analyze_samples(samples, length);
+		lines = find_scanlines(samples, length, starts, frames * 525);
+		
+		failed += verify_burst(samples, starts, lines);
+		failed += verify_kernels(get_setting_or("verify_rounds", 200));
+		
+		// field sync isn't made for noise, the threads are checked on a clean signal
+		ntscgen_init(&gen, timeInterval, 0);
+		ntscgen_fill(&gen, samples, length);
+		analyze_samples(samples, length);
+		failed += verify_threads(samples, length);
+		
+		free(color_wave1);
+		free(color_wave2);
+		free(starts);
+		free(samples);
+	}
+	
+	resampler_free(&scaler);
+	
+	if(failed)
+		printf("%d mismatches\n", failed);
+	else
+		printf("Everything matches\n");
+	
+	return failed;
+}
+
+#define SAMPLE_BLOCKS 4 // capture buffers between producer and decoder
+#define FIELD_SLOTS 3 // decoded fields between decoder and presenter, triple buffered
+#define MAX_FIELD_SLOTS 32 // when they are also published to other processes
+
+// Live decoding runs as a three stage pipeline: a producer thread captures
+// sample blocks, a decoder thread turns them into fields and the main thread
+// presents them, so capturing, decoding and drawing overlap. The decoder
+// never waits for the window: it always has a free field buffer, and the
+// presenter shows the newest field, skipping older ones it didn't get to.
+typedef struct {
+	spsc_ring block_ring; // producer -> decoder
+	short *block[SAMPLE_BLOCKS];
+	long block_length[SAMPLE_BLOCKS];
+	int block_gap[SAMPLE_BLOCKS]; // samples are missing between the previous block and this one
+	long samples; // capacity of a block
+	long carry; // room in front of each block for the unfinished field of the previous one
+	
+	presenter present; // decoder -> presenter
+	SDL_Surface *field[MAX_FIELD_SLOTS];
+	int field_num[MAX_FIELD_SLOTS];
+	field_crop field_crop[MAX_FIELD_SLOTS]; // the presenter shows fields with these, not the crop globals
+	int field_slots;
+	field_shm shm; // fields are decoded straight into it if header is not NULL
+	
+	// sample source: the scope, or a capture file or pipe if source is not NULL
+	short handle;
+	unsigned long timebase;
+	HANDLE source;
+	
+	HANDLE producer, decoder;
+	volatile LONG quit; // set by the presenter to stop the other stages
+	volatile LONG produced, decoded; // set when a stage has run out of input
+	volatile int bw, first_run; // changed from the keyboard
+	volatile int crop_left, crop_right; // crop percentages, applied by the decoder when recrop is set
+	volatile LONG recrop;
+	int out_width; // the setting, a new crop retries the resampler with it
+	volatile LONG clear_fields; // bumped to clear every field buffer once
+	LONG cleared[MAX_FIELD_SLOTS]; // clear_fields when the buffer was last cleared, decoder only
+	int track; // follow signal levels from decoded fields instead of reanalyzing
+} pipeline;
+
+static DWORD WINAPI produce_samples(LPVOID param) {
+	pipeline *pipe = (pipeline *)param;
+	short overflow;
+	char *block;
+	DWORD size, got, bytes;
+	long length;
+	stats_time started;
+	int slot;
+	
+	while(!pipe->quit) {
+		if((slot = ring_write_slot(&pipe->block_ring, 100)) < 0)
+			continue; // decoder is behind
+		
+		if(pipe->source != NULL) { // capture file or pipe, reads may return less than asked
+			block = (char *)pipe->block[slot];
+			size = pipe->samples * sizeof(short);
+			
+			for(got = 0; got < size; got += bytes)
+				if(!ReadFile(pipe->source, block + got, size - got, &bytes, NULL) || bytes == 0)
+					break;
+			
+			if(got < sizeof(short))
+				break; // end of input
+			
+			length = got / sizeof(short);
+		} else {
+			started = stats_now();
+			length = capture_ps3000(pipe->handle, pipe->block[slot], pipe->samples, pipe->timebase, &overflow);
+			stats_record(TP_PICO, started);
+			
+			if(length != pipe->samples || overflow) {
+				printf("Failed capture\n");
+				stats_count(CT_FAILED, 1);
+				continue;
+			}
+		}
+		
+		pipe->block_length[slot] = length;
+		pipe->block_gap[slot] = (pipe->source == NULL); // every scope capture starts afresh
+		ring_commit(&pipe->block_ring);
+		stats_count(CT_BLOCKS, 1);
+	}
+	
+	InterlockedExchange(&pipe->produced, 1);
+	
+	return 0;
+}
+
+// Fields are extracted from a continuous stream: the sync state and the
+// samples of the field in progress are carried over from one block to the
+// next, in front of the next block's samples. Every sample is sliced once and
+// a field split between two blocks is still decoded, so a file or pipe gives
+// every field it holds. Scope captures are separate acquisitions, the state
+// starts afresh with each of them.
+static DWORD WINAPI decode_blocks(LPVOID param) {
+	pipeline *pipe = (pipeline *)param;
+	field_sync fs;
+	short *data;
+	long length, tail = 0, keep;
+	stats_time started;
+	int slot, field_slot = -1, field_num, field_count, got;
+	LONG clear;
+	
+	while(!pipe->quit) {
+		if((slot = ring_read_slot(&pipe->block_ring, 100)) < 0) {
+			if(pipe->produced && ring_count(&pipe->block_ring) == 0)
+				break; // input ended
+			continue;
+		}
+		
+		if(pipe->block_gap[slot] && tail > 0) { // the field in progress can't be finished
+			if(fs.state == ST_DRAW)
+				stats_count(CT_PARTIAL, 1);
+			tail = 0;
+		}
+		
+		if(tail == 0)
+			sync_reset(&fs, 0, ST_WAIT_NORMAL, 0);
+		
+		data = pipe->block[slot] - tail;
+		length = tail + pipe->block_length[slot];
+		
+		// the scanline geometry only changes here, between blocks, the
+		// presenter keeps showing fields with the crop they were decoded with
+		if(InterlockedExchange(&pipe->recrop, 0)) {
+			set_crop(pipe->crop_left, pipe->crop_right);
+			out_width = pipe->out_width;
+			InterlockedIncrement(&pipe->clear_fields);
+		}
+		
+		if(pipe->first_run) {
+			if(pipe->track && lookup_Y != NULL)
+				init_level_tracker(); // snap to the next field, no extra pass
+			else
+				analyze_samples(pipe->block[slot], pipe->block_length[slot]);
+			pipe->first_run = 0;
+		}
+		
+		field_count = 0;
+		got = -1;
+		
+		while(!(min_I == max_I || min_Q == max_Q)) { // no usable color information otherwise
+			// only waits when recording a file or publishing to other processes
+			while(field_slot < 0 && !pipe->quit)
+				field_slot = present_back(&pipe->present, 100);
+			
+			if(field_slot < 0)
+				break;
+			
+			if(pipe->shm.header != NULL)
+				field_shm_begin(&pipe->shm, field_slot);
+			
+			clear = pipe->clear_fields;
+			if(pipe->cleared[field_slot] != clear) {
+				clear_surface(pipe->field[field_slot]);
+				pipe->cleared[field_slot] = clear;
+			}
+			
+			started = stats_now();
+			got = sync_field(&fs, data, length, &field_num);
+			
+			if(got == length) // the rest of the field comes with the next block
+				break;
+			
+			if(field_num != -1)
+				decode_field(pipe->field[field_slot], data, length, &fs, field_num, pipe->bw ? &extract_bw : &extract_color);
+			stats_record(TP_FIELD, started);
+			
+			// the decode pool is idle here, so the lookup tables can change
+			if(pipe->track && field_num != -1 && track_levels(data + fs.begin, got - fs.begin))
+				stats_count(CT_REBUILDS, 1);
+			
+			if(field_num != -1) { // a partial field just reuses the same buffer
+				pipe->field_num[field_slot] = field_num;
+				current_crop(&pipe->field_crop[field_slot]);
+				if(pipe->shm.header != NULL)
+					field_shm_publish(&pipe->shm, field_slot, field_num);
+				if(present_publish(&pipe->present)) // the previous one was never shown
+					stats_count(CT_DROPPED, 1);
+				stats_count(CT_FIELDS, 1);
+				field_slot = -1;
+				field_count++;
+			} else // sync lost in the middle of the field
+				stats_count(CT_PARTIAL, 1);
+			
+			sync_next(&fs, got);
+		}
+		
+		if(pipe->track && field_count == 0 && !pipe->quit)
+			relock_levels(pipe->block[slot], pipe->block_length[slot]);
+		
+		// carry the unfinished field, or just the last transition while
+		// waiting for one, over in front of the next block
+		if(got < length) // stopped early, nothing to carry
+			keep = length;
+		else if(fs.state == ST_DRAW || fs.previous < fs.begin)
+			keep = fs.begin;
+		else
+			keep = fs.previous;
+		tail = length - keep;
+		
+		if(tail > pipe->carry) { // sync lost for too long, start afresh
+			if(fs.state == ST_DRAW)
+				stats_count(CT_PARTIAL, 1);
+			tail = 0;
+		} else if(tail > 0) {
+			memcpy(pipe->block[(slot + 1) % SAMPLE_BLOCKS] - tail, data + keep, sizeof(short) * tail);
+			sync_rebase(&fs, keep);
+		}
+		
+		ring_release(&pipe->block_ring);
+	}
+	
+	InterlockedExchange(&pipe->decoded, 1);
+	
+	return 0;
+}
+
+// Allocate the pipeline buffers and start the producer and decoder threads.
+// With shm_fields set, the field buffers are the slots of a shared memory
+// ring, so other processes get every decoded field without a copy. They have
+// to be filled in turn, so then the decoder may wait for the presenter.
+// When a file is recorded, every field is presented and streamed.
+int pipeline_start(pipeline *pipe, long samples) {
+	int i, shm_fields = get_setting_or("shm_fields", 0); // 0 keeps the fields private
+	int flags = (shm_fields ? PRESENT_ORDERED : 0) | (video.file != NULL && pipe->source != NULL ? PRESENT_LOSSLESS : 0);
+	
+	pipe->samples = samples;
+	pipe->first_run = 1;
+	pipe->out_width = get_setting_or("out_width", 0);
+	pipe->track = get_setting_or("track_levels", 1);
+	pipe->field_slots = shm_fields ? MAX(FIELD_SLOTS, MIN(shm_fields, MAX_FIELD_SLOTS)) : FIELD_SLOTS;
+	init_level_tracker();
+	
+	if(ring_init(&pipe->block_ring, SAMPLE_BLOCKS) || present_init(&pipe->present, pipe->field_slots, flags))
+		return -1;
+	
+	if(shm_fields) {
+		if(field_shm_create(&pipe->shm, pipe->field_slots, field_width(), 252))
+			return -1;
+		printf("Publishing fields to %s in %d slots\n", FIELD_SHM_NAME, pipe->field_slots);
+	}
+	
+	// a field is a third of a block, the carry leaves room for a longer one
+	pipe->carry = samples / 2;
+	
+	for(i = 0; i < SAMPLE_BLOCKS; i++) {
+		pipe->block[i] = (short *)malloc(sizeof(short) * (pipe->carry + samples));
+		if(pipe->block[i] == NULL) {
+			printf("Ran out of memory while allocating %ld sample buffer\n", samples);
+			return -1;
+		}
+		pipe->block[i] += pipe->carry;
+	}
+	
+	for(i = 0; i < pipe->field_slots; i++) {
+		if(pipe->shm.header != NULL)
+			pipe->field[i] = SDL_CreateRGBSurfaceFrom(field_shm_pixels(&pipe->shm, i), field_width(), 252,
+				32, pipe->shm.header->pitch, 0xFF0000, 0xFF00, 0xFF, 0);
+		else
+			pipe->field[i] = SDL_CreateRGBSurface(SDL_SWSURFACE, field_width(), 252,
+				32, 0xFF0000, 0xFF00, 0xFF, 0);
+		if(pipe->field[i] == NULL) {
+			printf("Could not allocate field buffers!\n");
+			return -1;
+		}
+	}
+	
+	pipe->producer = CreateThread(NULL, 0, produce_samples, pipe, 0, NULL);
+	pipe->decoder = CreateThread(NULL, 0, decode_blocks, pipe, 0, NULL);
+	if(pipe->producer == NULL || pipe->decoder == NULL) {
+		printf("Could not start pipeline threads\n");
+		return -1;
+	}
+	
+	return 0;
+}
+
+// Stop the threads and free everything pipeline_start allocated
+void pipeline_stop(pipeline *pipe) {
+	present_counters counters;
+	int i;
+	
+	InterlockedExchange(&pipe->quit, 1);
+	
+	// a pipe with nothing to read keeps the producer in ReadFile, cancel
+	// the read until the producer sees quit
+	if(pipe->producer != NULL) {
+		while(WaitForSingleObject(pipe->producer, 100) == WAIT_TIMEOUT)
+			CancelSynchronousIo(pipe->producer);
+		CloseHandle(pipe->producer);
+	}
+	if(pipe->decoder != NULL) {
+		WaitForSingleObject(pipe->decoder, INFINITE);
+		CloseHandle(pipe->decoder);
+	}
+	
+	printf("Pipeline: %ld blocks (%ld failed), %ld fields decoded, %ld shown, %ld dropped\n",
+		stats_value(CT_BLOCKS), stats_value(CT_FAILED), stats_value(CT_FIELDS), 
+		stats_value(CT_SHOWN), stats_value(CT_DROPPED));
+	
+	present_stats(&pipe->present, &counters);
+	printf("Presenter: %ld fields taken, %.1f ms mean and %.1f ms worst wait, decoder waited %ld times\n",
+		counters.shown, counters.latency_ms, counters.max_latency_ms, counters.stalls);
+	
+	for(i = 0; i < SAMPLE_BLOCKS; i++)
+		if(pipe->block[i] != NULL)
+			free(pipe->block[i] - pipe->carry);
+	for(i = 0; i < pipe->field_slots; i++)
+		if(pipe->field[i] != NULL)
+			SDL_FreeSurface(pipe->field[i]);
+	
+	field_shm_close(&pipe->shm);
+	
+	ring_free(&pipe->block_ring);
+	present_free(&pipe->present);
+}
+
+static int video_first_field = 0; // the frame being streamed has its first field
+
+// Put a field into the frame being streamed, the second field completes
+// it. Waits up to timeout ms for the writer, after that the frame is skipped.
+// A second field without the first one in the same frame is skipped too,
+// the other lines would be left over from an older frame.
+static void stream_field(SDL_Surface *field, int field_num, const field_crop *crop, int scale_x, int scale_y, DWORD timeout) {
+	SDL_Surface *frame;
+	
+	if(field_num == 1 && !video_first_field) {
+		stats_count(CT_UNWRITTEN, 1);
+		return;
+	}
+	
+	if((frame = vidout_frame(&video, timeout)) == NULL) {
+		if(field_num == 1)
+			stats_count(CT_UNWRITTEN, 1);
+		video_first_field = 0;
+		return;
+	}
+	
+	show_field(&deint_video, frame, field, field_num, crop, scale_x, scale_y, 0, 1);
+	
+	if(field_num == 1) {
+		vidout_submit(&video);
+		video_first_field = 0;
+	} else
+		video_first_field = 1;
+}
+
+// Start streaming frames of the window size to path, see vidout_open
+static int open_video(const char *path, int scale_x, int scale_y) {
+	int format = get_setting_or("video_format", VIDOUT_Y4M); // 0 for YUV4MPEG2, 1 for raw bgr0
+	int interlaced = ((scale_x || scale_y) && out_width <= 0) || get_setting_or("deinterlace", DEINT_WEAVE) == DEINT_WEAVE;
+	
+	if(vidout_open(&video, path, format, frame_width(scale_x), 2 * (252 - crop_top - crop_bottom), interlaced))
+		return -1;
+	
+	printf("Streaming %d x %d %s to %s\n", video.width, video.height, format == VIDOUT_Y4M ? "YUV4MPEG2" : "raw bgr0", path);
+	
+	return 0;
+}
+
+static void close_video() {
+	if(video.file != NULL)
+		printf("Streamed %ld frames\n", vidout_close(&video));
+}
+
+// Take "-o <file>" out of the arguments, so the rest parse as before
+static const char * take_output_arg(int *argc, char *argv[]) {
+	const char *path;
+	int i;
+	
+	for(i = 2; i + 1 < *argc; i++) {
+		if(!strcmp(argv[i], "-o")) {
+			path = argv[i + 1];
+			
+			for(*argc -= 2; i < *argc; i++)
+				argv[i] = argv[i + 2];
+			argv[*argc] = NULL;
+			
+			return path;
+		}
 	}
-				
-	SDL_UnlockSurface(surface);
-	*field_type = -1;
 	
-	return offset; // data ran out
+	return NULL;
+}
+
+// Ctrl+C or closing the console, the only way to stop without a window
+static volatile LONG console_closed = 0;
+
+static BOOL WINAPI console_handler(DWORD type) {
+	InterlockedExchange(&console_closed, 1);
+	return TRUE;
 }
 
 int main(int argc, char *argv[]) {
-	SDL_Surface *screen, *field = NULL;
-	int done = 0, field_num = -1, field_count, scale_x, scale_y, blur = 0, sample = 1, bw = 0;
+	SDL_Surface *screen = NULL; // NULL when fields are only published to shared memory
+	int done = 0, scale_x, scale_y, blur = 0, sample = 1;
 	SDL_Event event;
+	pipeline pipe;
 
-	short handle, *buffer, overflow;
-	long timeInterval, samples, gotSamples;
+	long timeInterval, samples;
 	unsigned long timebase;
-	int i, first_run = 1;
+	int i, slot, stats_interval;
+	stats_time started, frame_started, published;
+	time_t stats_saved;
 	char inifile[80];
+	const char *video_path = take_output_arg(&argc, argv); // color <ini> ... -o <file, \\.\pipe\name or ->
 				
 	// profiling
-	init_timeprofiles();
+	init_stats();
 	
 	// with timebase > 2, sampling interval = (timebase - 2) * 16 ns
 	if(argc > 1) {
@@ -577,91 +2983,137 @@ int main(int argc, char *argv[]) {
 	
 	samples = (64000/timeInterval) * 3/2*525; // We'll need 1.5 frames long buffer to ensure two whole fields
 	
-	handle = init_ps3000(timebase, samples, &timeInterval);
-	if(handle == -1) {
-		printf("Could not initialize the scope! Exiting...\n");
-		return -1;
+	memset(&pipe, 0, sizeof(pipeline));
+	
+	if(argc > 3 && !strcmp(argv[2], "-p")) { // play a capture file or stdin: color <ini> -p <file or ->
+		if(!strcmp(argv[3], "-"))
+			pipe.source = GetStdHandle(STD_INPUT_HANDLE);
+		else
+			pipe.source = CreateFileA(argv[3], GENERIC_READ, FILE_SHARE_READ, NULL,
+				OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		
+		if(pipe.source == NULL || pipe.source == INVALID_HANDLE_VALUE) {
+			printf("Could not open %s\n", argv[3]);
+			return -1;
+		}
+		
+		timeInterval = get_setting_or("time_interval", timeInterval);
+	} else if(argc > 2 && !strcmp(argv[2], "-b")) { // benchmark on a synthetic signal: color <ini> -b [frames]
+		calculate_parameters(get_setting_or("time_interval", timeInterval));
+		return run_benchmark(get_setting_or("time_interval", timeInterval), argc > 3 ? atoi(argv[3]) : 4);
+	} else if(argc > 2 && !strcmp(argv[2], "-verify")) { // check the fast paths against the reference ones: color <ini> -verify [frames]
+		return run_verify(argc > 3 ? atoi(argv[3]) : 2);
+	} else if(argc > 3 && !strcmp(argv[2], "-batch")) { // color <ini> -batch <dir, file or .lst> [outdir [workers]]
+		return run_batch(argv[1], argv[3], argc > 4 ? argv[4] : ".", argc > 5 ? atoi(argv[5]) : 0);
+	} else if(argc > 4 && !strcmp(argv[2], "-compress")) { // color <ini> -compress <capture> <compressed capture>
+		return run_compress(argv[3], argv[4]);
+	} else if(argc > 4 && !strcmp(argv[2], "-fields")) { // fields for the MCU detector check: color <ini> -fields <capture> <listing>
+		calculate_parameters(get_setting_or("time_interval", timeInterval));
+		return run_fields(argv[3], argv[4], get_setting_or("time_interval", timeInterval), samples);
+	} else if(argc > 4 && !strcmp(argv[2], "-worker")) { // started by -batch: color <ini> -worker <outdir> <threads>
+		set_setting("threads", atoi(argv[4]));
+		calculate_parameters(get_setting_or("time_interval", timeInterval));
+		
+		return run_worker(argv[3], samples, scale_x, scale_y, get_setting_or("bw", 0));
+	} else if(argc > 2) { // decode capture files instead of the scope: color <ini> <file or dir> [outdir]
+		calculate_parameters(get_setting_or("time_interval", timeInterval));
+		if(video_path != NULL && open_video(video_path, scale_x, scale_y))
+			return -1;
+		
+		i = run_headless(argv[2], argc > 3 ? argv[3] : ".", samples, scale_x, scale_y, get_setting_or("bw", 0));
+		
+		close_video();
+		stats_snapshot(stdout, STATS_TEXT);
+		
+		return i;
+	} else {
+		pipe.handle = init_ps3000(timebase, samples, &timeInterval);
+		pipe.timebase = timebase;
+		if(pipe.handle == -1) {
+			printf("Could not initialize the scope! Exiting...\n");
+			return -1;
+		}
 	}
 	
 	// calculate parameters
 	calculate_parameters(timeInterval);
 	
-	if(SDL_Init(SDL_INIT_VIDEO) < 0) {
-		fprintf(stderr, "Couldn't initialize SDL: %s\n",SDL_GetError());
-		return(1);
-	}
-
-	// initialize screen size based on need
-	if((screen=SDL_SetVideoMode(copy_width >> (-scale_x), 2 * (252 - crop_top - crop_bottom), 
-			32, SDL_SWSURFACE)) == NULL ) {
-		fprintf(stderr, "Couldn't set video mode: %s\n", SDL_GetError());
-		quit(2);
-	}
-	printf("Set window size to %d x %d\n", copy_width >> (-scale_x), 2 * (252 - crop_top - crop_bottom));
+	SetConsoleCtrlHandler(console_handler, TRUE);
 	
-	SDL_WM_SetCaption("PS3000 Composite Video Decoder", "PS3000 Composite...");
-		
-	buffer = (short *)malloc(sizeof(short) * samples);
-	if(buffer == NULL) {
-		printf("Ran out of memory while allocating %ld sample buffer\n", samples);
-		deinit_ps3000(handle);
+	if(video_path != NULL && open_video(video_path, scale_x, scale_y)) {
+		if(pipe.source == NULL)
+			deinit_ps3000(pipe.handle);
 		return -1;
 	}
 	
-	// allocate space for field buffer
-	field = SDL_CreateRGBSurface(SDL_SWSURFACE, scanline_w, 252,
-		32, 0xFF0000, 0xFF00, 0xFF, 0);
+	if(get_setting_or("window", 1)) { // the window is just one reader of the decoded fields
+		if(SDL_Init(SDL_INIT_VIDEO) < 0) {
+			fprintf(stderr, "Couldn't initialize SDL: %s\n",SDL_GetError());
+			return(1);
+		}
+
+		// initialize screen size based on need
+		if((screen=SDL_SetVideoMode(frame_width(scale_x), 2 * (252 - crop_top - crop_bottom), 
+				32, SDL_SWSURFACE)) == NULL ) {
+			fprintf(stderr, "Couldn't set video mode: %s\n", SDL_GetError());
+			quit(2);
+		}
+		printf("Set window size to %d x %d\n", frame_width(scale_x), 2 * (252 - crop_top - crop_bottom));
+		
+		SDL_WM_SetCaption("PS3000 Composite Video Decoder", "PS3000 Composite...");
+	} else
+		printf("No window, press Ctrl+C to stop\n");
+		
+	init_color_waves();
+	init_color_kernel();
+	init_deinterlacers();
+	init_denoiser();
+	init_decode_pool();
 	
-	// calculate reference color waveforms
-	color_wave1 = (int *)malloc(sizeof(int) * scanline_w * 2);
-	color_wave2 = (int *)malloc(sizeof(int) * scanline_w * 2);
-	if(color_wave1 == NULL || color_wave2 == NULL) {
-		printf("Could not allocate color buffers!");
+	if(pipeline_start(&pipe, samples)) {
+		pipeline_stop(&pipe);
+		if(pipe.source == NULL)
+			deinit_ps3000(pipe.handle);
 		quit(2);
 	}
 	
-	for(i = 0; i < scanline_w * 2; i++) {
-		color_wave1[i] = (int)(MUL_WAVE * sin(2.0 * M_PI * (float)i / f_wavelength));
-		color_wave2[i] = (int)(MUL_WAVE * sin(2.0 * M_PI * (float)i / f_wavelength - M_PI / 2.0));
-	}
+	stats_interval = get_setting_or("stats_interval", 0); // seconds between snapshots, 0 for only on 's'
+	stats_saved = time(NULL);
 	
 	while(!done) {
-		start_timeprofile(TP_FRAME);
+		frame_started = stats_now();
 		
-		start_timeprofile(TP_PICO);
-		gotSamples = capture_ps3000(handle, buffer, samples, timebase, &overflow);
-		end_timeprofile(TP_PICO);
-		
-		if(gotSamples == samples && !overflow) {
-			if(first_run) {
-				analyze_samples(buffer, samples);				
-				first_run = 0;
+		// present the newest field the decoder has finished, wait a bit if there's nothing
+		if((slot = present_take(&pipe.present, 20)) >= 0) {
+			if(screen != NULL) {
+				started = stats_now();
+				show_field(&deint_frame, screen, pipe.field[slot], pipe.field_num[slot], &pipe.field_crop[slot],
+					scale_x, scale_y, blur, sample);
+				stats_record(TP_DRAW, started);
+				stats_count(CT_SHOWN, 1);
 			}
 			
-			field_count = 0;
-			for(i=0; i<samples && field_count < 2;) {
-				// skip a bit back for consecutive frames to allow VSYNC detection
-				if(i > 2 * scanline_w)
-					i -= 2 * scanline_w;
-				
-				start_timeprofile(TP_FIELD);
-				i += extract_field(field, buffer+i, samples-i, &field_num, bw ? &extract_bw : &extract_color);
-				end_timeprofile(TP_FIELD);
-				
-				if(field_num != -1) {
-					start_timeprofile(TP_DRAW);
-					draw_screen(screen, field, field_num, scale_x, scale_y, blur, sample);
-					end_timeprofile(TP_DRAW);
-					field_count++; // field successfully drawn
-				}
-			}
+			// a live signal doesn't wait for a slow encoder, a file can
+			if(video.file != NULL)
+				stream_field(pipe.field[slot], pipe.field_num[slot], &pipe.field_crop[slot], scale_x, scale_y,
+					pipe.source != NULL ? INFINITE : 0);
 			
-			update_screen(screen);
-		} else {
-			printf("Failed capture\n");
-		}
+			// the field is in the window surface now, the decoder can have it
+			// back while the screen updates
+			published = pipe.present.published_at[slot];
+			present_release(&pipe.present);
+			
+			if(screen != NULL) {
+				update_screen(screen);
+				stats_record(TP_PRESENT, published);
+			}
+		} else if(pipe.decoded && !present_pending(&pipe.present))
+			done = 1; // capture file played through
+		
+		if(console_closed || video.failed) // stopped, or the encoder went away
+			done = 1;
 		
-		while(SDL_PollEvent(&event)) {
+		while(screen != NULL && SDL_PollEvent(&event)) {
 			switch(event.type) {
 			case SDL_MOUSEBUTTONDOWN:
 #ifdef DEBUG
@@ -673,59 +3125,51 @@ int main(int argc, char *argv[]) {
 			case SDL_KEYDOWN:
 				switch(event.key.keysym.scancode) {
 				case 57: // space
-					bw = !bw;
+					pipe.bw = !pipe.bw;
 					break;
 				case 28: // enter
-					first_run = 1; // reinitialize values based on current display
+					pipe.first_run = 1; // reinitialize values based on current display
 					break;
 				case 75: // left
 					if(scale_x > MIN_SCALE_X)
 						scale_x--;
-					clear_surface(field);
+					InterlockedIncrement(&pipe.clear_fields);
 					clear_surface(screen);
 					break;
 				case 77: // right
 					if(scale_x < MAX_SCALE_X)
 						scale_x++;
-					clear_surface(field);
+					InterlockedIncrement(&pipe.clear_fields);
 					clear_surface(screen);
 					break;
 				case 72: // up
 					if(scale_y > MIN_SCALE_Y)
 						scale_y--;
-					clear_surface(field);
+					InterlockedIncrement(&pipe.clear_fields);
 					clear_surface(screen);
 					break;
 				case 80: // down
 					if(scale_y < MAX_SCALE_Y)
 						scale_y++;
-					clear_surface(field);
+					InterlockedIncrement(&pipe.clear_fields);
 					clear_surface(screen);
 					break;
 				case 78: // +
-					if(event.key.keysym.mod & KMOD_SHIFT) {
-						adj_crop_right++;
-						set_setting("crop_right", adj_crop_right);
-					} else {
-						adj_crop_left++;
-						set_setting("crop_left", adj_crop_left);
-					}
-					calculate_parameters(timeInterval);
-					clear_surface(field);
-					clear_surface(screen);
-					break;
 				case 74: // -
-					if(event.key.keysym.mod & KMOD_SHIFT) {
-						if(adj_crop_right > 0)
-							adj_crop_right--;
-						set_setting("crop_right", adj_crop_right);
-					} else {
-						if(adj_crop_left > 0)
-							adj_crop_left--;
-						set_setting("crop_left", adj_crop_left);
-					}
-					calculate_parameters(timeInterval);
-					clear_surface(field);
+					i = (event.key.keysym.scancode == 78) ? 1 : -1;
+					if(event.key.keysym.mod & KMOD_SHIFT)
+						adj_crop_right = MAX(0, adj_crop_right + i);
+					else
+						adj_crop_left = MAX(0, adj_crop_left + i);
+					
+					set_setting("crop_left", adj_crop_left);
+					set_setting("crop_right", adj_crop_right);
+					
+					// the decoder is using the crop, it picks the new one up
+					// before its next block and clears the fields
+					pipe.crop_left = adj_crop_left;
+					pipe.crop_right = adj_crop_right;
+					InterlockedExchange(&pipe.recrop, 1);
 					clear_surface(screen);
 					break;
 				case 2: case 3: case 4: // 1, 2, 3
@@ -734,6 +3178,9 @@ int main(int argc, char *argv[]) {
 				case 16: case 17: case 18: // q, w, e
 					sample = event.key.keysym.scancode - 15;
 					break;
+				case 31: // s
+					save_stats(".");
+					break;
 				default:
 					printf("No function for key %d\n", event.key.keysym.scancode);
 				}				
@@ -744,22 +3191,30 @@ int main(int argc, char *argv[]) {
 			}
 		}
 		
-		end_timeprofile(TP_FRAME);
+		if(stats_interval > 0 && time(NULL) - stats_saved >= stats_interval) {
+			save_stats(".");
+			stats_saved = time(NULL);
+		}
+		
+		stats_record(TP_FRAME, frame_started);
 	}
 	
-	printf("\n\n");
-	print_timeprofile("Frames", TP_FRAME);
-	printf("\n\n");
-	compare_timeprofiles("Picoscope", TP_PICO, "Frames", TP_FRAME);
-	compare_timeprofiles("Field", TP_FIELD, "Frames", TP_FRAME);
-	compare_timeprofiles("Draw", TP_DRAW, "Frames", TP_FRAME);
-	printf("\n\n");
-	compare_timeprofiles("Scanline", TP_SCANLINE, "Field", TP_FIELD);
-	compare_timeprofiles("Color burst", TP_BURST, "Scanline", TP_SCANLINE);
+	pipeline_stop(&pipe);
+	close_video();
 	
-	deinit_ps3000(handle);
+	printf("\n");
+	stats_snapshot(stdout, STATS_TEXT);
 	
-	SDL_FreeSurface(field);
+	if(pipe.source != NULL)
+		CloseHandle(pipe.source);
+	else
+		deinit_ps3000(pipe.handle);
+	
+	if(decode_pool != NULL)
+		pool_destroy(decode_pool);
+	free_deinterlacers();
+	resampler_free(&scaler);
+	denoise_free(&field_denoise);
 	free(color_wave1);
 	free(color_wave2);
 	
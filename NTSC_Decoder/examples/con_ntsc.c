@@ -8,6 +8,8 @@
 #include <conio.h>
 
 #include "ps2000.h"
+#include "levels.h"
+#include "sync.h"
 
 #include "SDL/SDL.h"
 
@@ -35,10 +37,11 @@ int level_black, level_white; // signal levels for total black and white, respec
 // data in surface will get garbled in case of -1
 int extractFrame(SDL_Surface *surface, short * samples, int length, int align) {
 	Uint32 *buffer;
+	sync_slicer slicer;
 	
-	int i = screen_width, j, offset, value, longs;
+	int i = screen_width, j, offset, next, previous, value, longs;
 	int state = ST_WAIT_NORMAL;
-	int is_high, count, is_transition;
+	int is_high, count;
 
 	if ( SDL_LockSurface(surface) < 0 ) {
 		fprintf(stderr, "Couldn't lock the display surface: %s\n",
@@ -48,88 +51,86 @@ int extractFrame(SDL_Surface *surface, short * samples, int length, int align) {
 	
 	buffer=(Uint32 *)surface->pixels;
 		
-	// loop through data
-	for(offset=0, j=0, count=0; offset < length && j < surface->h; offset++) {
-		// set is_high, is_transition
-		if(samples[offset] <= treshold) { // low
-			is_transition = is_high ? 1 : 0;
-			is_high = 0;
-		} else { // high
-			is_transition = is_high ? 0 : 1;
-			is_high = 1;
-		}
+	slicer_init(&slicer, samples, 0, length, treshold, 0);
+	
+	// loop through data one level run at a time, from edge to edge
+	for(offset = slicer_next(&slicer), j=0, previous=0; offset < length && j < surface->h; offset = next) {
+		is_high = !slicer.is_sync;
+		count = offset - previous; // length of the previous run
+		previous = offset;
 		
-		if(is_transition) { // only handle state changes on transitions
-			/*if(is_high)
-				printf("%3d x low (state: %d) %d\n", count, state, longs);
-			else
-				printf("%3d x high ", count);*/
-			
-			switch(state) {
-			case ST_WAIT_NORMAL:
-				if(!is_high && count > screen_width) // start hsync, last scanline was normal
-					state++;
-				break;
-			case ST_WAIT_BLANK:
-				if(!is_high && count < screen_width) { // first vsync period
-					state++;
-					longs = (count > long_high) ? 1 : 0; // should always be 1
-				}
-				break;
-			case ST_COUNT_LONGS:
-				if(!is_high) {
-					if(count > long_high) // another long
-						longs++;
-					else // longs counted
-						state++;
-				}
-				break;
-			case ST_WAIT_NON_BLANK:
-				if(!is_high && count > screen_width) // start hsync, last scanline was normal
+		/*if(is_high)
+			printf("%3d x low (state: %d) %d\n", count, state, longs);
+		else
+			printf("%3d x high ", count);*/
+		
+		switch(state) {
+		case ST_WAIT_NORMAL:
+			if(!is_high && count > screen_width) // start hsync, last scanline was normal
+				state++;
+			break;
+		case ST_WAIT_BLANK:
+			if(!is_high && count < screen_width) { // first vsync period
+				state++;
+				longs = (count > long_high) ? 1 : 0; // should always be 1
+			}
+			break;
+		case ST_COUNT_LONGS:
+			if(!is_high) {
+				if(count > long_high) // another long
+					longs++;
+				else // longs counted
 					state++;
-				break;
-			case ST_DRAW:
-				if(!is_high) { // start hsync
-					if(count < screen_width) { // start vsync
-						//printf("%d lines and %d longs decoded\n", j, longs);
-						if(j < 252) { // not enough scanlines
-							SDL_UnlockSurface(surface);
-							return -1;
-						} else {
-							SDL_UnlockSurface(surface);
-							return (longs == 7) ? 0 : 1; // determine field number
-						}
-					} else { // new scanline
-						j++;
-						i=0;
+			}
+			break;
+		case ST_WAIT_NON_BLANK:
+			if(!is_high && count > screen_width) // start hsync, last scanline was normal
+				state++;
+			break;
+		case ST_DRAW:
+			if(!is_high) { // start hsync
+				if(count < screen_width) { // start vsync
+					//printf("%d lines and %d longs decoded\n", j, longs);
+					if(j < 252) { // not enough scanlines
+						SDL_UnlockSurface(surface);
+						return -1;
+					} else {
+						SDL_UnlockSurface(surface);
+						return (longs == 7) ? 0 : 1; // determine field number
 					}
-				} else {
-					if(align & 1)
-						i = count-28; /*+ (longs == 7 ? align : 0)*/; // remove stutter
+				} else { // new scanline
+					j++;
+					i=0;
 				}
-				break;
+			} else {
+				if(align & 1)
+					i = count-28; /*+ (longs == 7 ? align : 0)*/; // remove stutter
 			}
-			count = 1;
-		} else
-			count++;
+			break;
+		}
+		
+		next = slicer_next(&slicer);
 			
 		if(state != ST_DRAW || !is_high)
 			continue;
 		
-		// very crude manual alignment works with odd values of "align" (cursor left/right changes "align")
-		/*if((align&1) && count > 25 && count < 40 && samples[offset-1] < align_treshold && samples[offset] >= align_treshold)
-			i = 39-count; //printf("%d\n", count+i);*/
+		// draw the whole high run up to the next edge
+		for(count = 1; offset < next; offset++, count++) {
+			// very crude manual alignment works with odd values of "align" (cursor left/right changes "align")
+			/*if((align&1) && count > 25 && count < 40 && samples[offset-1] < align_treshold && samples[offset] >= align_treshold)
+				i = 39-count; //printf("%d\n", count+i);*/
+				
+			value = 256 * (samples[offset]-level_black) / (level_white-level_black);
 			
-		value = 256 * (samples[offset]-level_black) / (level_white-level_black);
-		
-		if(value > 255)
-			value = 255;
-		if(value < 0)
-			value = 0;
-		
-		if(i < surface->w)
-			buffer[j*surface->pitch/4 + (count + i) * 2] = value * 0x10101;
-			buffer[j*surface->pitch/4 + (count + i) * 2 + 1] = value * 0x10101;
+			if(value > 255)
+				value = 255;
+			if(value < 0)
+				value = 0;
+			
+			if(i < surface->w)
+				buffer[j*surface->pitch/4 + (count + i) * 2] = value * 0x10101;
+				buffer[j*surface->pitch/4 + (count + i) * 2 + 1] = value * 0x10101;
+		}
 	}
 		
 	printf("Ran out of data at %d lines\n", j);
@@ -192,7 +193,8 @@ int main(int argc, char *argv[]) {
 
 	short handle;
 	int capture_interval;
-	int count[65536], i, sum, total;
+	level_hist hist;
+	int i;
 	
 	if(argc == 1)
 		capture_interval = 150;
@@ -219,29 +221,13 @@ int main(int argc, char *argv[]) {
 	/* Try to guess a good treshold value */
 	treshold = 2048; // initial guess
 	
-	for(i=0; i<65536; i++)
-		count[i] = 0;
-		
-	total = 0;
-	for(i=0; i<CAPTURE_LENGTH; i++) {
-		if(streaming_buffer[i] > -32768) {
-			count[streaming_buffer[i] + 32768]++;
-			total++;
-		}
-	}
+	if(level_hist_init(&hist))
+		return(1);
 	
-	sum = 5 * total / 100; // blanking periods are about 9.5 % of the signal
+	level_hist_add(&hist, streaming_buffer, CAPTURE_LENGTH);
 	
-	for(i=0; i<65536 && sum >= 0; i++) {
-		if(!count[i])
-			continue;
-			
-		printf("At %d, sum is still %d, decreasing by %d\n", i, sum, count[i]);
-		sum -= count[i];
-		
-		if(sum < 0)
-			treshold = i - 32768 + 1;
-	}
+	if(hist.total > 0) // blanking periods are about 9.5 % of the signal
+		treshold = level_hist_percentile(&hist, 0.05) + 1;
 	
 	printf("Treshold set at %d\n", treshold);
 	
@@ -259,18 +245,8 @@ int main(int argc, char *argv[]) {
 	field = SDL_CreateRGBSurface(SDL_SWSURFACE, 800, 600, 32, 0xFF0000, 0xFF00, 0xFF, 0);
 	
 	// find minimum and maximum colors
-	level_black = 65536;
-	level_white = 0;
-	
-	for(i=0; i<CAPTURE_LENGTH; i++) {
-		if(streaming_buffer[i] < treshold)
-			continue;
-			
-		if(streaming_buffer[i] < level_black)
-			level_black = streaming_buffer[i];
-		if(streaming_buffer[i] > level_white)
-			level_white = streaming_buffer[i];
-	}
+	level_black = level_hist_next(&hist, treshold - 1);
+	level_white = hist.max;
 	
 	redraw = 1;
 	while(!done) {
@@ -303,14 +279,14 @@ int main(int argc, char *argv[]) {
 					break;
 				case 72: // up
 					// raise black point
-					for(i=level_black-1; i > treshold && !count[i+32768]; i--) {}
+					i = level_hist_prev(&hist, level_black);
 					if(i > treshold)
 						level_black = i;
 					break;
 				case 80: // down
 					// lower black point
-					for(i=level_black+1; i < 32768 && !count[i+32768]; i++) {}
-					if(i < 32768)
+					i = level_hist_next(&hist, level_black);
+					if(i <= 32767)
 						level_black = i;
 					break;
 				case 78: // +
@@ -328,6 +304,7 @@ int main(int argc, char *argv[]) {
 	}
 	
 	ps2000_close_unit(handle);
+	level_hist_free(&hist);
 	
 	SDL_Quit();
 		
@@ -9,6 +9,11 @@
 
 #include "util.h"
 #include "picoutil.h"
+#include "threadpool.h"
+#include "sync.h"
+#include "levels.h"
+#include "deint.h"
+#include "present.h"
 
 #include "SDL/SDL.h"
 
@@ -25,6 +30,8 @@ int screen_width; // when there's more pixels than this, it's a normal scanline
 int long_high, long_low; // amount of samples in a long high or low pulse within VSYNC
 int level_black, level_white; // signal levels for total black and white, respectively
 
+level_hist signal_hist; // amplitude histogram of the samples levels were last picked from
+
 // rough scanline timings from HSYNC start:
 // sync length 4.3 us
 // colourburst area ends 9.0 us
@@ -37,13 +44,19 @@ void calculate_parameters(long timeInterval, short * buffer, long samples) {
 	long_high = 15000/timeInterval;
 	long_low = 15000/timeInterval;
 
-	// Try to guess a good treshold value
-	treshold = get_min(buffer, samples);
-	treshold = get_next(buffer, samples, treshold);
+	signal_levels levels;
+	
+	if(signal_hist.count == NULL && level_hist_init(&signal_hist))
+		return; // keep the old levels
 	
-	// find minimum and maximum colors
-	level_white = get_max(buffer, samples);
-	level_black = get_next(buffer, samples, treshold);
+	// treshold, black and white levels from a single pass over the samples
+	level_hist_clear(&signal_hist);
+	level_hist_add(&signal_hist, buffer, samples);
+	level_hist_levels(&signal_hist, &levels);
+	
+	treshold = levels.treshold;
+	level_white = levels.white;
+	level_black = levels.black;
 }
 
 #define MIN_SCALE_X -2
@@ -110,99 +123,145 @@ void draw_scanline(Uint32 *buffer, SDL_Surface *surface, short *samples, int sca
 	}
 }
 
+#define MAX_LINES 300 // 252 visible scanlines so this should be plenty
+
+// Scanline found by the sync pass of extract_field
+typedef struct {
+	int row;
+	int start; // offset of HSYNC start in samples
+	int offset; // offset of HSYNC end in samples
+} scanline_pos;
+
+typedef struct {
+	SDL_Surface *surface;
+	short *samples;
+	scanline_pos *lines;
+	int scale_x;
+} field_job;
+
+threadpool *decode_pool = NULL; // NULL draws scanlines on the calling thread
+
+static void decode_scanline(void *context, int index) {
+	field_job *job = (field_job *)context;
+	scanline_pos *pos = job->lines + index;
+	
+	draw_scanline((Uint32 *)job->surface->pixels, job->surface, job->samples, pos->start, pos->offset, pos->row, job->scale_x);
+}
+
 // Extract NTSC field from samples, and determine if it's partial, first, or second field
 // returns the amount of samples processed
 // sets fieldtype to -1 for partial field, 0 for first field and 1 for second field
 // set scale_x to -1 to halve the width, 0 to leave intact, 1 to double
 int extract_field(SDL_Surface *surface, short * samples, int length, int scale_x, int *field_type) {
-	Uint32 *buffer;
+	scanline_pos lines[MAX_LINES];
+	field_job job;
+	sync_slicer slicer;
 	
-	int j, offset, scanline_start = 0, longs = 0;
+	int i, j, offset, previous = -1, scanline_start = 0, longs = 0, found = 0;
 	int state = ST_WAIT_NORMAL;
-	int is_sync = 0, count, is_transition = 0;
+	int is_sync, count;
 
-	if ( SDL_LockSurface(surface) < 0 ) {
-		fprintf(stderr, "Couldn't lock the display surface: %s\n",
-				SDL_GetError());
-		quit(2);
-	}
+	slicer_init(&slicer, samples, 0, length, treshold, 0);
 	
-	buffer=(Uint32 *)surface->pixels;
+	// sync pass: jump from edge to edge and collect the scanlines of the field
+	for(j=0; j < surface->h && (offset = slicer_next(&slicer)) < length; ) {
+		is_sync = slicer.is_sync;
+		count = offset - previous - 1; // samples since the last transition
+		previous = offset;
 		
-	// loop through data
-	for(offset=0, j=0, count=0; offset < length && j < surface->h; offset++) {
-		// set is_sync, is_transition
-		if(samples[offset] <= treshold) { // low
-			is_transition = is_sync ? 0 : 1;
-			is_sync = 1;
-		} else { // high
-			is_transition = is_sync ? 1 : 0;
-			is_sync = 0;
-		}
-		
-		if(is_transition) { // only handle state changes on transitions			
-			switch(state) {
-			case ST_WAIT_NORMAL:
-				if(is_sync && count > screen_width) // start hsync, last scanline was normal
-					state++;
-				break;
-			case ST_WAIT_BLANK:
-				if(is_sync && count < screen_width) { // first vsync period
-					state++;
-					longs = (count > long_high) ? 1 : 0; // should always be 1
-				}
-				break;
-			case ST_COUNT_LONGS:
-				if(is_sync) {
-					if(count > long_high) // another long
-						longs++;
-					else // longs counted
-						state++;
-				}
-				break;
-			case ST_WAIT_NON_BLANK:
-				if(is_sync && count > screen_width) // start hsync, last scanline was normal
+		switch(state) {
+		case ST_WAIT_NORMAL:
+			if(is_sync && count > screen_width) // start hsync, last scanline was normal
+				state++;
+			break;
+		case ST_WAIT_BLANK:
+			if(is_sync && count < screen_width) { // first vsync period
+				state++;
+				longs = (count > long_high) ? 1 : 0; // should always be 1
+			}
+			break;
+		case ST_COUNT_LONGS:
+			if(is_sync) {
+				if(count > long_high) // another long
+					longs++;
+				else // longs counted
 					state++;
-				break;
-			case ST_DRAW:
-				if(is_sync) { // start hsync
-					if(count < screen_width) { // start vsync
-						//printf("%d lines and %d longs decoded\n", j, longs);
-						if(j < 252) { // not enough scanlines - partial field
-							SDL_UnlockSurface(surface);
-							*field_type = -1;
-							return offset;
-						} else {
-							SDL_UnlockSurface(surface);
-							*field_type = (longs == 7) ? 0 : 1; // determine field number
-							return offset;
-						}
-					} else { // next scanline
-						j++;
-						scanline_start = offset;
+			}
+			break;
+		case ST_WAIT_NON_BLANK:
+			if(is_sync && count > screen_width) // start hsync, last scanline was normal
+				state++;
+			break;
+		case ST_DRAW:
+			if(is_sync) { // start hsync
+				if(count < screen_width) { // start vsync
+					//printf("%d lines and %d longs decoded\n", j, longs);
+					if(j < 252) { // not enough scanlines - partial field
+						*field_type = -1;
+						return offset;
+					}
+					
+					// pixel pass, every scanline can be drawn independently
+					if ( SDL_LockSurface(surface) < 0 ) {
+						fprintf(stderr, "Couldn't lock the display surface: %s\n",
+								SDL_GetError());
+						quit(2);
 					}
-				} else { // end hsync
-					if(scanline_start + scanline_w < length)
-						draw_scanline(buffer, surface, samples, scanline_start, offset, j, scale_x);
-					// remove stutter
+					
+					job.surface = surface;
+					job.samples = samples;
+					job.lines = lines;
+					job.scale_x = scale_x;
+					
+					if(decode_pool != NULL)
+						pool_run(decode_pool, &decode_scanline, &job, found);
+					else
+						for(i = 0; i < found; i++)
+							decode_scanline(&job, i);
+					
+					SDL_UnlockSurface(surface);
+					*field_type = (longs == 7) ? 0 : 1; // determine field number
+					return offset;
+				} else { // next scanline
+					j++;
+					scanline_start = offset;
 				}
-				break;
+			} else { // end hsync
+				if(scanline_start + scanline_w < length && found < MAX_LINES) {
+					lines[found].row = j;
+					lines[found].start = scanline_start;
+					lines[found].offset = offset;
+					found++;
+				}
+				// remove stutter
 			}
-			count = 0;
-		} else
-			count++;
+			break;
+		}
 	}
 				
-	SDL_UnlockSurface(surface);
 	*field_type = -1;
-	return offset; // data ran out
+	return (j < surface->h) ? offset : offset + 1; // data ran out or too many scanlines
 }
 
 int crop_left, copy_width, crop_top, crop_bottom;
 
+deinterlacer deint; // writes unscaled frames in one pass
+
 void draw_screen(SDL_Surface *screen, SDL_Surface *half, int field_num, int scale_x, int scale_y) {
 	SDL_Rect src, dest;
-	int crop_x, copy_w;
+	int crop_x, copy_w, failed;
+	
+	if(scale_x == 0 && scale_y == 0 && SDL_LockSurface(screen) == 0) {
+		failed = deint_field(&deint, (unsigned int *)screen->pixels, screen->pitch / 4, 
+			(unsigned int *)((char *)half->pixels + crop_top * half->pitch) + crop_left, half->pitch / 4, field_num, 
+			MIN(copy_width, MIN(screen->w, half->w - crop_left)), MIN(252 - crop_top - crop_bottom, screen->h / 2));
+		SDL_UnlockSurface(screen);
+		
+		if(!failed)
+			return;
+	}
+	
+	deint_reset(&deint);
 	
 	switch(scale_x) {
 	case -2:
@@ -257,18 +316,134 @@ void clear_surface(SDL_Surface *surface) {
 	SDL_UnlockSurface(surface);
 }
 
+#define FIELD_BUFFERS 3 // triple buffered, so the decoder never waits for the window
+
+// The scope is read and decoded on a thread of its own and the main thread
+// only presents the newest field, so a slow window never holds up decoding.
+// Everything else that touches the samples is handed to the decoder too.
+typedef struct {
+	short handle, *buffer;
+	long samples, timeInterval;
+	unsigned long timebase;
+	
+	presenter present;
+	SDL_Surface *field[FIELD_BUFFERS];
+	int field_num[FIELD_BUFFERS];
+	
+	HANDLE thread;
+	volatile LONG quit;
+	volatile int scale_x;
+	
+	// changed from the keyboard, the decoder takes them between captures
+	volatile LONG recalibrate;
+	volatile LONG black_steps, white_steps; // key presses not applied yet, negative lowers the point
+	volatile LONG clear_fields; // bumped to clear every field buffer once
+	LONG cleared[FIELD_BUFFERS]; // clear_fields when the buffer was last cleared
+} decoder;
+
+// Move a black or white point by steps levels with samples, down for negative
+// steps. Levels at or below the sync treshold are never used.
+static int step_level(int level, int steps) {
+	int i;
+	
+	for(; steps < 0; steps++) {
+		i = level_hist_prev(&signal_hist, level);
+		if(i <= treshold)
+			break;
+		level = i;
+	}
+	
+	for(; steps > 0; steps--) {
+		i = level_hist_next(&signal_hist, level);
+		if(i > 32767)
+			break;
+		level = i;
+	}
+	
+	return level;
+}
+
+// Move the black and white points by the pending key presses, on the levels
+// of the current capture
+static void adjust_levels(short *buffer, long samples, int black_steps, int white_steps) {
+	if(signal_hist.count == NULL)
+		return; // calibration couldn't allocate it either
+	
+	level_hist_clear(&signal_hist);
+	level_hist_add(&signal_hist, buffer, samples);
+	
+	if(black_steps) {
+		level_black = step_level(level_black, black_steps);
+		printf("New black point at %d\n", level_black);
+	}
+	
+	if(white_steps) {
+		level_white = step_level(level_white, white_steps);
+		printf("New white point at %d\n", level_white);
+	}
+}
+
+static DWORD WINAPI decode_fields(LPVOID param) {
+	decoder *dec = (decoder *)param;
+	short overflow;
+	int i, slot = -1, field_num, black_steps, white_steps;
+	LONG clear;
+	
+	while(!dec->quit) {
+		if(capture_ps3000(dec->handle, dec->buffer, dec->samples, dec->timebase, &overflow) != dec->samples || overflow)
+			continue;
+		
+		// reinitialize values based on current sample set
+		if(InterlockedExchange(&dec->recalibrate, 0))
+			calculate_parameters(dec->timeInterval, dec->buffer, dec->samples);
+		
+		black_steps = InterlockedExchange(&dec->black_steps, 0);
+		white_steps = InterlockedExchange(&dec->white_steps, 0);
+		if(black_steps || white_steps)
+			adjust_levels(dec->buffer, dec->samples, black_steps, white_steps);
+		
+		for(i=0; i<dec->samples && !dec->quit;) {
+			// skip a bit back for consecutive frames to allow VSYNC detection
+			if(i > 2 * scanline_w)
+				i -= 2 * scanline_w;
+			
+			// a partial field leaves the buffer to the next one
+			if(slot < 0 && (slot = present_back(&dec->present, 100)) < 0)
+				break;
+			
+			clear = dec->clear_fields;
+			if(dec->cleared[slot] != clear) {
+				clear_surface(dec->field[slot]);
+				dec->cleared[slot] = clear;
+			}
+			
+			i += extract_field(dec->field[slot], dec->buffer+i, dec->samples-i, dec->scale_x, &field_num);
+			
+			if(field_num != -1) {
+				dec->field_num[slot] = field_num;
+				present_publish(&dec->present);
+				slot = -1;
+			}
+		}
+	}
+	
+	return 0;
+}
+
 int main(int argc, char *argv[]) {
-	SDL_Surface *screen, *field = NULL;
-	int done = 0, field_num, scale_x, scale_y;
+	SDL_Surface *screen;
+	int done = 0, scale_x, scale_y;
 	SDL_Event event;
+	decoder dec;
+	present_counters counters;
 
-	short handle, *buffer, overflow;
-	long timeInterval, samples, gotSamples;
-	unsigned long timebase;
-	int i, first_run = 1;
+	short overflow;
+	int i, slot;
 	
 	char inifile[80];
 	
+	memset(&dec, 0, sizeof(decoder));
+	
 	// with timebase > 2, sampling interval = (timebase - 2) * 16 ns
 	if(argc > 1) {
 		strcpy(inifile, argv[1]);
@@ -277,39 +452,39 @@ int main(int argc, char *argv[]) {
 	} else
 		load_settings("console.ini");
 	
-	timebase = get_setting_or("timebase", 6); // 64 ns gets us about 1000 samples per scan line
+	dec.timebase = get_setting_or("timebase", 6); // 64 ns gets us about 1000 samples per scan line
 	scale_x = get_setting_or("scale_x", 0);
 	scale_y = get_setting_or("scale_y", 0);
 	
-	switch(timebase) {
-	case 0: timeInterval = 2; break;
-	case 1: timeInterval = 4; break;
-	case 2: timeInterval = 8; break;
-	default: timeInterval = 16 * (timebase - 2);
+	switch(dec.timebase) {
+	case 0: dec.timeInterval = 2; break;
+	case 1: dec.timeInterval = 4; break;
+	case 2: dec.timeInterval = 8; break;
+	default: dec.timeInterval = 16 * (dec.timebase - 2);
 	}
 	
 	printf("Time interval is %ld ns, estimating %ld samples for a scanline\n",
-		timeInterval, 64000 / timeInterval);
-	samples = (64000/timeInterval) * 2*525; // We'll need two frames long buffer to ensure one whole
+		dec.timeInterval, 64000 / dec.timeInterval);
+	dec.samples = (64000/dec.timeInterval) * 2*525; // We'll need two frames long buffer to ensure one whole
 	
-	handle = init_ps3000(timebase, samples, &timeInterval);
-	if(handle == -1) {
+	dec.handle = init_ps3000(dec.timebase, dec.samples, &dec.timeInterval);
+	if(dec.handle == -1) {
 		printf("Could not initialize the scope! Exiting...\n");
 		return -1;
 	}
 	
-	printf("Got time interval of %ld\n", timeInterval);
+	printf("Got time interval of %ld\n", dec.timeInterval);
 	
 	// We can now calculate default crop values
 	crop_left = get_setting_or("crop_left", 0);
-	copy_width = get_setting_or("copy_width", 64000/timeInterval);
+	copy_width = get_setting_or("copy_width", 64000/dec.timeInterval);
 	crop_top = get_setting_or("crop_top", 0);
 	crop_bottom = get_setting_or("crop_bottom", 0);
 	
-	buffer = (short *)malloc(sizeof(short) * samples);
-	if(buffer == NULL) {
-		printf("Ran out of memory while allocating %ld sample buffer\n", samples);
-		deinit_ps3000(handle);
+	dec.buffer = (short *)malloc(sizeof(short) * dec.samples);
+	if(dec.buffer == NULL) {
+		printf("Ran out of memory while allocating %ld sample buffer\n", dec.samples);
+		deinit_ps3000(dec.handle);
 		return -1;
 	}
 	
@@ -326,38 +501,59 @@ int main(int argc, char *argv[]) {
 	
 	SDL_WM_SetCaption("PS3000 Composite Video Decoder", "PS3000 Composite...");
 	
-	while(!done) {
-		gotSamples = capture_ps3000(handle, buffer, samples, timebase, &overflow);
-		
-		if(gotSamples == samples && !overflow) {
-			if(first_run) {
-				// calculate parameters
-				calculate_parameters(timeInterval, buffer, samples);
-				
-				// on first run, we use default black and white points if available
-				level_black = get_setting_or("level_black", level_black);
-				level_white = get_setting_or("level_white", level_white);
-				
-				printf("Scanline should be about %d samples\n", scanline_w);
-				// allocate space for field buffer
-				field = SDL_CreateRGBSurface(SDL_SWSURFACE, 
-					11 * scanline_w / 10, // allocate about 10% extra for scanline
-					300, // 252 visible scanlines so this should be plenty
-					32, 0xFF0000, 0xFF00, 0xFF, 0);
-					
-				first_run = 0;
-			}
-			
-			for(i=0; i<samples;) {
-				// skip a bit back for consecutive frames to allow VSYNC detection
-				if(i > 2 * scanline_w)
-					i -= 2 * scanline_w;
-					
-				i += extract_field(field, buffer+i, samples-i, scale_x, &field_num);
-				
-				if(field_num != -1)
-					draw_screen(screen, field, field_num, scale_x, scale_y);
+	// 0 weave, 1 bob, 2 motion adaptive
+	if(deint_init(&deint, get_setting_or("deinterlace", DEINT_WEAVE), get_setting_or("deint_threshold", 24)))
+		deint_init(&deint, DEINT_WEAVE, 0);
+	
+	// scanline drawing threads, setting threads = 0 uses all processors
+	if(get_setting_or("threads", 0) != 1)
+		decode_pool = pool_create(get_setting_or("threads", 0));
+	
+	// the first capture sets the signal parameters and the field size, the
+	// window keeps handling events until there is one
+	while(capture_ps3000(dec.handle, dec.buffer, dec.samples, dec.timebase, &overflow) != dec.samples || overflow) {
+		while(SDL_PollEvent(&event)) {
+			if(event.type == SDL_QUIT) {
+				deinit_ps3000(dec.handle);
+				if(decode_pool != NULL)
+					pool_destroy(decode_pool);
+				deint_free(&deint);
+				quit(0);
 			}
+		}
+	}
+	
+	calculate_parameters(dec.timeInterval, dec.buffer, dec.samples);
+	
+	// on first run, we use default black and white points if available
+	level_black = get_setting_or("level_black", level_black);
+	level_white = get_setting_or("level_white", level_white);
+	
+	printf("Scanline should be about %d samples\n", scanline_w);
+	
+	for(i = 0; i < FIELD_BUFFERS; i++) {
+		dec.field[i] = SDL_CreateRGBSurface(SDL_SWSURFACE, 
+			11 * scanline_w / 10, // allocate about 10% extra for scanline
+			MAX_LINES, 32, 0xFF0000, 0xFF00, 0xFF, 0);
+		if(dec.field[i] == NULL) {
+			fprintf(stderr, "Could not allocate field buffers: %s\n", SDL_GetError());
+			quit(2);
+		}
+	}
+	
+	dec.scale_x = scale_x;
+	
+	if(present_init(&dec.present, FIELD_BUFFERS, 0) || 
+			(dec.thread = CreateThread(NULL, 0, decode_fields, &dec, 0, NULL)) == NULL) {
+		printf("Could not start the decoder thread\n");
+		quit(2);
+	}
+	
+	while(!done) {
+		// show the newest field, the decoder is already working on the next one
+		if((slot = present_take(&dec.present, 20)) >= 0) {
+			draw_screen(screen, dec.field[slot], dec.field_num[slot], scale_x, scale_y);
+			present_release(&dec.present);
 			update_screen(screen);
 		}
 		
@@ -371,62 +567,41 @@ int main(int argc, char *argv[]) {
 				//fprintf(stderr, "Key %d pressed\n", event.key.keysym.scancode);
 				switch(event.key.keysym.scancode) {
 				case 57: // space
-					// reinitialize values based on current sample set
-					calculate_parameters(timeInterval, buffer, samples); 
+					InterlockedExchange(&dec.recalibrate, 1);
 					break;
 				case 75: // left
 					if(scale_x > MIN_SCALE_X)
 						scale_x--;
-					clear_surface(field);
+					dec.scale_x = scale_x;
+					InterlockedIncrement(&dec.clear_fields);
 					break;
 				case 77: // right
 					if(scale_x < MAX_SCALE_X)
 						scale_x++;
-					clear_surface(field);
+					dec.scale_x = scale_x;
+					InterlockedIncrement(&dec.clear_fields);
 					break;
 				case 72: // up
 					if(event.key.keysym.mod & KMOD_SHIFT) {
 						if(scale_y > MIN_SCALE_Y)
 							scale_y--;
-						clear_surface(field);
-					} else {
-						// lower black point
-						i = get_prev(buffer, samples, level_black);
-						if(i > treshold) {
-							level_black = i;
-							printf("New black point at %d\n", level_black);
-						}	
-					}
+						InterlockedIncrement(&dec.clear_fields);
+					} else
+						InterlockedDecrement(&dec.black_steps); // lower black point
 					break;
 				case 80: // down
 					if(event.key.keysym.mod & KMOD_SHIFT) {
 						if(scale_y < MAX_SCALE_Y)
 							scale_y++;
-						clear_surface(field);
-					} else {
-						// raise black point
-						i = get_next(buffer, samples, level_black);
-						if(i < 32767) {
-							level_black = i;
-							printf("New black point at %d\n", level_black);
-						}
-					}
+						InterlockedIncrement(&dec.clear_fields);
+					} else
+						InterlockedIncrement(&dec.black_steps); // raise black point
 					break;
 				case 78: // +
-					// lower white point
-					i = get_prev(buffer, samples, level_white);
-					if(i > treshold) {
-						level_white = i;
-						printf("New white point at %d\n", level_white);
-					}
+					InterlockedDecrement(&dec.white_steps); // lower white point
 					break;
 				case 74: // -
-					// raise white point
-					i = get_next(buffer, samples, level_white);
-					if(i < 32767) {
-						level_white = i;
-						printf("New white point at %d\n", level_white);
-					}
+					InterlockedIncrement(&dec.white_steps); // raise white point
 					break;
 				}				
 				break;
@@ -437,7 +612,20 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	
-	deinit_ps3000(handle);
+	InterlockedExchange(&dec.quit, 1);
+	WaitForSingleObject(dec.thread, INFINITE);
+	CloseHandle(dec.thread);
+	
+	present_stats(&dec.present, &counters);
+	printf("%ld fields decoded, %ld shown, %ld dropped, %.1f ms mean and %.1f ms worst wait to be shown\n",
+		counters.frames, counters.shown, counters.dropped, counters.latency_ms, counters.max_latency_ms);
+	present_free(&dec.present);
+	
+	deinit_ps3000(dec.handle);
+	
+	if(decode_pool != NULL)
+		pool_destroy(decode_pool);
+	deint_free(&deint);
 	
 	SDL_Quit();
 		
@@ -0,0 +1,237 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Deinterlacing decoded fields into progressive frames. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deint.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_DEINT
+#include <immintrin.h>
+#endif
+
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+// Rounded up average of each byte, same as _mm_avg_epu8
+static unsigned int average(unsigned int a, unsigned int b) {
+	return (a | b) - (((a ^ b) >> 1) & 0x7F7F7F7F);
+}
+
+// Fill a missing line: pixels where the lines above and below have changed
+// by more than threshold in any colour since the previous field of the same
+// parity are interpolated between them, the rest are woven from other.
+// threshold < 0 interpolates everything.
+static void fill_scalar(unsigned int *line, const unsigned int *above, const unsigned int *below,
+		const unsigned int *prev_above, const unsigned int *prev_below, const unsigned int *other,
+		int n, int threshold) {
+	int x, c, m;
+
+	for(x = 0; x < n; x++) {
+		m = 0;
+		for(c = 0; c < 24; c += 8) {
+			m = MAX(m, abs((int)((above[x] >> c) & 0xFF) - (int)((prev_above[x] >> c) & 0xFF)));
+			m = MAX(m, abs((int)((below[x] >> c) & 0xFF) - (int)((prev_below[x] >> c) & 0xFF)));
+		}
+
+		line[x] = (m > threshold) ? average(above[x], below[x]) : other[x];
+	}
+}
+
+#ifdef SIMD_DEINT
+
+// The SIMD versions take the per byte difference both ways with saturating
+// subtracts, fold the three colours of a pixel into its low byte and use the
+// comparison as a mask to pick between the average and the woven pixel.
+
+__attribute__((target("sse2")))
+static void fill_sse2(unsigned int *line, const unsigned int *above, const unsigned int *below,
+		const unsigned int *prev_above, const unsigned int *prev_below, const unsigned int *other,
+		int n, int threshold) {
+	__m128i limit = _mm_set1_epi32(threshold), low = _mm_set1_epi32(0xFF);
+	__m128i a, b, pa, pb, d, m, moving;
+	int x;
+
+	for(x = 0; x + 4 <= n; x += 4) {
+		a = _mm_loadu_si128((const __m128i *)(above + x));
+		b = _mm_loadu_si128((const __m128i *)(below + x));
+		pa = _mm_loadu_si128((const __m128i *)(prev_above + x));
+		pb = _mm_loadu_si128((const __m128i *)(prev_below + x));
+
+		d = _mm_max_epu8(_mm_or_si128(_mm_subs_epu8(a, pa), _mm_subs_epu8(pa, a)),
+			_mm_or_si128(_mm_subs_epu8(b, pb), _mm_subs_epu8(pb, b)));
+		m = _mm_max_epu8(_mm_max_epu8(d, _mm_srli_epi32(d, 8)), _mm_srli_epi32(d, 16));
+		moving = _mm_cmpgt_epi32(_mm_and_si128(m, low), limit);
+
+		_mm_storeu_si128((__m128i *)(line + x), _mm_or_si128(_mm_and_si128(moving, _mm_avg_epu8(a, b)),
+			_mm_andnot_si128(moving, _mm_loadu_si128((const __m128i *)(other + x)))));
+	}
+
+	fill_scalar(line + x, above + x, below + x, prev_above + x, prev_below + x, other + x, n - x, threshold);
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(unsigned int *line, const unsigned int *above, const unsigned int *below,
+		const unsigned int *prev_above, const unsigned int *prev_below, const unsigned int *other,
+		int n, int threshold) {
+	__m256i limit = _mm256_set1_epi32(threshold), low = _mm256_set1_epi32(0xFF);
+	__m256i a, b, pa, pb, d, m, moving;
+	int x;
+
+	for(x = 0; x + 8 <= n; x += 8) {
+		a = _mm256_loadu_si256((const __m256i *)(above + x));
+		b = _mm256_loadu_si256((const __m256i *)(below + x));
+		pa = _mm256_loadu_si256((const __m256i *)(prev_above + x));
+		pb = _mm256_loadu_si256((const __m256i *)(prev_below + x));
+
+		d = _mm256_max_epu8(_mm256_or_si256(_mm256_subs_epu8(a, pa), _mm256_subs_epu8(pa, a)),
+			_mm256_or_si256(_mm256_subs_epu8(b, pb), _mm256_subs_epu8(pb, b)));
+		m = _mm256_max_epu8(_mm256_max_epu8(d, _mm256_srli_epi32(d, 8)), _mm256_srli_epi32(d, 16));
+		moving = _mm256_cmpgt_epi32(_mm256_and_si256(m, low), limit);
+
+		_mm256_storeu_si256((__m256i *)(line + x), _mm256_blendv_epi8(
+			_mm256_loadu_si256((const __m256i *)(other + x)), _mm256_avg_epu8(a, b), moving));
+	}
+
+	fill_scalar(line + x, above + x, below + x, prev_above + x, prev_below + x, other + x, n - x, threshold);
+}
+
+#endif // SIMD_DEINT
+
+static void (*fill_line)(unsigned int *, const unsigned int *, const unsigned int *,
+	const unsigned int *, const unsigned int *, const unsigned int *, int, int) = NULL;
+
+const char * deint_setup(int simd) {
+	fill_line = &fill_scalar;
+
+#ifdef SIMD_DEINT
+	if(simd) {
+		__builtin_cpu_init();
+
+		if(__builtin_cpu_supports("avx2"))
+			fill_line = &fill_avx2;
+		else if(__builtin_cpu_supports("sse2"))
+			fill_line = &fill_sse2;
+	}
+
+	if(fill_line == &fill_avx2)
+		return "AVX2";
+	if(fill_line == &fill_sse2)
+		return "SSE2";
+#endif
+
+	return "scalar";
+}
+
+int deint_init(deinterlacer *di, int mode, int threshold) {
+	if(fill_line == NULL)
+		deint_setup(1);
+
+	memset(di, 0, sizeof(deinterlacer));
+
+	if(mode < DEINT_WEAVE || mode > DEINT_ADAPTIVE) {
+		printf("Unknown deinterlacing mode %d\n", mode);
+		return -1;
+	}
+
+	di->mode = mode;
+	di->threshold = MIN(MAX(threshold, 0), 255);
+
+	return 0;
+}
+
+void deint_free(deinterlacer *di) {
+	free(di->history[0]);
+	free(di->history[1]);
+
+	di->history[0] = di->history[1] = NULL;
+	di->width = di->rows = 0;
+	deint_reset(di);
+}
+
+void deint_reset(deinterlacer *di) {
+	di->valid[0] = di->valid[1] = 0;
+}
+
+static int resize_history(deinterlacer *di, int width, int rows) {
+	int i;
+
+	deint_free(di);
+
+	for(i = 0; i < 2; i++) {
+		di->history[i] = (unsigned int *)calloc((long)width * rows, sizeof(unsigned int));
+		if(di->history[i] == NULL) {
+			printf("Could not allocate deinterlacing history for %d x %d\n", width, rows);
+			deint_free(di);
+			return -1;
+		}
+	}
+
+	di->width = width;
+	di->rows = rows;
+
+	return 0;
+}
+
+int deint_field(deinterlacer *di, unsigned int *frame, int frame_pitch,
+		const unsigned int *field, int field_pitch, int field_num, int width, int rows) {
+	const unsigned int *above, *below, *prev_above, *prev_below, *other;
+	unsigned int *same = NULL;
+	int p = field_num, q = 1 - field_num, x, w, j, k, threshold = -1;
+
+	if(width <= 0 || rows <= 0)
+		return 0;
+
+	if(di->mode == DEINT_WEAVE) { // the other field is already in the frame
+		for(j = 0; j < rows; j++)
+			memcpy(frame + (long)(2 * j + p) * frame_pitch, field + (long)j * field_pitch, width * sizeof(unsigned int));
+		return 0;
+	}
+
+	if(di->mode == DEINT_ADAPTIVE) {
+		if((width != di->width || rows != di->rows) && resize_history(di, width, rows))
+			return -1;
+
+		same = di->history[p];
+		if(di->valid[p] && di->valid[q])
+			threshold = di->threshold; // otherwise there's nothing to compare with, interpolate
+	}
+
+	for(x = 0; x < width; x += DEINT_TILE) {
+		w = MIN(DEINT_TILE, width - x);
+
+		for(j = 0; j <= rows; j++) {
+			if(j < rows) { // missing frame line 2 * j + q, between field lines j - p and j + q
+				above = field + (long)MAX(j - p, 0) * field_pitch + x;
+				below = field + (long)MIN(j + q, rows - 1) * field_pitch + x;
+
+				if(same != NULL) {
+					prev_above = same + (long)MAX(j - p, 0) * width + x;
+					prev_below = same + (long)MIN(j + q, rows - 1) * width + x;
+					other = di->history[q] + (long)j * width + x;
+				} else
+					prev_above = prev_below = other = above; // bob
+
+				fill_line(frame + (long)(2 * j + q) * frame_pitch + x, above, below,
+					prev_above, prev_below, other, w, threshold);
+			}
+
+			// no later missing line looks at field line j - p, so it can go
+			// to the frame and replace the previous field in the history
+			k = j - p;
+			if(k < 0 || k >= rows)
+				continue;
+
+			memcpy(frame + (long)(2 * k + p) * frame_pitch + x, field + (long)k * field_pitch + x, w * sizeof(unsigned int));
+			if(same != NULL)
+				memcpy(same + (long)k * width + x, field + (long)k * field_pitch + x, w * sizeof(unsigned int));
+		}
+	}
+
+	if(same != NULL)
+		di->valid[p] = 1;
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Deinterlacing decoded fields into progressive frames. */
+
+#ifndef DEINT_H
+#define DEINT_H
+
+#define DEINT_WEAVE 0 // field lines in every other frame line, the rest are left from the previous field
+#define DEINT_BOB 1 // missing lines interpolated from the field above and below
+#define DEINT_ADAPTIVE 2 // weave where the picture is still, bob where it moves
+
+#define DEINT_TILE 512 // pixels per column tile, a handful of rows of it stay in L1
+
+// The frame is written in column tiles, going down the field a line at a
+// time, so each field line is read from memory once and is still in the
+// cache as the line below the previous missing line. Every frame line is
+// written exactly once per field.
+//
+// Motion is judged per pixel from the lines above and below a missing line,
+// compared with the same lines of the previous field of the same parity, so
+// the fine vertical detail that differs between the two fields of a still
+// picture does not count as motion.
+typedef struct {
+	int mode, threshold; // threshold 0..255, largest colour change still considered static
+	int width, rows; // size of the kept fields
+	unsigned int *history[2]; // last field of each parity, width x rows
+	int valid[2]; // history[parity] holds a field of the current size
+} deinterlacer;
+
+// Returns 0 on success and -1 on failure. History is allocated on first use.
+int deint_init(deinterlacer *di, int mode, int threshold);
+void deint_free(deinterlacer *di);
+
+// Forget the kept fields, e.g. after the frame has been drawn some other way
+void deint_reset(deinterlacer *di);
+
+// Put rows lines of width 32-bit pixels from field, field_num 0 going to the
+// even frame lines, into a frame of 2 * rows lines. Pitches are in pixels.
+// Returns 0 on success and -1 if the history could not be allocated.
+int deint_field(deinterlacer *di, unsigned int *frame, int frame_pitch,
+	const unsigned int *field, int field_pitch, int field_num, int width, int rows);
+
+// Select the line kernel: simd = 0 forces the portable one. Called
+// automatically with simd = 1 on first use. Returns the kernel name.
+const char * deint_setup(int simd);
+
+#endif // DEINT_H
@@ -0,0 +1,210 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Temporal noise reduction of decoded fields by exponential averaging. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "denoise.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_DENOISE
+#include <immintrin.h>
+#endif
+
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+#define ROUND (1 << (DENOISE_FRACTION - 1))
+
+// Average n pixels into their running averages and replace them with the
+// new averages. threshold < 0 restarts every average from the pixel.
+static void filter_scalar(short *average, unsigned int *pixels, int n, int shift, int threshold) {
+	int x, c, v[4], moving;
+
+	for(x = 0; x < n; x++, average += 4) {
+		moving = 0;
+		for(c = 0; c < 4; c++) {
+			v[c] = (pixels[x] >> (8 * c)) & 0xFF;
+			if(abs(v[c] - ((average[c] + ROUND) >> DENOISE_FRACTION)) > threshold)
+				moving = 1;
+		}
+
+		for(c = 0; c < 4; c++) {
+			v[c] <<= DENOISE_FRACTION;
+			average[c] = (short)(moving ? v[c] : average[c] + ((v[c] - average[c]) >> shift));
+		}
+
+		pixels[x] = 0;
+		for(c = 0; c < 4; c++)
+			pixels[x] |= (unsigned int)((average[c] + ROUND) >> DENOISE_FRACTION) << (8 * c);
+	}
+}
+
+#ifdef SIMD_DENOISE
+
+// The SIMD versions keep a pixel as four 16-bit channels. A channel over
+// the threshold is spread to the other three with two shuffles, so the
+// whole pixel restarts, and the comparison picks between the restarted and
+// the updated average.
+
+__attribute__((target("sse2"), always_inline))
+static inline __m128i step_sse2(__m128i v, __m128i a, __m128i limit, __m128i count) {
+	__m128i d, m;
+
+	d = _mm_sub_epi16(v, _mm_srli_epi16(_mm_add_epi16(a, _mm_set1_epi16(ROUND)), DENOISE_FRACTION));
+	m = _mm_cmpgt_epi16(_mm_max_epi16(d, _mm_sub_epi16(_mm_setzero_si128(), d)), limit);
+	m = _mm_or_si128(m, _mm_shufflehi_epi16(_mm_shufflelo_epi16(m, 0xB1), 0xB1));
+	m = _mm_or_si128(m, _mm_shufflehi_epi16(_mm_shufflelo_epi16(m, 0x4E), 0x4E));
+
+	v = _mm_slli_epi16(v, DENOISE_FRACTION);
+	d = _mm_add_epi16(a, _mm_sra_epi16(_mm_sub_epi16(v, a), count));
+
+	return _mm_or_si128(_mm_and_si128(m, v), _mm_andnot_si128(m, d));
+}
+
+__attribute__((target("sse2")))
+static void filter_sse2(short *average, unsigned int *pixels, int n, int shift, int threshold) {
+	__m128i zero = _mm_setzero_si128(), round = _mm_set1_epi16(ROUND), limit = _mm_set1_epi16((short)threshold);
+	__m128i count = _mm_cvtsi32_si128(shift), v, lo, hi;
+	int x;
+
+	for(x = 0; x + 4 <= n; x += 4) {
+		v = _mm_loadu_si128((__m128i *)(pixels + x));
+		lo = step_sse2(_mm_unpacklo_epi8(v, zero), _mm_loadu_si128((__m128i *)(average + 4 * x)), limit, count);
+		hi = step_sse2(_mm_unpackhi_epi8(v, zero), _mm_loadu_si128((__m128i *)(average + 4 * x + 8)), limit, count);
+
+		_mm_storeu_si128((__m128i *)(average + 4 * x), lo);
+		_mm_storeu_si128((__m128i *)(average + 4 * x + 8), hi);
+		_mm_storeu_si128((__m128i *)(pixels + x), _mm_packus_epi16(
+			_mm_srli_epi16(_mm_add_epi16(lo, round), DENOISE_FRACTION),
+			_mm_srli_epi16(_mm_add_epi16(hi, round), DENOISE_FRACTION)));
+	}
+
+	filter_scalar(average + 4 * x, pixels + x, n - x, shift, threshold);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i step_avx2(__m256i v, __m256i a, __m256i limit, __m128i count) {
+	__m256i d, m;
+
+	d = _mm256_sub_epi16(v, _mm256_srli_epi16(_mm256_add_epi16(a, _mm256_set1_epi16(ROUND)), DENOISE_FRACTION));
+	m = _mm256_cmpgt_epi16(_mm256_abs_epi16(d), limit);
+	m = _mm256_or_si256(m, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(m, 0xB1), 0xB1));
+	m = _mm256_or_si256(m, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(m, 0x4E), 0x4E));
+
+	v = _mm256_slli_epi16(v, DENOISE_FRACTION);
+	d = _mm256_add_epi16(a, _mm256_sra_epi16(_mm256_sub_epi16(v, a), count));
+
+	return _mm256_blendv_epi8(d, v, m);
+}
+
+// Four pixels widen to one vector, the packed result is put back in order
+__attribute__((target("avx2")))
+static void filter_avx2(short *average, unsigned int *pixels, int n, int shift, int threshold) {
+	__m256i round = _mm256_set1_epi16(ROUND), limit = _mm256_set1_epi16((short)threshold), lo, hi;
+	__m128i count = _mm_cvtsi32_si128(shift);
+	int x;
+
+	for(x = 0; x + 8 <= n; x += 8) {
+		lo = step_avx2(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(pixels + x))),
+			_mm256_loadu_si256((__m256i *)(average + 4 * x)), limit, count);
+		hi = step_avx2(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(pixels + x + 4))),
+			_mm256_loadu_si256((__m256i *)(average + 4 * x + 16)), limit, count);
+
+		_mm256_storeu_si256((__m256i *)(average + 4 * x), lo);
+		_mm256_storeu_si256((__m256i *)(average + 4 * x + 16), hi);
+		_mm256_storeu_si256((__m256i *)(pixels + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(
+			_mm256_srli_epi16(_mm256_add_epi16(lo, round), DENOISE_FRACTION),
+			_mm256_srli_epi16(_mm256_add_epi16(hi, round), DENOISE_FRACTION)), 0xD8));
+	}
+
+	filter_scalar(average + 4 * x, pixels + x, n - x, shift, threshold);
+}
+
+#endif // SIMD_DENOISE
+
+static void (*filter_line)(short *, unsigned int *, int, int, int) = NULL;
+
+const char * denoise_setup(int simd) {
+	filter_line = &filter_scalar;
+
+#ifdef SIMD_DENOISE
+	if(simd) {
+		__builtin_cpu_init();
+
+		if(__builtin_cpu_supports("avx2"))
+			filter_line = &filter_avx2;
+		else if(__builtin_cpu_supports("sse2"))
+			filter_line = &filter_sse2;
+	}
+
+	if(filter_line == &filter_avx2)
+		return "AVX2";
+	if(filter_line == &filter_sse2)
+		return "SSE2";
+#endif
+
+	return "scalar";
+}
+
+int denoise_init(denoiser *dn, int shift, int threshold) {
+	if(filter_line == NULL)
+		denoise_setup(1);
+
+	memset(dn, 0, sizeof(denoiser));
+
+	if(shift < 1 || shift > DENOISE_MAX_SHIFT) {
+		printf("Noise reduction shift has to be 1 to %d, not %d\n", DENOISE_MAX_SHIFT, shift);
+		return -1;
+	}
+
+	dn->shift = shift;
+	dn->threshold = MIN(MAX(threshold, 0), 255);
+
+	return 0;
+}
+
+void denoise_free(denoiser *dn) {
+	free(dn->average[0]);
+	free(dn->average[1]);
+
+	dn->average[0] = dn->average[1] = NULL;
+	dn->width = dn->rows = 0;
+	dn->valid[0] = dn->valid[1] = 0;
+}
+
+int denoise_resize(denoiser *dn, int width, int rows) {
+	int i;
+
+	if(width == dn->width && rows == dn->rows)
+		return 0;
+
+	denoise_free(dn);
+
+	for(i = 0; i < 2; i++) {
+		dn->average[i] = (short *)calloc((long)width * rows * 4, sizeof(short));
+		if(dn->average[i] == NULL) {
+			printf("Could not allocate noise reduction for %d x %d\n", width, rows);
+			denoise_free(dn);
+			return -1;
+		}
+	}
+
+	dn->width = width;
+	dn->rows = rows;
+
+	return 0;
+}
+
+void denoise_line(const denoiser *dn, unsigned int *pixels, int field_num, int line) {
+	if(line < 0 || line >= dn->rows)
+		return;
+
+	filter_line(dn->average[field_num] + (long)line * dn->width * 4, pixels, dn->width, dn->shift,
+		dn->valid[field_num] ? dn->threshold : -1);
+}
+
+void denoise_field_done(denoiser *dn, int field_num) {
+	dn->valid[field_num] = 1;
+}
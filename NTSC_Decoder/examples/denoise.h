@@ -0,0 +1,49 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Temporal noise reduction of decoded fields by exponential averaging. */
+
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#define DENOISE_FRACTION 7 // fraction bits of the accumulated channels
+#define DENOISE_MAX_SHIFT 6 // longest average, over 64 fields of the same parity
+
+// Every pixel keeps a running average of its colour over the fields of the
+// same parity: avg += (pixel - avg) / 2^shift, which averages the noise over
+// about 2^shift fields. The average is kept with 7 fraction bits in 16-bit
+// channels, so small steps don't get lost in rounding even at long averages.
+//
+// Where any colour of a pixel differs from its average by more than
+// threshold, the picture has moved and the average restarts from the new
+// pixel, so moving parts are not smeared over the following fields.
+//
+// Scanlines are filtered in place right after they are decoded, while they
+// are still in the cache, and the rows of the average are independent, so
+// the decode pool can filter scanlines on any thread.
+typedef struct {
+	int shift; // 1..DENOISE_MAX_SHIFT
+	int threshold; // 0..255, 255 never restarts
+	int width, rows; // size of the averages
+	short *average[2]; // per parity, rows x width pixels of B, G, R and 0 channels
+	int valid[2]; // average[parity] has been filled by a whole field
+} denoiser;
+
+// Returns 0 on success and -1 on failure
+int denoise_init(denoiser *dn, int shift, int threshold);
+void denoise_free(denoiser *dn);
+
+// Make room for fields of width x rows pixels, forgetting the averages if
+// the size changes. Call between fields. Returns 0 on success and -1 on
+// failure.
+int denoise_resize(denoiser *dn, int width, int rows);
+
+// Filter row line of field field_num in place, dn->width pixels from pixels
+void denoise_line(const denoiser *dn, unsigned int *pixels, int field_num, int line);
+
+// All rows of field field_num have been filtered, its averages are in use
+void denoise_field_done(denoiser *dn, int field_num);
+
+// Select the line kernel: simd = 0 forces the portable one. Called
+// automatically with simd = 1 on first use. Returns the kernel name.
+const char * denoise_setup(int simd);
+
+#endif // DENOISE_H
@@ -8,6 +8,7 @@
 #include <conio.h>
 
 #include "ps2000.h"
+#include "levels.h"
 
 #include "SDL/SDL.h"
 
@@ -115,7 +116,8 @@ int main(int argc, char *argv[]) {
 	int capture_interval;
 	int offset=0;
 	int treshold = 2048, screen_width;
-	int count[65536], i, sum, total;
+	level_hist hist;
+	int i;
 	
 	if(argc == 1)
 		capture_interval = 150;
@@ -137,29 +139,13 @@ int main(int argc, char *argv[]) {
 	capture_data(handle, capture_interval);
 	
 	/* Try to guess a good treshold value */
-	for(i=0; i<65536; i++)
-		count[i] = 0;
-		
-	total = 0;
-	for(i=0; i<CAPTURE_LENGTH; i++) {
-		if(streaming_buffer[i] > -32768) {
-			count[streaming_buffer[i] + 32768]++;
-			total++;
-		}
-	}
+	if(level_hist_init(&hist))
+		return(1);
 	
-	sum = 5 * total / 100; // blanking periods are about 9.5 % of the signal
+	level_hist_add(&hist, streaming_buffer, CAPTURE_LENGTH);
 	
-	for(i=0; i<65536 && sum >= 0; i++) {
-		if(!count[i])
-			continue;
-			
-		printf("At %d, sum is still %d, decreasing by %d\n", i, sum, count[i]);
-		sum -= count[i];
-		
-		if(sum < 0)
-			treshold = i - 32768 + 1;
-	}
+	if(hist.total > 0) // blanking periods are about 9.5 % of the signal
+		treshold = level_hist_percentile(&hist, 0.05) + 1;
 	
 	printf("Treshold set at %d\n", treshold);
 	
@@ -174,17 +160,7 @@ int main(int argc, char *argv[]) {
 	}
 	
 	// find minimum and maximum colors
-	int minc = 65536, maxc = 0;
-	
-	for(i=0; i<CAPTURE_LENGTH; i++) {
-		if(streaming_buffer[i] < treshold)
-			continue;
-			
-		if(streaming_buffer[i] < minc)
-			minc = streaming_buffer[i];
-		if(streaming_buffer[i] > maxc)
-			maxc = streaming_buffer[i];
-	}
+	int minc = level_hist_next(&hist, treshold - 1), maxc = hist.max;
 	
 	redraw = 1;
 	while(!done) {
@@ -208,14 +184,14 @@ int main(int argc, char *argv[]) {
 				case 77: // right
 				case 72: // up
 					// raise black point
-					for(i=minc-1; i > treshold && !count[i+32768]; i--) {}
+					i = level_hist_prev(&hist, minc);
 					if(i > treshold)
 						minc = i;
 					break;
 				case 80: // down
 					// lower black point
-					for(i=minc+1; i < 32768 && !count[i+32768]; i++) {}
-					if(i < 32768)
+					i = level_hist_next(&hist, minc);
+					if(i <= 32767)
 						minc = i;
 					break;
 				case 78: // +
@@ -233,6 +209,7 @@ int main(int argc, char *argv[]) {
 	}
 	
 	ps2000_close_unit(handle);
+	level_hist_free(&hist);
 	
 	SDL_Quit();
 		
@@ -0,0 +1,149 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Decoded fields in a named shared memory ring for other processes. */
+
+#include "windows.h"
+#include <stdio.h>
+#include <string.h>
+
+#include "fieldshm.h"
+
+#define SLOT_ALIGN 4096 // slots start on page boundaries
+
+static field_shm_slot * get_slot(field_shm *shm, int slot) {
+	return (field_shm_slot *)((char *)shm->header + sizeof(field_shm_header) + (long long)slot * shm->header->slot_size);
+}
+
+int field_shm_create(field_shm *shm, int slots, int width, int height) {
+	field_shm_header *header;
+	int pitch = width * 4, slot_size, i;
+	long long size;
+
+	memset(shm, 0, sizeof(field_shm));
+
+	slot_size = sizeof(field_shm_slot) + pitch * height;
+	slot_size = (slot_size + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+	size = sizeof(field_shm_header) + (long long)slots * slot_size;
+
+	// backed by the paging file, exists until the decoder and all readers close it
+	shm->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		(DWORD)(size >> 32), (DWORD)(size & 0xFFFFFFFF), FIELD_SHM_NAME);
+	if(shm->mapping == NULL) {
+		printf("Could not create shared memory %s\n", FIELD_SHM_NAME);
+		return -1;
+	}
+
+	header = (field_shm_header *)MapViewOfFile(shm->mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)size);
+	if(header == NULL) {
+		printf("Could not map %lld bytes of shared memory\n", size);
+		field_shm_close(shm);
+		return -1;
+	}
+
+	shm->header = header;
+
+	// a reader from an earlier run may still have the ring open, so readers
+	// only see the new layout once magic is set again
+	header->magic = 0;
+	MemoryBarrier();
+
+	header->version = FIELD_SHM_VERSION;
+	header->slots = slots;
+	header->width = width;
+	header->height = height;
+	header->pitch = pitch;
+	header->slot_size = slot_size;
+	header->published = 0;
+
+	for(i = 0; i < slots; i++) {
+		get_slot(shm, i)->sequence = 0;
+		get_slot(shm, i)->number = -1;
+	}
+
+	MemoryBarrier();
+	header->magic = FIELD_SHM_MAGIC;
+
+	return 0;
+}
+
+int field_shm_open(field_shm *shm) {
+	memset(shm, 0, sizeof(field_shm));
+
+	shm->mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, FIELD_SHM_NAME);
+	if(shm->mapping == NULL) {
+		printf("No decoder is publishing fields at %s\n", FIELD_SHM_NAME);
+		return -1;
+	}
+
+	shm->header = (field_shm_header *)MapViewOfFile(shm->mapping, FILE_MAP_READ, 0, 0, 0);
+	if(shm->header == NULL) {
+		printf("Could not map shared memory %s\n", FIELD_SHM_NAME);
+		field_shm_close(shm);
+		return -1;
+	}
+
+	if(shm->header->magic != FIELD_SHM_MAGIC || shm->header->version != FIELD_SHM_VERSION) {
+		printf("Shared memory %s is not a version %d field ring\n", FIELD_SHM_NAME, FIELD_SHM_VERSION);
+		field_shm_close(shm);
+		return -1;
+	}
+
+	MemoryBarrier(); // layout is complete once magic is set
+
+	return 0;
+}
+
+unsigned int * field_shm_pixels(field_shm *shm, int slot) {
+	return (unsigned int *)(get_slot(shm, slot) + 1);
+}
+
+void field_shm_begin(field_shm *shm, int slot) {
+	field_shm_slot *s = get_slot(shm, slot);
+
+	if((s->sequence & 1) == 0)
+		InterlockedIncrement(&s->sequence); // full barrier, readers see odd before any pixel changes
+}
+
+void field_shm_publish(field_shm *shm, int slot, int field_num) {
+	field_shm_slot *s = get_slot(shm, slot);
+
+	s->number = shm->header->published;
+	s->field_num = field_num;
+
+	InterlockedIncrement(&s->sequence); // even again, pixels are visible first
+	InterlockedIncrement(&shm->header->published);
+}
+
+int field_shm_acquire(field_shm *shm, LONG number, LONG *sequence) {
+	int slot;
+	field_shm_slot *s;
+
+	if(number < 0)
+		return -1;
+
+	slot = number % shm->header->slots;
+	s = get_slot(shm, slot);
+
+	*sequence = s->sequence;
+	MemoryBarrier(); // read the slot only after its sequence
+
+	if((*sequence & 1) || s->number != number)
+		return -1;
+
+	return slot;
+}
+
+int field_shm_valid(field_shm *shm, int slot, LONG sequence) {
+	MemoryBarrier(); // pixels have been read before the check
+
+	return get_slot(shm, slot)->sequence == sequence;
+}
+
+void field_shm_close(field_shm *shm) {
+	if(shm->header != NULL)
+		UnmapViewOfFile(shm->header);
+	if(shm->mapping != NULL)
+		CloseHandle(shm->mapping);
+
+	shm->header = NULL;
+	shm->mapping = NULL;
+}
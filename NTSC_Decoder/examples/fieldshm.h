@@ -0,0 +1,66 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Decoded fields in a named shared memory ring for other processes. */
+
+#ifndef FIELDSHM_H
+#define FIELDSHM_H
+
+#include "windows.h"
+
+#define FIELD_SHM_NAME "Local\\NTSCDecoderFields"
+#define FIELD_SHM_MAGIC 0x4D485346 // "FSHM"
+#define FIELD_SHM_VERSION 1
+
+// The mapping starts with the header, followed by slots fields, each a
+// field_shm_slot and height rows of pitch bytes of 32-bit RGB pixels.
+// The decoder renders straight into the slots, so nothing gets copied.
+//
+// Every slot has a sequence number that is odd while the decoder writes it.
+// Readers never lock anything: they note the sequence, read the pixels and
+// check that the sequence has not changed, or else the field was
+// overwritten under them and is dropped. Any amount of readers can follow
+// the ring this way without slowing down the decoder.
+typedef struct {
+	LONG magic, version;
+	int slots, width, height, pitch; // pitch in bytes
+	int slot_size; // bytes from one slot to the next
+	volatile LONG published; // fields published, the latest is in slot (published - 1) % slots
+	char padding[64 - 3 * sizeof(LONG) - 5 * sizeof(int)];
+} field_shm_header;
+
+typedef struct {
+	volatile LONG sequence; // odd while the slot is being written
+	LONG number; // value of published when the field was published
+	int field_num; // 0 or 1, which field of the frame
+	char padding[64 - 2 * sizeof(LONG) - sizeof(int)];
+} field_shm_slot;
+
+typedef struct {
+	HANDLE mapping;
+	field_shm_header *header;
+} field_shm;
+
+// Decoder: create the ring. Returns 0 on success and -1 on failure.
+int field_shm_create(field_shm *shm, int slots, int width, int height);
+
+// Reader: map a ring created by another process, or -1 if there is none
+int field_shm_open(field_shm *shm);
+
+unsigned int * field_shm_pixels(field_shm *shm, int slot);
+
+// Decoder: mark a slot as being written, before anything is drawn in it.
+// Slots have to be used in order, like ring_write_slot hands them out, so
+// field n is always in slot n % slots.
+void field_shm_begin(field_shm *shm, int slot);
+// Decoder: publish the finished field in slot
+void field_shm_publish(field_shm *shm, int slot, int field_num);
+
+// Reader: slot of field number, the latest being published - 1, and its
+// sequence to check against afterwards. Returns -1 if the field has already
+// been overwritten or is being written.
+int field_shm_acquire(field_shm *shm, LONG number, LONG *sequence);
+// Reader: 1 if the slot still holds the field acquired with sequence
+int field_shm_valid(field_shm *shm, int slot, LONG sequence);
+
+void field_shm_close(field_shm *shm);
+
+#endif // FIELDSHM_H
@@ -0,0 +1,225 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Amplitude histogram of 16-bit samples and the signal levels found from it. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "levels.h"
+
+#define BIAS 32768 // bin of sample 0
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_LEVELS
+#include <immintrin.h>
+#endif
+
+// Count samples into bins and return their min and max. The SIMD versions
+// flip the sign bit to get bin numbers and keep min/max in vector registers,
+// leaving only the increments to do one at a time.
+static void add_scalar(unsigned int *count, const short *samples, long length, int *min, int *max) {
+	int lo = *min, hi = *max;
+	long i;
+
+	for(i = 0; i < length; i++) {
+		count[samples[i] + BIAS]++;
+		if(samples[i] < lo)
+			lo = samples[i];
+		if(samples[i] > hi)
+			hi = samples[i];
+	}
+
+	*min = lo;
+	*max = hi;
+}
+
+#ifdef SIMD_LEVELS
+
+__attribute__((target("sse2")))
+static void add_sse2(unsigned int *count, const short *samples, long length, int *min, int *max) {
+	unsigned short bin[8];
+	__m128i lo = _mm_set1_epi16(32767), hi = _mm_set1_epi16(-32768), sign = _mm_set1_epi16(-32768), v;
+	short l[8], h[8];
+	long i;
+	int j;
+
+	for(i = 0; i + 8 <= length; i += 8) {
+		v = _mm_loadu_si128((const __m128i *)(samples + i));
+		lo = _mm_min_epi16(lo, v);
+		hi = _mm_max_epi16(hi, v);
+		_mm_storeu_si128((__m128i *)bin, _mm_xor_si128(v, sign));
+
+		for(j = 0; j < 8; j++)
+			count[bin[j]]++;
+	}
+
+	_mm_storeu_si128((__m128i *)l, lo);
+	_mm_storeu_si128((__m128i *)h, hi);
+	for(j = 0; j < 8; j++) {
+		if(l[j] < *min)
+			*min = l[j];
+		if(h[j] > *max)
+			*max = h[j];
+	}
+
+	add_scalar(count, samples + i, length - i, min, max);
+}
+
+__attribute__((target("avx2")))
+static void add_avx2(unsigned int *count, const short *samples, long length, int *min, int *max) {
+	unsigned short bin[16];
+	__m256i lo = _mm256_set1_epi16(32767), hi = _mm256_set1_epi16(-32768), sign = _mm256_set1_epi16(-32768), v;
+	short l[16], h[16];
+	long i;
+	int j;
+
+	for(i = 0; i + 16 <= length; i += 16) {
+		v = _mm256_loadu_si256((const __m256i *)(samples + i));
+		lo = _mm256_min_epi16(lo, v);
+		hi = _mm256_max_epi16(hi, v);
+		_mm256_storeu_si256((__m256i *)bin, _mm256_xor_si256(v, sign));
+
+		for(j = 0; j < 16; j++)
+			count[bin[j]]++;
+	}
+
+	_mm256_storeu_si256((__m256i *)l, lo);
+	_mm256_storeu_si256((__m256i *)h, hi);
+	for(j = 0; j < 16; j++) {
+		if(l[j] < *min)
+			*min = l[j];
+		if(h[j] > *max)
+			*max = h[j];
+	}
+
+	add_scalar(count, samples + i, length - i, min, max);
+}
+
+#endif // SIMD_LEVELS
+
+static void (*add_samples)(unsigned int *, const short *, long, int *, int *) = NULL;
+
+const char * level_hist_setup(int simd) {
+	add_samples = &add_scalar;
+
+#ifdef SIMD_LEVELS
+	if(simd) {
+		__builtin_cpu_init();
+
+		if(__builtin_cpu_supports("avx2"))
+			add_samples = &add_avx2;
+		else if(__builtin_cpu_supports("sse2"))
+			add_samples = &add_sse2;
+	}
+
+	if(add_samples == &add_avx2)
+		return "AVX2";
+	if(add_samples == &add_sse2)
+		return "SSE2";
+#endif
+
+	return "scalar";
+}
+
+int level_hist_init(level_hist *hist) {
+	if(add_samples == NULL)
+		level_hist_setup(1);
+
+	hist->count = (unsigned int *)calloc(65536, sizeof(unsigned int));
+	hist->total = 0;
+	hist->min = 32767;
+	hist->max = -32768;
+
+	if(hist->count == NULL) {
+		printf("Could not allocate level histogram\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void level_hist_free(level_hist *hist) {
+	free(hist->count);
+	hist->count = NULL;
+}
+
+void level_hist_clear(level_hist *hist) {
+	if(hist->max >= hist->min)
+		memset(hist->count + hist->min + BIAS, 0, sizeof(unsigned int) * (hist->max - hist->min + 1));
+
+	hist->total = 0;
+	hist->min = 32767;
+	hist->max = -32768;
+}
+
+void level_hist_add(level_hist *hist, const short *samples, long length) {
+	if(length <= 0)
+		return;
+
+	add_samples(hist->count, samples, length, &hist->min, &hist->max);
+	hist->total += length;
+}
+
+void level_hist_lines(level_hist *hist, const short *samples, long length, int lines, int line_length) {
+	long step;
+	int line;
+
+	if(lines <= 0 || (long)lines * line_length >= length) {
+		level_hist_add(hist, samples, length);
+		return;
+	}
+
+	step = (length - line_length) / lines;
+
+	for(line = 0; line < lines; line++)
+		level_hist_add(hist, samples + line * step, line_length);
+}
+
+int level_hist_next(level_hist *hist, int level) {
+	for(level = level < hist->min ? hist->min : level + 1; level <= hist->max; level++)
+		if(hist->count[level + BIAS])
+			return level;
+
+	return 32768;
+}
+
+int level_hist_prev(level_hist *hist, int level) {
+	for(level = level > hist->max ? hist->max : level - 1; level >= hist->min; level--)
+		if(hist->count[level + BIAS])
+			return level;
+
+	return -32769;
+}
+
+int level_hist_percentile(level_hist *hist, double fraction) {
+	long clipped = hist->count[0], below = (long)(fraction * (hist->total - clipped)), seen = 0;
+	int level;
+
+	// clipped samples are left out, or a clipping sync tip would pull the
+	// percentile down to -32768
+	for(level = hist->min > -32767 ? hist->min : -32767; level <= hist->max; level++)
+		if((seen += hist->count[level + BIAS]) > below)
+			return level;
+
+	return hist->max;
+}
+
+void level_hist_levels(level_hist *hist, signal_levels *levels) {
+	int level, middle = hist->min + (hist->max - hist->min) / 2;
+	unsigned int most = 0;
+
+	levels->sync_tip = hist->min;
+	levels->treshold = level_hist_next(hist, hist->min);
+	levels->black = level_hist_next(hist, levels->treshold);
+	levels->white = hist->max;
+
+	// porches and the VSYNC intervals make blanking the most common level
+	// below the middle of the range, bar the sync tip itself
+	levels->blanking = levels->black;
+	for(level = levels->treshold + 1; level <= middle; level++) {
+		if(hist->count[level + BIAS] > most) {
+			most = hist->count[level + BIAS];
+			levels->blanking = level;
+		}
+	}
+}
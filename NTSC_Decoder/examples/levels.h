@@ -0,0 +1,55 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Amplitude histogram of 16-bit samples and the signal levels found from it. */
+
+#ifndef LEVELS_H
+#define LEVELS_H
+
+// One bin per sample value. Bins outside min..max are always zero, so
+// clearing and scanning only touch the range the signal actually used.
+typedef struct {
+	unsigned int *count; // 65536 bins, indexed by sample + 32768
+	long total;
+	int min, max; // lowest and highest level added, max < min when empty
+} level_hist;
+
+// Levels of a composite video signal
+typedef struct {
+	int sync_tip; // lowest level
+	int treshold; // next level above the sync tip, samples <= this are sync
+	int blanking; // most common level between sync and the middle of the range
+	int black; // next level above treshold
+	int white; // highest level
+} signal_levels;
+
+// Returns 0 on success and -1 on failure
+int level_hist_init(level_hist *hist);
+void level_hist_free(level_hist *hist);
+
+void level_hist_clear(level_hist *hist);
+
+// Add samples in a single pass. Clipped samples are counted at -32768, as
+// get_min sees them.
+void level_hist_add(level_hist *hist, const short *samples, long length);
+
+// Add lines evenly spaced windows of line_length samples, or everything if
+// lines is 0. A few dozen scanlines are enough to find the sync tip and the
+// blanking level, at a small fraction of the cost of a whole capture.
+void level_hist_lines(level_hist *hist, const short *samples, long length, int lines, int line_length);
+
+// Closest level above or below level with samples, like get_next and
+// get_prev, or 32768 and -32769 if there is none, so every sample value
+// is a level that can be returned
+int level_hist_next(level_hist *hist, int level);
+int level_hist_prev(level_hist *hist, int level);
+
+// Lowest level at which more than fraction of the samples are at or below
+// it, leaving out clipped ones
+int level_hist_percentile(level_hist *hist, double fraction);
+
+void level_hist_levels(level_hist *hist, signal_levels *levels);
+
+// Select the min/max kernel: simd = 0 forces the portable one. Called
+// automatically with simd = 1 on first use. Returns the kernel name.
+const char * level_hist_setup(int simd);
+
+#endif // LEVELS_H
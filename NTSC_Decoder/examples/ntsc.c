@@ -8,20 +8,24 @@
 #include <conio.h>
 
 #include "ps2000.h"
+#include "pulses.h"
 
 #define CAPTURE_LENGTH (1000*1000)
 
-short * streaming_buffer;
+// Samples are analysed as they stream in, nothing is buffered
+pulses analyser;
 long streaming_ptr;
 
 void  __stdcall ps2000FastStreamingReady(short **overviewBuffers, 
 		short overflow, unsigned long triggeredAt, short triggered, 
 		short auto_stop, unsigned long nValues) {
-	long i;
-	short * channel_A = overviewBuffers[0];
+	long count = (long)nValues;
 	
-	for(i=0; i<nValues && streaming_ptr < CAPTURE_LENGTH; i++)
-		streaming_buffer[streaming_ptr++] = channel_A[i];
+	if(count > CAPTURE_LENGTH - streaming_ptr)
+		count = CAPTURE_LENGTH - streaming_ptr;
+	
+	pulses_feed(&analyser, overviewBuffers[0], count);
+	streaming_ptr += count;
 }
 
 void capture_data(short handle, int capture_interval) {
@@ -41,18 +45,23 @@ void capture_data(short handle, int capture_interval) {
 	ps2000_stop(handle);
 }
 
+// ntsc [interval_ns [rle file]]: histograms of the sync pulses of
+// CAPTURE_LENGTH samples, and their RLE stream if a file is given
 int main(int argc, char *argv[]) {
 	short handle;
 	int capture_interval;
-	int treshold = 2048, screen_width;
-	int i;
+	int treshold = 2048;
+	FILE *rle = NULL;
 	
 	if(argc == 1)
 		capture_interval = 150;
 	else
 		capture_interval = atoi(argv[1]);
 	
-	screen_width = 58000/capture_interval; // lines shorter than this are definitely part of screen blanking
+	if(argc > 2 && (rle = fopen(argv[2], "wb")) == NULL) {
+		printf("Could not open %s\n", argv[2]);
+		return 1;
+	}
 	
 	handle = ps2000_open_unit();
 	
@@ -62,58 +71,27 @@ int main(int argc, char *argv[]) {
 	// No trigger
 	ps2000_set_trigger(handle, PS2000_NONE, 0, PS2000_RISING, 0, 0);
 	
-	streaming_buffer = (short *)malloc(sizeof(short) * CAPTURE_LENGTH);
-	
 	printf("Treshold set at %d\n", treshold);
 	
-	int long_high = 100, long_low = 100;
-	int low, count, lines, vsync;
+	if(pulses_init(&analyser, treshold, capture_interval, rle)) {
+		ps2000_close_unit(handle);
+		fclose(rle);
+		return 1;
+	}
 	
 	capture_data(handle, capture_interval);
 	
-	low = 0;
-	count = 0;
-	lines = 0;
-	vsync = 0;
-	
-	// Analyze data
-	for(i=0; i<CAPTURE_LENGTH; i++) {
-		if(streaming_buffer[i] < treshold) { // signal low
-			if(!low) { // just went down
-				low = 1;
-				if(count > screen_width) { // should be normal scanline
-					vsync = 0; // not in vertical sync
-					lines++;
-				} else { // short one!
-					vsync = 1; // in vertical sync
-					if(lines > 0) { // display leftover lines
-						printf("\n%4d ", lines);
-						lines = 0;
-					}
-					if(count > long_high)
-						printf("H ", count);
-					else
-						printf("- ", count);
-				}
-				count = 0; // initialize counter
-			}
-			count++;
-		} else { // signal high
-			if(low) { // just went up
-				low = 0;
-				if(vsync) { // only display low lengths on vsync period
-					if(count > long_low)
-						printf("_ ", count);
-					else
-						printf(". ", count);
-				}
-				count = 0;
-			}
-			count++;
-		}
+	ps2000_close_unit(handle);
+	
+	if(pulses_finish(&analyser)) {
+		fclose(rle);
+		return 1;
 	}
 	
-	ps2000_close_unit(handle);
+	pulses_print(&analyser, stdout);
+	
+	if(rle != NULL)
+		fclose(rle);
 	
 	return 0;
 }
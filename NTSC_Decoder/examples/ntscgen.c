@@ -0,0 +1,114 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Synthetic composite NTSC signal for testing and benchmarking decoders. */
+
+#include <math.h>
+
+#include "ntscgen.h"
+
+// Color subcarrier frequency in MHz
+#define COLOR_SUBCARRIER  3.579545
+
+// Timings in ns
+#define LINE 63556.0 // 1s / 29.97 / 525
+#define HALF_LINE (LINE / 2.0)
+#define HSYNC 4700.0
+#define EQUALIZING 2300.0
+#define SERRATION 4700.0 // high part of a broad VSYNC pulse
+#define BURST_START 5300.0
+#define BURST_LEN 2500.0
+#define ACTIVE_START 9400.0
+#define ACTIVE_END 62200.0
+
+#define RISE 140.0 // sync edge rise and fall time
+
+#define IRE 160 // sample units per IRE, sync tip at -6400 and white at 16000
+
+// 75% colour bars: luma, chroma amplitude (IRE) and chroma phase (degrees)
+static const float bars[8][3] = {
+	{ 77, 0, 0 }, { 69, 31, 167 }, { 56, 44, 283 }, { 48, 41, 241 },
+	{ 36, 41, 61 }, { 28, 44, 103 }, { 15, 31, 347 }, { 7.5, 0, 0 }
+};
+
+void ntscgen_init(ntscgen *gen, long timeInterval, int noise) {
+	gen->timeInterval = timeInterval;
+	gen->sample = 0;
+	gen->noise = noise;
+	gen->seed = 12345;
+}
+
+// Sync pulse level in IRE at r for a pulse from start to end, with sloped edges
+static double pulse(double r, double start, double end) {
+	double in = (r - start) / RISE + 0.5, out = (end - r) / RISE + 0.5;
+
+	in = in < 0 ? 0 : (in > 1 ? 1 : in);
+	out = out < 0 ? 0 : (out > 1 ? 1 : out);
+
+	return -40 * in * out;
+}
+
+// Signal level in IRE within the 9 line VSYNC period
+static double vsync_level(double t) {
+	int n = (int)(t / HALF_LINE);
+	double r = t - n * HALF_LINE;
+
+	if(n < 6 || n >= 12) // equalizing pulses
+		return pulse(r, 0, EQUALIZING);
+	else // serrated broad pulses
+		return pulse(r, 0, HALF_LINE - SERRATION);
+}
+
+// Signal level in IRE within a scanline, active video ends at "end"
+static double line_level(double r, double end, double time) {
+	double phase = 2.0 * M_PI * COLOR_SUBCARRIER * time / 1000.0;
+	int bar;
+
+	if(r < HSYNC + RISE)
+		return pulse(r, 0, HSYNC);
+	if(r >= BURST_START && r < BURST_START + BURST_LEN)
+		return 20 * sin(phase + M_PI);
+	if(r < ACTIVE_START || r >= end)
+		return 0;
+
+	bar = (int)(8 * (r - ACTIVE_START) / (ACTIVE_END - ACTIVE_START));
+
+	return bars[bar][0] + bars[bar][1] * sin(phase + bars[bar][2] * M_PI / 180.0);
+}
+
+// Signal level in IRE at time ns from the start of the signal
+static double signal_level(double time) {
+	double p = fmod(time, 525 * LINE), r;
+
+	if(p < 262.5 * LINE) { // field ending in a half scanline
+		if(p < 9 * LINE)
+			return vsync_level(p);
+
+		r = fmod(p - 9 * LINE, LINE);
+
+		return line_level(r, p >= 262 * LINE ? HALF_LINE : ACTIVE_END, time);
+	}
+
+	p -= 262.5 * LINE; // field starting with a half scanline
+
+	if(p < 9 * LINE)
+		return vsync_level(p);
+	if(p < 9.5 * LINE)
+		return 0;
+
+	return line_level(fmod(p - 9.5 * LINE, LINE), ACTIVE_END, time);
+}
+
+void ntscgen_fill(ntscgen *gen, short *samples, long length) {
+	long i;
+	int value;
+
+	for(i = 0; i < length; i++, gen->sample++) {
+		value = (int)(signal_level((double)gen->sample * gen->timeInterval) * IRE);
+
+		if(gen->noise) {
+			gen->seed = gen->seed * 1103515245 + 12345;
+			value += (int)((gen->seed >> 16) % (2 * gen->noise + 1)) - gen->noise;
+		}
+
+		samples[i] = (short)(value < -32768 ? -32768 : (value > 32767 ? 32767 : value));
+	}
+}
@@ -0,0 +1,23 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Synthetic composite NTSC signal for testing and benchmarking decoders. */
+
+#ifndef NTSCGEN_H
+#define NTSCGEN_H
+
+typedef struct {
+	long timeInterval; // ns per sample
+	long long sample; // index of the next sample to generate
+	int noise; // peak noise amplitude in sample units
+	unsigned int seed; // noise generator state
+} ntscgen;
+
+// Prepare a generator for a capture interval, noise is the peak amplitude of
+// random noise added to the signal (0 for a clean signal)
+void ntscgen_init(ntscgen *gen, long timeInterval, int noise);
+
+// Generate the next length samples of a continuous signal. Frames start with
+// the VSYNC of the field that ends in a half scanline (7 longs), followed by
+// the field that starts with one (6 longs). Active lines carry 75% colour bars.
+void ntscgen_fill(ntscgen *gen, short *samples, long length);
+
+#endif // NTSCGEN_H
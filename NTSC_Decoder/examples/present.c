@@ -0,0 +1,169 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Triple buffering between a decoder and a presenter that shows the newest
+ * finished frame. */
+
+#include "windows.h"
+#include <stdio.h>
+#include <string.h>
+
+#include "present.h"
+
+#define PRESENT_FRESH 0x10000 // in latest until the presenter takes the frame
+#define PRESENT_INDEX 0xFFFF
+
+int present_init(presenter *p, int buffers, int flags) {
+	memset(p, 0, sizeof(presenter));
+
+	if(buffers < PRESENT_MIN_BUFFERS || buffers > PRESENT_MAX_BUFFERS) {
+		printf("Can't present with %d buffers\n", buffers);
+		return -1;
+	}
+
+	p->buffers = buffers;
+	p->flags = flags;
+	p->back = -1;
+	p->front = -1;
+	p->latest = buffers - 1; // so the first frame goes to buffer 0
+	p->published = CreateEventA(NULL, FALSE, FALSE, NULL);
+	p->taken = CreateEventA(NULL, FALSE, FALSE, NULL);
+
+	if(p->published == NULL || p->taken == NULL) {
+		printf("Could not create presenter events\n");
+		present_free(p);
+		return -1;
+	}
+
+	return 0;
+}
+
+// The buffer after the newest one in turn that isn't being shown, or -1.
+// The presenter only ever moves front to the newest buffer, which is never
+// a candidate, so the answer stays valid until the next present_publish.
+static int free_buffer(presenter *p) {
+	int i, next;
+
+	if((p->flags & PRESENT_LOSSLESS) && (p->latest & PRESENT_FRESH))
+		return -1; // the last frame hasn't been taken
+
+	for(i = 1; i < p->buffers; i++) {
+		next = ((p->latest & PRESENT_INDEX) + i) % p->buffers;
+
+		if(next != p->front)
+			return next;
+		if(p->flags & PRESENT_ORDERED)
+			return -1; // can't skip it
+	}
+
+	return -1;
+}
+
+int present_back(presenter *p, DWORD timeout) {
+	if(p->back >= 0)
+		return p->back;
+
+	// events are auto-reset and stay signaled, so a take between the check
+	// and the wait is not lost
+	if((p->back = free_buffer(p)) < 0) {
+		InterlockedIncrement(&p->stalls);
+
+		while((p->back = free_buffer(p)) < 0)
+			if(timeout == 0 || WaitForSingleObject(p->taken, timeout) == WAIT_TIMEOUT)
+				return (p->back = free_buffer(p));
+	}
+
+	return p->back;
+}
+
+int present_publish(presenter *p) {
+	LARGE_INTEGER now;
+	LONG previous;
+
+	if(p->back < 0)
+		return 0;
+
+	QueryPerformanceCounter(&now);
+	p->published_at[p->back] = now.QuadPart;
+
+	previous = InterlockedExchange(&p->latest, p->back | PRESENT_FRESH); // full barrier, buffer contents are visible first
+	p->back = -1;
+
+	InterlockedIncrement(&p->frames);
+	SetEvent(p->published);
+
+	if(previous & PRESENT_FRESH) { // overwritten before the presenter got to it
+		InterlockedIncrement(&p->dropped);
+		return 1;
+	}
+
+	return 0;
+}
+
+int present_take(presenter *p, DWORD timeout) {
+	LARGE_INTEGER now;
+	LONGLONG latency;
+	LONG latest;
+	int index;
+
+	for(;;) {
+		latest = p->latest;
+
+		if(!(latest & PRESENT_FRESH)) {
+			if(timeout == 0 || WaitForSingleObject(p->published, timeout) == WAIT_TIMEOUT)
+				if(!(p->latest & PRESENT_FRESH))
+					return -1;
+			continue;
+		}
+
+		// claim the buffer first, then check that it's still the newest one,
+		// or the decoder may already be writing it again
+		index = latest & PRESENT_INDEX;
+		InterlockedExchange(&p->front, index);
+
+		if(InterlockedCompareExchange(&p->latest, index, latest) == latest)
+			break;
+	}
+
+	SetEvent(p->taken);
+
+	QueryPerformanceCounter(&now);
+	latency = now.QuadPart - p->published_at[index];
+	p->latency_total += latency;
+	if(latency > p->latency_max)
+		p->latency_max = latency;
+	InterlockedIncrement(&p->shown);
+
+	return index;
+}
+
+void present_release(presenter *p) {
+	InterlockedExchange(&p->front, -1);
+	SetEvent(p->taken);
+}
+
+int present_pending(presenter *p) {
+	return (p->latest & PRESENT_FRESH) != 0;
+}
+
+void present_stats(presenter *p, present_counters *counters) {
+	LARGE_INTEGER frequency;
+	double ms_per_tick;
+
+	QueryPerformanceFrequency(&frequency);
+	ms_per_tick = 1000.0 / (double)frequency.QuadPart;
+
+	counters->frames = p->frames;
+	counters->shown = p->shown;
+	counters->dropped = p->dropped;
+	counters->stalls = p->stalls;
+	counters->latency_ms = p->shown ? p->latency_total * ms_per_tick / p->shown : 0.0;
+	counters->max_latency_ms = p->latency_max * ms_per_tick;
+}
+
+void present_free(presenter *p) {
+	if(p->published != NULL)
+		CloseHandle(p->published);
+	if(p->taken != NULL)
+		CloseHandle(p->taken);
+
+	memset(p, 0, sizeof(presenter));
+}
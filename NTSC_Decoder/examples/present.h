@@ -0,0 +1,71 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Triple buffering between a decoder and a presenter that shows the newest
+ * finished frame. */
+
+#ifndef PRESENT_H
+#define PRESENT_H
+
+#include "windows.h"
+
+#define PRESENT_MIN_BUFFERS 3
+#define PRESENT_MAX_BUFFERS 32
+
+#define PRESENT_ORDERED 1 // buffers are written in turn, for rings other processes follow
+#define PRESENT_LOSSLESS 2 // the decoder waits until every frame has been taken
+
+// Like the ring, this only hands out buffer indices and the caller owns the
+// buffers. The decoder always writes a buffer that is neither the newest
+// finished one nor the one being shown, so with three buffers it never
+// waits for the presenter, and the presenter always takes the newest frame.
+// Frames the decoder replaces before they are taken are counted as dropped.
+typedef struct {
+	volatile LONG latest; // newest finished buffer, PRESENT_FRESH until taken
+	char padding1[64 - sizeof(LONG)];
+	volatile LONG front; // buffer the presenter is showing, or -1
+	char padding2[64 - sizeof(LONG)];
+	int buffers, flags;
+	int back; // buffer the decoder writes, -1 until present_back
+	HANDLE published, taken; // signaled when a frame is published, or taken or released
+	LONGLONG published_at[PRESENT_MAX_BUFFERS]; // performance counter ticks, as stats_now
+
+	// written by the decoder
+	volatile LONG frames, dropped, stalls;
+	// written by the presenter
+	volatile LONG shown;
+	LONGLONG latency_total, latency_max; // ticks from publishing to taking
+} presenter;
+
+typedef struct {
+	long frames; // published by the decoder
+	long shown; // taken by the presenter
+	long dropped; // replaced by a newer frame before they were taken
+	long stalls; // times the decoder had to wait for a buffer
+	double latency_ms, max_latency_ms; // from publishing to taking, mean and worst
+} present_counters;
+
+// Returns 0 on success and -1 on failure
+int present_init(presenter *p, int buffers, int flags);
+
+// Decoder: get the buffer to write, waiting up to timeout ms if the flags
+// require it. Returns -1 if there is still no free buffer. Calling again
+// before present_publish returns the same buffer.
+int present_back(presenter *p, DWORD timeout);
+// Decoder: make the buffer from present_back the newest frame. Returns 1 if
+// this replaced a frame that was never taken, 0 otherwise.
+int present_publish(presenter *p);
+
+// Presenter: take the newest frame, waiting up to timeout ms for one that
+// hasn't been taken yet. Returns its buffer or -1 if there is none. The
+// buffer stays the presenter's until present_release or the next take.
+int present_take(presenter *p, DWORD timeout);
+// Presenter: done reading the buffer from present_take
+void present_release(presenter *p);
+
+// A frame has been published but not taken yet
+int present_pending(presenter *p);
+
+void present_stats(presenter *p, present_counters *counters);
+
+void present_free(presenter *p);
+
+#endif // PRESENT_H
@@ -0,0 +1,186 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Streaming sync pulse analyser: run-length encodes the sync level and keeps
+ * histograms of pulse widths, vertical blanking pulses and scanlines per
+ * field. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sync.h"
+#include "pulses.h"
+
+static void put_varint(pulses *p, unsigned long long value) {
+	do {
+		fputc((int)(value & 0x7f) | (value > 0x7f ? 0x80 : 0), p->out);
+		value >>= 7;
+		p->bytes++;
+	} while(value);
+}
+
+// Count a run of length samples into a histogram of 0.1 us bins, longer
+// ones go to the last bin
+static void add_width(pulses *p, long *bins, int count, long long length) {
+	long long bin = length * p->interval_ns / 100;
+
+	bins[bin < count ? bin : count - 1]++;
+}
+
+// A run of length samples at level is_sync just ended
+static void end_run(pulses *p, long long length, int is_sync) {
+	if(p->out != NULL) {
+		put_varint(p, ((unsigned long long)length << 1) | is_sync);
+		p->runs++;
+	}
+
+	if(is_sync) { // a sync pulse ended
+		add_width(p, p->width, PULSES_WIDTH_BINS, length);
+
+		if(!p->vsync)
+			p->hsync++;
+		else if(length > p->long_low)
+			p->broad_pulses++;
+		else {
+			p->equalizing++;
+			p->blanking_equalizing++;
+			add_width(p, p->equalizing_width, PULSES_BLANKING_BINS, length);
+		}
+
+		p->broad = p->vsync && length > p->long_low;
+	} else if(length > p->screen_width) { // a normal scanline ended
+		if(p->vsync && p->whole) {
+			p->equalizing_per_blanking[p->blanking_equalizing < PULSES_MAX_BLANKING ?
+				p->blanking_equalizing : PULSES_MAX_BLANKING]++;
+			p->serrations_per_blanking[p->blanking_serrations < PULSES_MAX_BLANKING ?
+				p->blanking_serrations : PULSES_MAX_BLANKING]++;
+		}
+
+		p->vsync = 0;
+		p->lines++;
+	} else { // short one, in vertical blanking
+		if(!p->vsync) { // it starts here
+			p->whole = p->lines > 0;
+			p->blanking_equalizing = p->blanking_serrations = 0;
+		}
+
+		if(p->broad) {
+			p->serrations++;
+			p->blanking_serrations++;
+			add_width(p, p->serration_width, PULSES_BLANKING_BINS, length);
+		}
+
+		if(p->lines > 0) {
+			// the first field was joined half way
+			if(p->fields_seen++)
+				p->lines_per_field[p->lines < PULSES_MAX_LINES ? p->lines : PULSES_MAX_LINES]++;
+			p->lines = 0;
+		}
+		p->vsync = 1;
+	}
+}
+
+int pulses_init(pulses *p, int treshold, int interval_ns, FILE *out) {
+	pulses_header header;
+
+	memset(p, 0, sizeof(pulses));
+	p->treshold = treshold;
+	p->interval_ns = interval_ns;
+	p->screen_width = 58000 / interval_ns; // lines shorter than this are definitely part of screen blanking
+	p->long_low = 15000 / interval_ns; // broad pulses are 27 us, equalizing ones 2.3 us
+	p->out = out;
+
+	if(out == NULL)
+		return 0;
+
+	memset(&header, 0, sizeof(pulses_header));
+	memcpy(header.magic, PULSES_MAGIC, sizeof(header.magic));
+	header.treshold = treshold;
+	header.interval_ns = interval_ns;
+
+	if(fwrite(&header, sizeof(pulses_header), 1, out) != 1) {
+		printf("Could not write RLE header\n");
+		return -1;
+	}
+	p->bytes = sizeof(pulses_header);
+
+	return 0;
+}
+
+void pulses_feed(pulses *p, const short *samples, int count) {
+	sync_slicer slicer;
+	long long edge;
+	int i;
+
+	// the slicer counts samples <= treshold as sync
+	slicer_init(&slicer, samples, 0, count, p->treshold - 1, p->is_sync);
+
+	while((i = slicer_next(&slicer)) < count) {
+		edge = p->position + i;
+		end_run(p, edge - p->run_start, p->is_sync);
+		p->run_start = edge;
+		p->is_sync = slicer.is_sync;
+	}
+
+	p->position += count;
+}
+
+int pulses_finish(pulses *p) {
+	if(p->position > p->run_start && p->out != NULL) {
+		put_varint(p, ((unsigned long long)(p->position - p->run_start) << 1) | p->is_sync);
+		p->runs++;
+	}
+
+	p->run_start = p->position;
+
+	if(p->out != NULL && (fflush(p->out) || ferror(p->out))) {
+		printf("Could not write RLE stream\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Nonzero bins of a width histogram in 0.1 us steps
+static void print_widths(FILE *out, const char *title, long *bins, int count) {
+	int i;
+
+	fprintf(out, "%s:\n", title);
+	for(i = 0; i < count; i++)
+		if(bins[i])
+			fprintf(out, "%s%5.1f us %8ld\n", i == count - 1 ? ">=" : "  ", i / 10.0, bins[i]);
+}
+
+// Nonzero bins of a histogram of counts up to max, returns the total
+static long print_counts(FILE *out, const char *title, long *bins, int max) {
+	long total = 0;
+	int i;
+
+	fprintf(out, "%s:\n", title);
+	for(i = 0; i <= max; i++)
+		if(bins[i]) {
+			fprintf(out, "%s%4d %8ld\n", i == max ? ">=" : "  ", i, bins[i]);
+			total += bins[i];
+		}
+
+	return total;
+}
+
+void pulses_print(pulses *p, FILE *out) {
+
+	fprintf(out, "%lld samples, %ld HSYNC, %ld equalizing, %ld broad pulses, %ld serrations\n",
+		p->position, p->hsync, p->equalizing, p->broad_pulses, p->serrations);
+
+	if(p->out != NULL)
+		fprintf(out, "RLE stream: %lld runs in %lld bytes, %.0f times smaller than the samples\n",
+			p->runs, p->bytes, p->bytes ? 2.0 * p->position / p->bytes : 0.0);
+
+	print_widths(out, "Sync pulse widths", p->width, PULSES_WIDTH_BINS);
+	print_widths(out, "Equalizing pulse widths", p->equalizing_width, PULSES_BLANKING_BINS);
+	print_widths(out, "Serration widths", p->serration_width, PULSES_BLANKING_BINS);
+
+	if(!print_counts(out, "Equalizing pulses per vertical blanking", p->equalizing_per_blanking, PULSES_MAX_BLANKING))
+		fprintf(out, "  no complete vertical blanking\n");
+	print_counts(out, "Serrations per vertical blanking", p->serrations_per_blanking, PULSES_MAX_BLANKING);
+
+	if(!print_counts(out, "Scanlines per field", p->lines_per_field, PULSES_MAX_LINES))
+		fprintf(out, "  no complete fields\n");
+}
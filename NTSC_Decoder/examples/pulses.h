@@ -0,0 +1,62 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Streaming sync pulse analyser: run-length encodes the sync level and keeps
+ * histograms of pulse widths, vertical blanking pulses and scanlines per
+ * field. */
+
+#ifndef PULSES_H
+#define PULSES_H
+
+#include <stdio.h>
+
+#define PULSES_MAGIC "NTSCRLE1"
+#define PULSES_WIDTH_BINS 400 // sync pulse widths in 0.1 us steps, longer ones go to the last bin
+#define PULSES_MAX_LINES 1024 // scanlines per field, more go to the last bin
+#define PULSES_BLANKING_BINS 100 // equalizing pulse and serration widths in 0.1 us steps
+#define PULSES_MAX_BLANKING 32 // pulses per vertical blanking interval, more go to the last bin
+
+// The RLE stream starts with this header, followed by one record per run of
+// samples on the same side of the treshold: an unsigned LEB128 varint of
+// (length << 1) | is_sync. A scanline is two records of two bytes each, so
+// a field takes about a kilobyte. The last run is cut at the end of the
+// capture, so the lengths always add up to the samples analysed.
+typedef struct {
+	char magic[8];
+	int treshold; // samples below this are sync
+	int interval_ns; // time between samples
+} pulses_header;
+
+typedef struct {
+	int treshold, interval_ns;
+	int screen_width; // a high shorter than this is part of vertical blanking
+	int long_low; // a vertical blanking low longer than this is a broad pulse
+	int is_sync; // level of the run in progress
+	long long position; // samples analysed
+	long long run_start; // first sample of the run in progress
+	FILE *out; // RLE stream, or NULL
+	long long runs, bytes; // written to the RLE stream, header included
+
+	int vsync, broad, lines, fields_seen;
+	int whole; // the vertical blanking in progress started after scanlines
+	int blanking_equalizing, blanking_serrations; // counted in it so far
+	long width[PULSES_WIDTH_BINS]; // sync pulses by width
+	long lines_per_field[PULSES_MAX_LINES + 1];
+	long hsync, equalizing, broad_pulses, serrations;
+	
+	// vertical blanking: pulse widths, and pulses in each interval that started after scanlines
+	long equalizing_width[PULSES_BLANKING_BINS], serration_width[PULSES_BLANKING_BINS];
+	long equalizing_per_blanking[PULSES_MAX_BLANKING + 1], serrations_per_blanking[PULSES_MAX_BLANKING + 1];
+} pulses;
+
+// Start analysing a signal sampled every interval_ns, writing the RLE stream
+// to out unless it's NULL. Returns 0 on success and -1 if out can't be written.
+int pulses_init(pulses *p, int treshold, int interval_ns, FILE *out);
+
+// Analyse the next count samples, the runs carry over from the previous call
+void pulses_feed(pulses *p, const short *samples, int count);
+
+// Write out the run in progress, returns 0 on success and -1 on write errors
+int pulses_finish(pulses *p);
+
+void pulses_print(pulses *p, FILE *out);
+
+#endif // PULSES_H
@@ -0,0 +1,260 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Polyphase horizontal resampling of 32-bit RGB scanlines to any width. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <math.h>
+
+#include "resample.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_RESAMPLE
+#include <immintrin.h>
+#endif
+
+#define COEF_SHIFT 14
+#define COEF_ONE (1 << COEF_SHIFT)
+
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+static const double PI = 3.14159265358979323846;
+
+static double sinc(double x) {
+	return x == 0.0 ? 1.0 : sin(PI * x) / (PI * x);
+}
+
+// Index of tap t of a phase in the interleaved coefficient layout
+static int coef_index(int t) {
+	return (t >> 2) * 16 + (t & 2) * 4 + (t & 1);
+}
+
+static void resample_scalar(const resampler *rs, unsigned int *out, const unsigned int *in, int from, int to) {
+	const unsigned int *p;
+	const short *c;
+	int j, t, ch, sum[3];
+
+	for(j = from; j < to; j++) {
+		p = in + rs->first[j];
+		c = rs->coef + rs->phase[j] * rs->taps * 4;
+
+		sum[0] = sum[1] = sum[2] = COEF_ONE / 2;
+		for(t = 0; t < rs->taps; t++) {
+			sum[0] += c[coef_index(t)] * (int)(p[t] & 0xFF);
+			sum[1] += c[coef_index(t)] * (int)((p[t] >> 8) & 0xFF);
+			sum[2] += c[coef_index(t)] * (int)((p[t] >> 16) & 0xFF);
+		}
+
+		for(ch = 0; ch < 3; ch++)
+			sum[ch] = MAX(MIN(sum[ch] >> COEF_SHIFT, 255), 0);
+
+		out[j] = (sum[2] << 16) | (sum[1] << 8) | sum[0];
+	}
+}
+
+#ifdef SIMD_RESAMPLE
+
+// Four input pixels are spread into two vectors of 16-bit channels with
+// pixels 0 and 1 (2 and 3) of each channel side by side, so one multiply-add
+// against the interleaved coefficients gives two taps of all four channels.
+// Packing the sums with saturation clamps them to 0..255.
+
+#define SPREAD_LO 0, -1, 4, -1, 1, -1, 5, -1, 2, -1, 6, -1, 3, -1, 7, -1
+#define SPREAD_HI 8, -1, 12, -1, 9, -1, 13, -1, 10, -1, 14, -1, 11, -1, 15, -1
+
+__attribute__((target("ssse3")))
+static void resample_ssse3(const resampler *rs, unsigned int *out, const unsigned int *in, int from, int to) {
+	__m128i lo = _mm_setr_epi8(SPREAD_LO), hi = _mm_setr_epi8(SPREAD_HI), round = _mm_set1_epi32(COEF_ONE / 2);
+	__m128i acc, v;
+	const __m128i *c;
+	const unsigned int *p;
+	int j, t;
+
+	for(j = from; j < to; j++) {
+		p = in + rs->first[j];
+		c = (const __m128i *)(rs->coef + rs->phase[j] * rs->taps * 4);
+		acc = round;
+
+		for(t = 0; t < rs->taps; t += 4, c += 2) {
+			v = _mm_loadu_si128((const __m128i *)(p + t));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi8(v, lo), _mm_load_si128(c)));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi8(v, hi), _mm_load_si128(c + 1)));
+		}
+
+		acc = _mm_srai_epi32(acc, COEF_SHIFT);
+		acc = _mm_packs_epi32(acc, acc);
+		out[j] = (unsigned int)_mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+	}
+}
+
+// Two outputs at a time, one in each 128-bit lane
+__attribute__((target("avx2")))
+static void resample_avx2(const resampler *rs, unsigned int *out, const unsigned int *in, int from, int to) {
+	__m256i lo = _mm256_setr_epi8(SPREAD_LO, SPREAD_LO), hi = _mm256_setr_epi8(SPREAD_HI, SPREAD_HI);
+	__m256i round = _mm256_set1_epi32(COEF_ONE / 2), acc, v;
+	const __m128i *c0, *c1;
+	const unsigned int *p0, *p1;
+	int j, t;
+
+	for(j = from; j + 2 <= to; j += 2) {
+		p0 = in + rs->first[j];
+		p1 = in + rs->first[j + 1];
+		c0 = (const __m128i *)(rs->coef + rs->phase[j] * rs->taps * 4);
+		c1 = (const __m128i *)(rs->coef + rs->phase[j + 1] * rs->taps * 4);
+		acc = round;
+
+		for(t = 0; t < rs->taps; t += 4, c0 += 2, c1 += 2) {
+			v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(p0 + t))),
+				_mm_loadu_si128((const __m128i *)(p1 + t)), 1);
+			acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_shuffle_epi8(v, lo),
+				_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128(c0)), _mm_load_si128(c1), 1)));
+			acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_shuffle_epi8(v, hi),
+				_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128(c0 + 1)), _mm_load_si128(c1 + 1), 1)));
+		}
+
+		acc = _mm256_srai_epi32(acc, COEF_SHIFT);
+		acc = _mm256_packs_epi32(acc, acc);
+		acc = _mm256_packus_epi16(acc, acc);
+		out[j] = (unsigned int)_mm256_extract_epi32(acc, 0);
+		out[j + 1] = (unsigned int)_mm256_extract_epi32(acc, 4);
+	}
+
+	resample_scalar(rs, out, in, j, to);
+}
+
+#endif // SIMD_RESAMPLE
+
+static void (*filter_line)(const resampler *, unsigned int *, const unsigned int *, int, int) = NULL;
+
+const char * resample_setup(int simd) {
+	filter_line = &resample_scalar;
+
+#ifdef SIMD_RESAMPLE
+	if(simd) {
+		__builtin_cpu_init();
+
+		if(__builtin_cpu_supports("avx2"))
+			filter_line = &resample_avx2;
+		else if(__builtin_cpu_supports("ssse3"))
+			filter_line = &resample_ssse3;
+	}
+
+	if(filter_line == &resample_avx2)
+		return "AVX2";
+	if(filter_line == &resample_ssse3)
+		return "SSSE3";
+#endif
+
+	return "scalar";
+}
+
+// Coefficients of one phase, rounded so that they still sum to exactly one
+static void build_phase(short *coef, int taps, double offset, double cutoff) {
+	double weight[RESAMPLE_MAX_TAPS], x, total = 0.0;
+	int t, k, sum = 0, peak = 0;
+
+	for(t = 0; t < taps; t++) {
+		x = (t - taps / 2 + 1 - offset) * cutoff; // distance from the centre in output pixels
+		weight[t] = (fabs(x) < 2.0) ? sinc(x) * sinc(x / 2.0) : 0.0;
+		total += weight[t];
+	}
+
+	for(t = 0; t < taps; t++) {
+		coef[coef_index(t)] = (short)floor(weight[t] / total * COEF_ONE + 0.5);
+		sum += coef[coef_index(t)];
+		if(weight[t] > weight[peak])
+			peak = t;
+	}
+
+	coef[coef_index(peak)] += COEF_ONE - sum;
+
+	// the SIMD kernels multiply every tap pair four times over
+	for(t = 0; t < taps; t += 2) {
+		for(k = 2; k < 8; k += 2) {
+			coef[coef_index(t) + k] = coef[coef_index(t)];
+			coef[coef_index(t) + k + 1] = coef[coef_index(t + 1)];
+		}
+	}
+}
+
+int resampler_init(resampler *rs, int in_width, int out_width) {
+	double ratio, cutoff, x;
+	int j, p, start;
+
+	if(filter_line == NULL)
+		resample_setup(1);
+
+	memset(rs, 0, sizeof(resampler));
+
+	if(in_width <= 0 || out_width <= 0) {
+		printf("Cannot resample %d pixels to %d\n", in_width, out_width);
+		return -1;
+	}
+
+	ratio = (double)in_width / out_width;
+	cutoff = MIN(1.0, 1.0 / ratio);
+	rs->taps = ((int)ceil(4.0 / cutoff) + 3) & ~3;
+	rs->taps = MIN(rs->taps, RESAMPLE_MAX_TAPS);
+	if(rs->taps * cutoff < 4.0)
+		cutoff = 4.0 / rs->taps; // shrinking a lot, keep the whole window within the taps
+
+	rs->coef = (short *)_aligned_malloc(RESAMPLE_PHASES * rs->taps * 4 * sizeof(short), 64);
+	rs->first = (int *)malloc(out_width * sizeof(int));
+	rs->phase = (short *)malloc(out_width * sizeof(short));
+
+	if(rs->coef == NULL || rs->first == NULL || rs->phase == NULL) {
+		printf("Could not allocate resampler for %d to %d pixels\n", in_width, out_width);
+		resampler_free(rs);
+		return -1;
+	}
+
+	for(p = 0; p < RESAMPLE_PHASES; p++)
+		build_phase(rs->coef + p * rs->taps * 4, rs->taps, (double)p / RESAMPLE_PHASES, cutoff);
+
+	for(j = 0; j < out_width; j++) {
+		x = (j + 0.5) * ratio - 0.5;
+		start = (int)floor(x);
+		p = (int)floor((x - start) * RESAMPLE_PHASES + 0.5);
+
+		if(p == RESAMPLE_PHASES) { // rounds to the next pixel
+			start++;
+			p = 0;
+		}
+
+		rs->first[j] = start - rs->taps / 2 + 1;
+		rs->phase[j] = (short)p;
+	}
+
+	rs->in_width = in_width;
+	rs->out_width = out_width;
+
+	return 0;
+}
+
+void resampler_free(resampler *rs) {
+	if(rs->coef != NULL)
+		_aligned_free(rs->coef);
+	free(rs->first);
+	free(rs->phase);
+
+	memset(rs, 0, sizeof(resampler));
+}
+
+int resample_run(const resampler *rs, int from, int *first, int *last) {
+	int to = from + 1;
+
+	// first[] never decreases, so the run ends at the first output reaching too far
+	while(to < rs->out_width && rs->first[to] + rs->taps <= rs->first[from] + RESAMPLE_CHUNK)
+		to++;
+
+	*first = rs->first[from];
+	*last = rs->first[to - 1] + rs->taps;
+
+	return to;
+}
+
+void resample_line(const resampler *rs, unsigned int *out, const unsigned int *in, int from, int to) {
+	filter_line(rs, out, in, from, to);
+}
@@ -0,0 +1,46 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Polyphase horizontal resampling of 32-bit RGB scanlines to any width. */
+
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#define RESAMPLE_PHASES 64 // filter positions between two input pixels
+#define RESAMPLE_MAX_TAPS 64 // enough for shrinking to 1/16 without aliasing
+#define RESAMPLE_CHUNK 512 // most input pixels resample_run asks for at a time
+
+// Output pixel j is centred at input position (j + 0.5) * in_width /
+// out_width - 0.5 and filtered from taps input pixels starting at first[j],
+// with the coefficients of the nearest of RESAMPLE_PHASES subpixel phases.
+// The filter is a Lanczos-2 windowed sinc, widened when shrinking so that
+// it also works as the anti-aliasing filter.
+//
+// Coefficients are 1.14 fixed point, summing to 16384 for each phase. A
+// phase is taps / 4 blocks of 16 shorts, the first 8 holding taps 0 and 1
+// and the next 8 taps 2 and 3 of the block repeated 4 times, which is the
+// order the SIMD kernels multiply them in. The table is 64-byte aligned.
+typedef struct {
+	int in_width, out_width;
+	int taps; // multiple of 4
+	short *coef; // RESAMPLE_PHASES x taps * 4
+	int *first; // out_width first input pixels, can be < 0 or past in_width at the edges
+	short *phase; // out_width phases
+} resampler;
+
+// Returns 0 on success and -1 on failure
+int resampler_init(resampler *rs, int in_width, int out_width);
+void resampler_free(resampler *rs);
+
+// Outputs from onwards that can be filtered from at most RESAMPLE_CHUNK
+// consecutive input pixels. Returns the end of the run and sets the input
+// pixels it needs, [*first, *last).
+int resample_run(const resampler *rs, int from, int *first, int *last);
+
+// Filter outputs [from, to) into out[from..to). in[first[j]] has to be
+// readable for all their taps, see resample_run.
+void resample_line(const resampler *rs, unsigned int *out, const unsigned int *in, int from, int to);
+
+// Select the filter kernel: simd = 0 forces the portable one. Called
+// automatically with simd = 1 on first use. Returns the kernel name.
+const char * resample_setup(int simd);
+
+#endif // RESAMPLE_H
@@ -0,0 +1,74 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Lock-free single producer, single consumer ring of buffer slots. */
+
+#include "windows.h"
+#include <stdio.h>
+#include <string.h>
+
+#include "ring.h"
+
+int ring_init(spsc_ring *ring, int slots) {
+	memset(ring, 0, sizeof(spsc_ring));
+
+	if(slots <= 0 || (slots & (slots - 1))) {
+		printf("Ring size %d is not a power of two\n", slots);
+		return -1;
+	}
+
+	ring->slots = slots;
+	ring->written = CreateEventA(NULL, FALSE, FALSE, NULL);
+	ring->read = CreateEventA(NULL, FALSE, FALSE, NULL);
+
+	if(ring->written == NULL || ring->read == NULL) {
+		printf("Could not create ring events\n");
+		ring_free(ring);
+		return -1;
+	}
+
+	return 0;
+}
+
+int ring_write_slot(spsc_ring *ring, DWORD timeout) {
+	// events are auto-reset and stay signaled, so a release between the
+	// check and the wait is not lost
+	while(ring->head - ring->tail == ring->slots)
+		if(timeout == 0 || WaitForSingleObject(ring->read, timeout) == WAIT_TIMEOUT)
+			if(ring->head - ring->tail == ring->slots)
+				return -1;
+
+	return (unsigned long)ring->head & (ring->slots - 1);
+}
+
+void ring_commit(spsc_ring *ring) {
+	InterlockedIncrement(&ring->head); // full barrier, slot contents are visible first
+	SetEvent(ring->written);
+}
+
+int ring_read_slot(spsc_ring *ring, DWORD timeout) {
+	while(ring->head == ring->tail)
+		if(timeout == 0 || WaitForSingleObject(ring->written, timeout) == WAIT_TIMEOUT)
+			if(ring->head == ring->tail)
+				return -1;
+
+	MemoryBarrier(); // don't read slot contents before head
+
+	return (unsigned long)ring->tail & (ring->slots - 1);
+}
+
+void ring_release(spsc_ring *ring) {
+	InterlockedIncrement(&ring->tail);
+	SetEvent(ring->read);
+}
+
+int ring_count(spsc_ring *ring) {
+	return ring->head - ring->tail;
+}
+
+void ring_free(spsc_ring *ring) {
+	if(ring->written != NULL)
+		CloseHandle(ring->written);
+	if(ring->read != NULL)
+		CloseHandle(ring->read);
+
+	memset(ring, 0, sizeof(spsc_ring));
+}
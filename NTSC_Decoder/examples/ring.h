@@ -0,0 +1,42 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Lock-free single producer, single consumer ring of buffer slots. */
+
+#ifndef RING_H
+#define RING_H
+
+#include "windows.h"
+
+// The ring only hands out slot indices, the caller owns the slot buffers.
+// head and tail are each written by one side only, so no locks are needed;
+// the events are just for sleeping on an empty or a full ring.
+typedef struct {
+	volatile LONG head; // slots written, only changed by the producer
+	char padding1[64 - sizeof(LONG)];
+	volatile LONG tail; // slots read, only changed by the consumer
+	char padding2[64 - sizeof(LONG)];
+	int slots;
+	HANDLE written, read; // signaled when a slot is committed or released
+} spsc_ring;
+
+// slots has to be a power of two, so slot indices stay in order when the
+// counters wrap around. Returns 0 on success and -1 on failure.
+int ring_init(spsc_ring *ring, int slots);
+
+// Producer: get the slot to fill, waiting up to timeout ms for a free one.
+// Returns -1 if the ring is still full.
+int ring_write_slot(spsc_ring *ring, DWORD timeout);
+// Producer: publish the slot from ring_write_slot to the consumer
+void ring_commit(spsc_ring *ring);
+
+// Consumer: get the oldest filled slot, waiting up to timeout ms for one.
+// Returns -1 if the ring is still empty.
+int ring_read_slot(spsc_ring *ring, DWORD timeout);
+// Consumer: hand the slot from ring_read_slot back to the producer
+void ring_release(spsc_ring *ring);
+
+// Amount of filled slots
+int ring_count(spsc_ring *ring);
+
+void ring_free(spsc_ring *ring);
+
+#endif // RING_H
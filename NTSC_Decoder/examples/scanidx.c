@@ -0,0 +1,265 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Scanline index of a capture file: HSYNC starts, VSYNC boundaries and field
+ * types, saved as a sidecar file next to the capture. */
+
+#include "windows.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scanidx.h"
+#include "sync.h"
+
+#define ST_WAIT_NORMAL 0
+#define ST_WAIT_BLANK 1
+#define ST_COUNT_LONGS 2
+#define ST_WAIT_NON_BLANK 3
+#define ST_DRAW 4
+
+#define INDEX_WINDOW (16*1024*1024) // samples mapped at a time while indexing
+#define MAX_LINES 1024 // a field with more scanlines than this has lost sync
+
+#define INDEX_MAGIC "NTSCIDX2"
+
+typedef struct {
+	char magic[8];
+	long long samples, file_size, modified;
+	int treshold, screen_width, long_high;
+	int fields;
+	long lines;
+} index_header;
+
+// On failure the arrays are left as they were, for scanidx_build to free
+static int add_field(scanidx *idx, int *allocated) {
+	scanidx_field *grown;
+
+	if(idx->fields == *allocated) {
+		grown = (scanidx_field *)realloc(idx->field, sizeof(scanidx_field) * *allocated * 2);
+		if(grown == NULL)
+			return -1;
+		idx->field = grown;
+		*allocated *= 2;
+	}
+
+	return idx->fields++;
+}
+
+static int add_line(scanidx *idx, long *allocated, unsigned int start) {
+	unsigned int *grown;
+
+	if(idx->lines == *allocated) {
+		grown = (unsigned int *)realloc(idx->line, sizeof(unsigned int) * *allocated * 2);
+		if(grown == NULL)
+			return -1;
+		idx->line = grown;
+		*allocated *= 2;
+	}
+
+	idx->line[idx->lines++] = start;
+
+	return 0;
+}
+
+int scanidx_build(scanidx *idx, capfile *cf, int treshold, int screen_width, int long_high) {
+	sync_slicer slicer;
+	short *view;
+	scanidx_field *field = NULL;
+	long long first, offset, previous = -1, count, field_start = 0;
+	long lines_allocated = 64 * 256, first_line = 0;
+	int fields_allocated = 64, state = ST_WAIT_NORMAL, longs = 0, is_sync = 0, edge, n;
+
+	memset(idx, 0, sizeof(scanidx));
+	idx->samples = cf->samples;
+	idx->file_size = cf->file_size;
+	idx->modified = cf->modified;
+	idx->treshold = treshold;
+	idx->screen_width = screen_width;
+	idx->long_high = long_high;
+	idx->field = (scanidx_field *)malloc(sizeof(scanidx_field) * fields_allocated);
+	idx->line = (unsigned int *)malloc(sizeof(unsigned int) * lines_allocated);
+	if(idx->field == NULL || idx->line == NULL)
+		goto fail;
+
+	// the state machine carries over window boundaries, so no overlap is needed
+	for(first = 0; first < cf->samples; first += cf->view_length) {
+		view = capfile_view(cf, first, INDEX_WINDOW);
+		if(view == NULL)
+			goto fail;
+
+		slicer_init(&slicer, view, 0, cf->view_length, treshold, is_sync);
+
+		while((edge = slicer_next(&slicer)) < cf->view_length) {
+			offset = first + edge;
+			count = offset - previous - 1; // samples since the last transition
+			previous = offset;
+			is_sync = slicer.is_sync;
+
+			if(!is_sync) // only HSYNC and VSYNC starts matter
+				continue;
+
+			switch(state) {
+			case ST_WAIT_NORMAL:
+				if(count > screen_width) // last scanline was normal
+					state++;
+				break;
+			case ST_WAIT_BLANK:
+				if(count < screen_width) { // first vsync period
+					state++;
+					longs = (count > long_high) ? 1 : 0;
+				}
+				break;
+			case ST_COUNT_LONGS:
+				if(count > long_high) // another long
+					longs++;
+				else // longs counted
+					state++;
+				break;
+			case ST_WAIT_NON_BLANK:
+				if(count > screen_width) { // first scanline of the field
+					state++;
+					field_start = offset;
+					first_line = idx->lines;
+					if(add_line(idx, &lines_allocated, 0))
+						goto fail;
+				}
+				break;
+			case ST_DRAW:
+				if(count < screen_width) { // VSYNC ends the field
+					if((n = add_field(idx, &fields_allocated)) < 0)
+						goto fail;
+
+					field = idx->field + n;
+					field->start = field_start;
+					field->end = offset;
+					field->first_line = first_line;
+					field->lines = (int)(idx->lines - first_line);
+					// scanlines after the first, as extract_field counts them
+					field->type = (field->lines - 1 < 252) ? -1 : ((longs == 7) ? 0 : 1);
+
+					// this was the first vsync period of the next field
+					state = ST_COUNT_LONGS;
+					longs = (count > long_high) ? 1 : 0;
+				} else if(idx->lines - first_line >= MAX_LINES) { // lost sync, drop the field
+					idx->lines = first_line;
+					state = ST_WAIT_NORMAL;
+				} else if(add_line(idx, &lines_allocated, (unsigned int)(offset - field_start)))
+					goto fail;
+				break;
+			}
+		}
+	}
+
+	if(state == ST_DRAW) // capture ended in the middle of a field
+		idx->lines = first_line;
+
+	return 0;
+
+fail:
+	printf("Could not index capture\n");
+	scanidx_free(idx);
+	return -1;
+}
+
+int scanidx_save(scanidx *idx, const char *filename) {
+	index_header header;
+	FILE *out;
+	int ok;
+
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	header.samples = idx->samples;
+	header.file_size = idx->file_size;
+	header.modified = idx->modified;
+	header.treshold = idx->treshold;
+	header.screen_width = idx->screen_width;
+	header.long_high = idx->long_high;
+	header.fields = idx->fields;
+	header.lines = idx->lines;
+
+	out = fopen(filename, "wb");
+	if(out == NULL) {
+		printf("Could not write index %s\n", filename);
+		return -1;
+	}
+
+	ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+		fwrite(idx->field, sizeof(scanidx_field), idx->fields, out) == (size_t)idx->fields &&
+		fwrite(idx->line, sizeof(unsigned int), idx->lines, out) == (size_t)idx->lines;
+
+	fclose(out);
+
+	if(!ok) {
+		printf("Could not write index %s\n", filename);
+		remove(filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+int scanidx_load(scanidx *idx, const char *filename, capfile *cf, int treshold, int screen_width, int long_high) {
+	index_header header;
+	FILE *in;
+
+	memset(idx, 0, sizeof(scanidx));
+
+	in = fopen(filename, "rb");
+	if(in == NULL)
+		return -1;
+
+	if(fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) ||
+			header.samples != cf->samples || header.file_size != cf->file_size || header.modified != cf->modified ||
+			header.treshold != treshold ||
+			header.screen_width != screen_width || header.long_high != long_high) {
+		fclose(in); // stale or foreign index
+		return -1;
+	}
+
+	idx->samples = header.samples;
+	idx->file_size = header.file_size;
+	idx->modified = header.modified;
+	idx->treshold = header.treshold;
+	idx->screen_width = header.screen_width;
+	idx->long_high = header.long_high;
+	idx->fields = header.fields;
+	idx->lines = header.lines;
+	idx->field = (scanidx_field *)malloc(sizeof(scanidx_field) * (idx->fields + 1));
+	idx->line = (unsigned int *)malloc(sizeof(unsigned int) * (idx->lines + 1));
+
+	if(idx->field == NULL || idx->line == NULL ||
+			fread(idx->field, sizeof(scanidx_field), idx->fields, in) != (size_t)idx->fields ||
+			fread(idx->line, sizeof(unsigned int), idx->lines, in) != (size_t)idx->lines) {
+		printf("Could not read index %s\n", filename);
+		fclose(in);
+		scanidx_free(idx);
+		return -1;
+	}
+
+	fclose(in);
+
+	return 0;
+}
+
+int scanidx_open(scanidx *idx, capfile *cf, const char *capture, int treshold, int screen_width, int long_high) {
+	char name[MAX_PATH];
+
+	snprintf(name, sizeof(name), "%s" SCANIDX_EXT, capture);
+
+	if(!scanidx_load(idx, name, cf, treshold, screen_width, long_high)) {
+		printf("Loaded scanline index %s (%d fields)\n", name, idx->fields);
+		return 0;
+	}
+
+	if(scanidx_build(idx, cf, treshold, screen_width, long_high))
+		return -1;
+
+	printf("Indexed %d fields of %s\n", idx->fields, capture);
+	scanidx_save(idx, name); // decoding can go on without the sidecar
+
+	return 0;
+}
+
+void scanidx_free(scanidx *idx) {
+	free(idx->field);
+	free(idx->line);
+	memset(idx, 0, sizeof(scanidx));
+}
@@ -0,0 +1,47 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Scanline index of a capture file: HSYNC starts, VSYNC boundaries and field
+ * types, saved as a sidecar file next to the capture. */
+
+#ifndef SCANIDX_H
+#define SCANIDX_H
+
+#include "capfile.h"
+
+typedef struct {
+	long long start; // HSYNC start of the first scanline after VSYNC
+	long long end; // start of the VSYNC that ends the field
+	int type; // 0 for first field, 1 for second field, -1 for partial field
+	int lines; // amount of scanlines
+	long first_line; // index of the first scanline in scanidx.line
+} scanidx_field;
+
+typedef struct {
+	long long samples; // length of the indexed capture
+	long long file_size, modified; // of the indexed capture, as in capfile
+	int treshold, screen_width, long_high; // sync parameters the index was built with
+	int fields;
+	scanidx_field *field;
+	long lines;
+	unsigned int *line; // HSYNC starts relative to the start of their field
+} scanidx;
+
+// Run the sync state machine over the whole capture, returns 0 on success and -1 on failure
+int scanidx_build(scanidx *idx, capfile *cf, int treshold, int screen_width, int long_high);
+
+int scanidx_save(scanidx *idx, const char *filename);
+
+// Load an index, returns -1 if it's missing or was not built for this capture
+// (length, file size and last write time) and these sync parameters
+int scanidx_load(scanidx *idx, const char *filename, capfile *cf, int treshold, int screen_width, int long_high);
+
+// Load the sidecar index of capture, or build and save it if there's none
+int scanidx_open(scanidx *idx, capfile *cf, const char *capture, int treshold, int screen_width, int long_high);
+
+void scanidx_free(scanidx *idx);
+
+// Sample offset of scanline "line" of field n
+#define SCANIDX_LINE(idx, n, line) ((idx)->field[n].start + (idx)->line[(idx)->field[n].first_line + (line)])
+
+#define SCANIDX_EXT ".idx"
+
+#endif // SCANIDX_H
@@ -0,0 +1,251 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Per-thread latency histograms and event counters for the decoders. */
+
+#include "windows.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// Log-linear buckets in ns: values below 16 get a bucket each, above that
+// every power of two is split in 8, so bucket width is at most 1/8 of its value
+#define SUB_BITS 3
+#define MAX_EXPONENT 47 // about 39 hours, longer times go to the last bucket
+#define BUCKETS (((MAX_EXPONENT - SUB_BITS) << SUB_BITS) + (2 << SUB_BITS))
+
+typedef struct stats_thread {
+	struct stats_thread *next;
+	volatile LONG count[STATS_MAX_STAGES][BUCKETS];
+	volatile LONGLONG total[STATS_MAX_STAGES], max[STATS_MAX_STAGES]; // ns
+} stats_thread;
+
+static stats_thread * volatile threads = NULL; // histograms of every thread that has recorded
+static THREAD_LOCAL stats_thread *own = NULL;
+
+static const char *stage_name[STATS_MAX_STAGES];
+static const char *counter_name[STATS_MAX_COUNTERS];
+static volatile LONG counters[STATS_MAX_COUNTERS];
+
+static double ns_per_tick;
+
+void stats_init() {
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceFrequency(&frequency);
+	ns_per_tick = 1e9 / (double)frequency.QuadPart;
+}
+
+void stats_stage(int stage, const char *name) {
+	stage_name[stage] = name;
+}
+
+void stats_counter(int counter, const char *name) {
+	counter_name[counter] = name;
+}
+
+stats_time stats_now() {
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+
+	return (stats_time)now.QuadPart;
+}
+
+static int bucket_of(unsigned long long ns) {
+	int e = 0;
+
+	if(ns < (2 << SUB_BITS))
+		return (int)ns;
+
+	while(ns >> (e + 1))
+		e++; // highest set bit
+
+	if(e > MAX_EXPONENT)
+		return BUCKETS - 1;
+
+	return ((e - SUB_BITS) << SUB_BITS) + (int)(ns >> (e - SUB_BITS));
+}
+
+// Middle of the values falling in bucket b
+static double bucket_value(int b) {
+	int e;
+
+	if(b < (2 << SUB_BITS))
+		return b;
+
+	e = (b >> SUB_BITS) + SUB_BITS - 1;
+
+	return (double)((long long)(b - ((e - SUB_BITS) << SUB_BITS)) << (e - SUB_BITS)) +
+		(double)(1LL << (e - SUB_BITS)) / 2.0;
+}
+
+// First use on a thread links its histograms to the global list
+static stats_thread * own_stats() {
+	stats_thread *head;
+
+	if(own != NULL)
+		return own;
+
+	own = (stats_thread *)calloc(1, sizeof(stats_thread));
+	if(own == NULL)
+		return NULL;
+
+	do {
+		head = threads;
+		own->next = head;
+	} while(InterlockedCompareExchangePointer((void * volatile *)&threads, own, head) != head);
+
+	return own;
+}
+
+void stats_record(int stage, stats_time start) {
+	stats_thread *mine = own_stats();
+	long long ns = (long long)((stats_now() - start) * ns_per_tick);
+
+	if(mine == NULL)
+		return;
+
+	// only this thread writes here, readers may see a slightly old value
+	mine->count[stage][bucket_of(ns)]++;
+	mine->total[stage] += ns;
+	if(ns > mine->max[stage])
+		mine->max[stage] = ns;
+}
+
+void stats_count(int counter_id, long amount) {
+	InterlockedExchangeAdd(&counters[counter_id], amount);
+}
+
+long stats_value(int counter_id) {
+	return counters[counter_id];
+}
+
+void stats_reset() {
+	stats_thread *t;
+	int i;
+
+	for(t = threads; t != NULL; t = t->next) {
+		memset((void *)t->count, 0, sizeof(t->count));
+		memset((void *)t->total, 0, sizeof(t->total));
+		memset((void *)t->max, 0, sizeof(t->max));
+	}
+
+	for(i = 0; i < STATS_MAX_COUNTERS; i++)
+		InterlockedExchange(&counters[i], 0);
+}
+
+// ns value below which fraction of the samples are
+static double percentile(LONG *count, long long samples, double fraction) {
+	long long seen = 0, target = (long long)(fraction * samples + 0.5);
+	int b;
+
+	if(target < 1)
+		target = 1;
+
+	for(b = 0; b < BUCKETS; b++)
+		if((seen += count[b]) >= target)
+			return bucket_value(b);
+
+	return bucket_value(BUCKETS - 1);
+}
+
+void stats_snapshot(FILE *out, int format) {
+	LONG merged[BUCKETS];
+	stats_thread *t;
+	long long samples, total, max;
+	double us[4]; // mean, p50, p99, max
+	int stage, c, b, first = 1;
+
+	if(format == STATS_JSON)
+		fprintf(out, "{\"stages\": [");
+	else if(format == STATS_CSV)
+		fprintf(out, "name,count,mean_us,p50_us,p99_us,max_us\n");
+	else
+		fprintf(out, "%-16s %10s %10s %10s %10s %10s\n", "Stage", "Count", "Mean us", "p50 us", "p99 us", "Max us");
+
+	for(stage = 0; stage < STATS_MAX_STAGES; stage++) {
+		if(stage_name[stage] == NULL)
+			continue;
+
+		memset(merged, 0, sizeof(merged));
+		samples = total = max = 0;
+
+		for(t = threads; t != NULL; t = t->next) {
+			for(b = 0; b < BUCKETS; b++) {
+				merged[b] += t->count[stage][b];
+				samples += t->count[stage][b];
+			}
+			total += t->total[stage];
+			if(t->max[stage] > max)
+				max = t->max[stage];
+		}
+
+		us[0] = samples ? total / 1000.0 / samples : 0;
+		us[1] = samples ? percentile(merged, samples, 0.50) / 1000.0 : 0;
+		us[2] = samples ? percentile(merged, samples, 0.99) / 1000.0 : 0;
+		us[3] = max / 1000.0;
+
+		// bucket middles can lie past the largest value actually seen
+		for(b = 1; b < 3; b++)
+			if(us[b] > us[3])
+				us[b] = us[3];
+
+		if(format == STATS_JSON)
+			fprintf(out, "%s\n  {\"name\": \"%s\", \"count\": %lld, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f}",
+				first ? "" : ",", stage_name[stage], samples, us[0], us[1], us[2], us[3]);
+		else if(format == STATS_CSV)
+			fprintf(out, "%s,%lld,%.3f,%.3f,%.3f,%.3f\n", stage_name[stage], samples, us[0], us[1], us[2], us[3]);
+		else
+			fprintf(out, "%-16s %10lld %10.1f %10.1f %10.1f %10.1f\n", stage_name[stage], samples, us[0], us[1], us[2], us[3]);
+
+		first = 0;
+	}
+
+	if(format == STATS_JSON)
+		fprintf(out, "\n], \"counters\": {");
+
+	for(c = 0, first = 1; c < STATS_MAX_COUNTERS; c++) {
+		if(counter_name[c] == NULL)
+			continue;
+
+		if(format == STATS_JSON)
+			fprintf(out, "%s\n  \"%s\": %ld", first ? "" : ",", counter_name[c], (long)counters[c]);
+		else if(format == STATS_CSV)
+			fprintf(out, "%s,%ld,,,,\n", counter_name[c], (long)counters[c]);
+		else
+			fprintf(out, "%-16s %10ld\n", counter_name[c], (long)counters[c]);
+
+		first = 0;
+	}
+
+	if(format == STATS_JSON)
+		fprintf(out, "\n}}\n");
+
+	fflush(out);
+}
+
+int stats_write(const char *filename) {
+	const char *extension = strrchr(filename, '.');
+	FILE *out;
+
+	out = fopen(filename, "w");
+	if(out == NULL) {
+		printf("Could not write statistics to %s\n", filename);
+		return -1;
+	}
+
+	stats_snapshot(out, extension == NULL ? STATS_TEXT :
+		!strcmp(extension, ".json") ? STATS_JSON :
+		!strcmp(extension, ".csv") ? STATS_CSV : STATS_TEXT);
+
+	fclose(out);
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Per-thread latency histograms and event counters for the decoders. */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+#define STATS_MAX_STAGES 16
+#define STATS_MAX_COUNTERS 16
+
+#define STATS_TEXT 0
+#define STATS_JSON 1
+#define STATS_CSV 2
+
+typedef unsigned long long stats_time;
+
+// Call once before any other thread records anything
+void stats_init();
+
+// Name a stage or counter, only named ones show in snapshots
+void stats_stage(int stage, const char *name);
+void stats_counter(int counter, const char *name);
+
+// Timestamp for stats_record, performance counter ticks
+stats_time stats_now();
+
+// Add the time since start to the histogram of stage. Every thread has its
+// own histograms, so this never takes a lock or an interlocked instruction.
+void stats_record(int stage, stats_time start);
+
+void stats_count(int counter, long amount);
+long stats_value(int counter);
+
+// Zero the histograms of every thread and the counters, for example between
+// captures. Only call while no other thread is recording.
+void stats_reset();
+
+// Merge the histograms of all threads and write count, mean, p50, p99 and
+// max of every stage plus the counters. Safe to call while recording.
+void stats_snapshot(FILE *out, int format);
+
+// Snapshot to a file, format from the extension: .json, .csv or text
+int stats_write(const char *filename);
+
+#endif // STATS_H
@@ -0,0 +1,161 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Sync slicer: finds the edges of the sync level from 32 sample bitmasks. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sync.h"
+
+#define BLOCK 32 // samples per level bitmask
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_SLICER
+#include <immintrin.h>
+#endif
+
+#ifdef __GNUC__
+#define CTZ(x) __builtin_ctz(x)
+#else
+static int CTZ(unsigned int x) {
+	int n = 0;
+
+	while(!(x & 1)) {
+		x >>= 1;
+		n++;
+	}
+
+	return n;
+}
+#endif
+
+// Bit i is set when samples[i] is sync level
+static unsigned int level_mask_scalar(const short *samples, int treshold) {
+	unsigned int mask = 0;
+	int i;
+
+	for(i = 0; i < BLOCK; i++)
+		if(samples[i] <= treshold)
+			mask |= 1u << i;
+
+	return mask;
+}
+
+#ifdef SIMD_SLICER
+
+__attribute__((target("sse2")))
+static unsigned int level_mask_sse2(const short *samples, int treshold) {
+	__m128i t = _mm_set1_epi16((short)treshold);
+	__m128i a = _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i *)samples), t);
+	__m128i b = _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i *)(samples + 8)), t);
+	__m128i c = _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i *)(samples + 16)), t);
+	__m128i d = _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i *)(samples + 24)), t);
+	unsigned int high;
+
+	// saturating pack keeps the 0 / -1 compare results, one byte per sample
+	high = (unsigned int)_mm_movemask_epi8(_mm_packs_epi16(a, b)) |
+		((unsigned int)_mm_movemask_epi8(_mm_packs_epi16(c, d)) << 16);
+
+	return ~high;
+}
+
+__attribute__((target("avx2")))
+static unsigned int level_mask_avx2(const short *samples, int treshold) {
+	__m256i t = _mm256_set1_epi16((short)treshold);
+	__m256i a = _mm256_cmpgt_epi16(_mm256_loadu_si256((const __m256i *)samples), t);
+	__m256i b = _mm256_cmpgt_epi16(_mm256_loadu_si256((const __m256i *)(samples + 16)), t);
+
+	// pack works within 128-bit lanes, so the result is a0 b0 a1 b1: swap the middle quarters
+	return ~(unsigned int)_mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8));
+}
+
+#endif // SIMD_SLICER
+
+static unsigned int (*level_mask)(const short *, int) = NULL;
+
+const char * slicer_setup(int simd) {
+	level_mask = &level_mask_scalar;
+
+#ifdef SIMD_SLICER
+	if(simd) {
+		__builtin_cpu_init();
+
+		if(__builtin_cpu_supports("avx2"))
+			level_mask = &level_mask_avx2;
+		else if(__builtin_cpu_supports("sse2"))
+			level_mask = &level_mask_sse2;
+	}
+
+	if(level_mask == &level_mask_avx2)
+		return "AVX2";
+	if(level_mask == &level_mask_sse2)
+		return "SSE2";
+#endif
+
+	return "scalar";
+}
+
+// Compute transitions for the block starting at slicer->base
+static void load_block(sync_slicer *slicer) {
+	unsigned int levels = 0;
+	int i, left = slicer->length - slicer->base;
+
+	if(left >= BLOCK) {
+		levels = level_mask(slicer->samples + slicer->base, slicer->treshold);
+		left = BLOCK;
+	} else { // partial block at the end, don't read past length
+		for(i = 0; i < left; i++)
+			if(slicer->samples[slicer->base + i] <= slicer->treshold)
+				levels |= 1u << i;
+	}
+
+	// sample i is an edge if its level differs from sample i-1
+	slicer->edges = levels ^ ((levels << 1) | slicer->level);
+
+	if(left < BLOCK)
+		slicer->edges &= (1u << left) - 1;
+
+	slicer->level = (levels >> (left - 1)) & 1;
+}
+
+void slicer_init(sync_slicer *slicer, const short *samples, int offset, int length, int treshold, int is_sync) {
+	if(level_mask == NULL)
+		slicer_setup(1);
+
+	// saturate so that the 16-bit compares agree with the int comparison
+	if(treshold > 32767)
+		treshold = 32767;
+	if(treshold < -32768)
+		treshold = -32768;
+
+	slicer->samples = samples;
+	slicer->length = length;
+	slicer->treshold = treshold;
+	slicer->base = offset;
+	slicer->edges = 0;
+	slicer->level = is_sync ? 1 : 0;
+	slicer->is_sync = slicer->level;
+
+	if(offset < length)
+		load_block(slicer);
+}
+
+int slicer_next(sync_slicer *slicer) {
+	int edge;
+
+	while(slicer->edges == 0) {
+		slicer->base += BLOCK;
+
+		if(slicer->base >= slicer->length) {
+			slicer->base = slicer->length;
+			return slicer->length;
+		}
+
+		load_block(slicer);
+	}
+
+	edge = slicer->base + CTZ(slicer->edges);
+	slicer->edges &= slicer->edges - 1; // clear the lowest set bit
+	slicer->is_sync = !slicer->is_sync;
+
+	return edge;
+}
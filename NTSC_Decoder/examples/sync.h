@@ -0,0 +1,33 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Sync slicer: finds the edges of the sync level from 32 sample bitmasks. */
+
+#ifndef SYNC_H
+#define SYNC_H
+
+// Iterates over the transitions between sync (sample <= treshold) and
+// non-sync levels. Samples are compared 32 at a time into a level bitmask,
+// which is turned into a transition bitmask, and edges are then popped from
+// it with count trailing zeros, so the caller only runs once per edge.
+typedef struct {
+	const short *samples;
+	int length;
+	int treshold;
+	int base; // offset of the current 32 sample block
+	unsigned int edges; // transitions not yet returned in the current block
+	int level; // 1 if the last sample of the current block is sync
+	int is_sync; // level after the edge last returned by slicer_next
+} sync_slicer;
+
+// Start slicing samples[offset..length), is_sync is the level assumed before offset
+void slicer_init(sync_slicer *slicer, const short *samples, int offset, int length, int treshold, int is_sync);
+
+// Returns the offset of the next sample whose level differs from the previous
+// one and updates slicer->is_sync to the new level, or returns length when
+// there are no more edges
+int slicer_next(sync_slicer *slicer);
+
+// Select the bitmask kernel: simd = 0 forces the portable one. Called
+// automatically with simd = 1 on first use. Returns the kernel name.
+const char * slicer_setup(int simd);
+
+#endif // SYNC_H
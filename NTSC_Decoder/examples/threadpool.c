@@ -0,0 +1,164 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Small work-stealing thread pool for decoding scanlines in parallel. */
+
+#include "windows.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "threadpool.h"
+
+// Each worker owns a range of indices and takes them from the front with an
+// atomic increment. Thieves use the very same counter, so nothing is ever
+// handed out twice. Padded to a cache line to avoid false sharing.
+typedef struct {
+	volatile LONG next;
+	LONG end;
+	HANDLE start; // signaled when there's work for the thread
+	HANDLE thread;
+	threadpool *pool;
+	char padding[64 - 2 * sizeof(LONG) - 2 * sizeof(HANDLE) - sizeof(threadpool *)];
+} pool_worker;
+
+struct threadpool {
+	int threads;
+	pool_worker *workers;
+	HANDLE done; // signaled when the last worker finishes
+	volatile LONG active;
+	volatile LONG quit;
+	pool_task task;
+	void *context;
+};
+
+static int work_range(pool_worker *worker) {
+	pool_task task = worker->pool->task;
+	void *context = worker->pool->context;
+	LONG index;
+	int count = 0;
+
+	while((index = InterlockedIncrement(&worker->next) - 1) < worker->end) {
+		task(context, index);
+		count++;
+	}
+
+	return count;
+}
+
+static void work(threadpool *pool, int id) {
+	int victim;
+
+	work_range(&pool->workers[id]);
+
+	// own range done, help the others starting from the next thread
+	for(victim = (id + 1) % pool->threads; victim != id; victim = (victim + 1) % pool->threads)
+		work_range(&pool->workers[victim]);
+
+	if(InterlockedDecrement(&pool->active) == 0)
+		SetEvent(pool->done);
+}
+
+static DWORD WINAPI worker_thread(LPVOID param) {
+	pool_worker *worker = (pool_worker *)param;
+	threadpool *pool = worker->pool;
+
+	for(;;) {
+		WaitForSingleObject(worker->start, INFINITE);
+
+		if(pool->quit)
+			break;
+
+		work(pool, (int)(worker - pool->workers));
+	}
+
+	return 0;
+}
+
+threadpool * pool_create(int threads) {
+	SYSTEM_INFO info;
+	threadpool *pool;
+	int i;
+
+	if(threads <= 0) {
+		GetSystemInfo(&info);
+		threads = info.dwNumberOfProcessors;
+	}
+
+	pool = (threadpool *)calloc(1, sizeof(threadpool));
+	if(pool == NULL)
+		return NULL;
+
+	pool->workers = (pool_worker *)calloc(threads, sizeof(pool_worker));
+	pool->done = CreateEventA(NULL, FALSE, FALSE, NULL);
+	if(pool->workers == NULL || pool->done == NULL) {
+		printf("Could not allocate thread pool\n");
+		free(pool->workers);
+		free(pool);
+		return NULL;
+	}
+
+	pool->threads = threads;
+
+	// worker 0 is the thread calling pool_run
+	for(i = 0; i < threads; i++) {
+		pool->workers[i].pool = pool;
+
+		if(i == 0)
+			continue;
+
+		pool->workers[i].start = CreateEventA(NULL, FALSE, FALSE, NULL);
+		pool->workers[i].thread = CreateThread(NULL, 0, worker_thread, &pool->workers[i], 0, NULL);
+
+		if(pool->workers[i].thread == NULL) {
+			printf("Could only start %d decoding threads\n", i);
+			CloseHandle(pool->workers[i].start);
+			pool->threads = i;
+			break;
+		}
+	}
+
+	return pool;
+}
+
+void pool_run(threadpool *pool, pool_task task, void *context, int count) {
+	int i;
+
+	pool->task = task;
+	pool->context = context;
+	pool->active = pool->threads;
+
+	for(i = 0; i < pool->threads; i++) {
+		pool->workers[i].next = count * i / pool->threads;
+		pool->workers[i].end = count * (i + 1) / pool->threads;
+	}
+
+	MemoryBarrier();
+
+	for(i = 1; i < pool->threads; i++)
+		SetEvent(pool->workers[i].start);
+
+	work(pool, 0);
+
+	if(pool->threads > 1)
+		WaitForSingleObject(pool->done, INFINITE);
+}
+
+int pool_threads(threadpool *pool) {
+	return pool->threads;
+}
+
+void pool_destroy(threadpool *pool) {
+	int i;
+
+	pool->quit = 1;
+	MemoryBarrier();
+
+	for(i = 1; i < pool->threads; i++) {
+		SetEvent(pool->workers[i].start);
+		WaitForSingleObject(pool->workers[i].thread, INFINITE);
+		CloseHandle(pool->workers[i].thread);
+		CloseHandle(pool->workers[i].start);
+	}
+
+	CloseHandle(pool->done);
+	free(pool->workers);
+	free(pool);
+}
@@ -0,0 +1,25 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Small work-stealing thread pool for decoding scanlines in parallel. */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// Called once for every index in 0..count-1 of pool_run
+typedef void (*pool_task)(void *context, int index);
+
+typedef struct threadpool threadpool;
+
+// Create a pool of the given amount of threads (including the caller),
+// 0 or less for one thread per processor. Returns NULL on failure.
+threadpool * pool_create(int threads);
+
+// Run task for indices 0..count-1 and return when all of them are done.
+// Indices are split evenly between threads, threads that run out of work
+// steal the remaining indices of the others.
+void pool_run(threadpool *pool, pool_task task, void *context, int count);
+
+int pool_threads(threadpool *pool);
+
+void pool_destroy(threadpool *pool);
+
+#endif // THREADPOOL_H
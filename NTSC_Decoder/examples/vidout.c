@@ -0,0 +1,224 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Streaming YUV4MPEG2 or raw video output of decoded frames. */
+
+#include "windows.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <io.h>
+
+#include "vidout.h"
+
+#define FRAME_HEADER "FRAME\n"
+
+// Full range BT.601 YCbCr from the 0xRRGGBB surface pixels into three planes
+static void encode_y4m(SDL_Surface *frame, unsigned char *dest) {
+	unsigned char *Y = dest, *Cb = Y + frame->w * frame->h, *Cr = Cb + frame->w * frame->h;
+	Uint32 *pixels;
+	int x, y, r, g, b;
+
+	for(y = 0; y < frame->h; y++) {
+		pixels = (Uint32 *)((char *)frame->pixels + y * frame->pitch);
+
+		for(x = 0; x < frame->w; x++) {
+			r = (pixels[x] >> 16) & 0xFF;
+			g = (pixels[x] >> 8) & 0xFF;
+			b = pixels[x] & 0xFF;
+
+			*Y++ = (unsigned char)((77 * r + 150 * g + 29 * b + 128) >> 8);
+			*Cb++ = (unsigned char)((-43 * r - 85 * g + 128 * b + 32896) >> 8);
+			*Cr++ = (unsigned char)((128 * r - 107 * g - 21 * b + 32896) >> 8);
+		}
+	}
+}
+
+// Pipes may take less than asked at a time
+static int write_all(HANDLE file, const char *data, long length) {
+	DWORD put;
+
+	while(length > 0) {
+		if(!WriteFile(file, data, length, &put, NULL) || put == 0)
+			return -1;
+
+		data += put;
+		length -= put;
+	}
+
+	return 0;
+}
+
+static DWORD WINAPI write_frames(LPVOID param) {
+	vidout *out = (vidout *)param;
+	SDL_Surface *frame;
+	char *data;
+	long length;
+	int slot, y;
+
+	for(;;) {
+		if((slot = ring_read_slot(&out->ring, 100)) < 0) {
+			if(out->quit)
+				break; // everything submitted has been written
+			continue;
+		}
+
+		frame = out->frame[slot];
+		data = out->buffer[slot];
+		length = out->frame_bytes;
+
+		if(out->format == VIDOUT_Y4M) {
+			encode_y4m(frame, (unsigned char *)data + strlen(FRAME_HEADER));
+		} else if(frame->pitch == out->width * 4) {
+			data = (char *)frame->pixels; // already in the right layout
+		} else {
+			for(y = 0; y < out->height; y++)
+				memcpy(data + y * out->width * 4, (char *)frame->pixels + y * frame->pitch, out->width * 4);
+		}
+
+		if(!out->failed) {
+			if(write_all(out->file, data, length)) {
+				printf("Video output closed after %ld frames\n", out->written);
+				InterlockedExchange(&out->failed, 1);
+			} else
+				InterlockedIncrement(&out->written);
+		}
+
+		ring_release(&out->ring);
+	}
+
+	return 0;
+}
+
+int vidout_open(vidout *out, const char *path, int format, int width, int height, int interlaced) {
+	char header[128];
+	int i;
+
+	memset(out, 0, sizeof(vidout));
+
+	out->format = format;
+	out->width = width;
+	out->height = height;
+	out->slot = -1;
+
+	if(!strcmp(path, "-")) {
+		// keep our own handle to the real stdout and send printf to stderr
+		fflush(stdout);
+		if(!DuplicateHandle(GetCurrentProcess(), GetStdHandle(STD_OUTPUT_HANDLE), GetCurrentProcess(),
+				&out->file, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+			fprintf(stderr, "Could not get stdout for video output\n");
+			return -1;
+		}
+		_dup2(_fileno(stderr), _fileno(stdout));
+	} else if(!strncmp(path, "\\\\.\\pipe\\", 9)) {
+		// the encoder opens the pipe like a file, e.g. ffmpeg -i \\.\pipe\ntsc
+		out->file = CreateNamedPipeA(path, PIPE_ACCESS_OUTBOUND, PIPE_TYPE_BYTE | PIPE_WAIT,
+			1, 1 << 20, 0, 0, NULL);
+		if(out->file == INVALID_HANDLE_VALUE) {
+			printf("Could not create pipe %s\n", path);
+			out->file = NULL;
+			return -1;
+		}
+
+		printf("Waiting for a reader on %s\n", path);
+		if(!ConnectNamedPipe(out->file, NULL) && GetLastError() != ERROR_PIPE_CONNECTED) {
+			printf("Nobody connected to %s\n", path);
+			vidout_close(out);
+			return -1;
+		}
+	} else {
+		out->file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+			CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if(out->file == INVALID_HANDLE_VALUE) {
+			printf("Could not create %s\n", path);
+			out->file = NULL;
+			return -1;
+		}
+	}
+
+	if(format == VIDOUT_Y4M) {
+		// interlaced top field first: field 0 goes to the even lines
+		sprintf(header, "YUV4MPEG2 W%d H%d F30000:1001 %s A0:0 C444 XCOLORRANGE=FULL\n",
+			width, height, interlaced ? "It" : "Ip");
+		out->frame_bytes = strlen(FRAME_HEADER) + 3L * width * height;
+	} else {
+		header[0] = 0;
+		out->frame_bytes = 4L * width * height;
+	}
+
+	if(ring_init(&out->ring, VIDOUT_FRAMES)) {
+		vidout_close(out);
+		return -1;
+	}
+
+	for(i = 0; i < VIDOUT_FRAMES; i++) {
+		out->frame[i] = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32, 0xFF0000, 0xFF00, 0xFF, 0);
+		out->buffer[i] = (char *)malloc(out->frame_bytes);
+
+		if(out->frame[i] == NULL || out->buffer[i] == NULL) {
+			printf("Could not allocate video output frames\n");
+			vidout_close(out);
+			return -1;
+		}
+
+		memcpy(out->buffer[i], FRAME_HEADER, strlen(FRAME_HEADER));
+	}
+
+	if(header[0] && write_all(out->file, header, strlen(header))) {
+		printf("Could not write video header\n");
+		vidout_close(out);
+		return -1;
+	}
+
+	out->writer = CreateThread(NULL, 0, write_frames, out, 0, NULL);
+	if(out->writer == NULL) {
+		printf("Could not start video writer\n");
+		vidout_close(out);
+		return -1;
+	}
+
+	return 0;
+}
+
+SDL_Surface * vidout_frame(vidout *out, DWORD timeout) {
+	if(out->failed)
+		return NULL;
+
+	if(out->slot < 0)
+		out->slot = ring_write_slot(&out->ring, timeout);
+
+	return out->slot < 0 ? NULL : out->frame[out->slot];
+}
+
+void vidout_submit(vidout *out) {
+	if(out->slot < 0)
+		return;
+
+	ring_commit(&out->ring);
+	out->slot = -1;
+}
+
+long vidout_close(vidout *out) {
+	long written;
+	int i;
+
+	if(out->writer != NULL) {
+		InterlockedExchange(&out->quit, 1);
+		WaitForSingleObject(out->writer, INFINITE);
+		CloseHandle(out->writer);
+	}
+
+	if(out->file != NULL)
+		CloseHandle(out->file);
+
+	for(i = 0; i < VIDOUT_FRAMES; i++) {
+		if(out->frame[i] != NULL)
+			SDL_FreeSurface(out->frame[i]);
+		free(out->buffer[i]);
+	}
+
+	ring_free(&out->ring);
+
+	written = out->written;
+	memset(out, 0, sizeof(vidout));
+
+	return written;
+}
@@ -0,0 +1,50 @@
+/** Licenced under GNU GPL, see Licence.txt for details
+ * Streaming YUV4MPEG2 or raw video output of decoded frames. */
+
+#ifndef VIDOUT_H
+#define VIDOUT_H
+
+#include "windows.h"
+#include "SDL/SDL.h"
+#include "ring.h"
+
+#define VIDOUT_Y4M 0 // 4:4:4 YCbCr, e.g. ffmpeg -i - or x264 --demuxer y4m -
+#define VIDOUT_RAW 1 // surface pixels as is, ffmpeg -f rawvideo -pix_fmt bgr0 -s WxH -i -
+
+#define VIDOUT_FRAMES 2 // one being drawn while the other is written
+
+// Frames are drawn straight into one of the surfaces and handed to a writer
+// thread, which encodes the whole frame into one buffer and writes it with a
+// single WriteFile, so a slow encoder never stalls decoding in the middle of
+// a frame and the pipe sees few, large writes.
+typedef struct {
+	HANDLE file, writer;
+	int format, width, height;
+	spsc_ring ring; // drawing -> writer
+	SDL_Surface *frame[VIDOUT_FRAMES];
+	char *buffer[VIDOUT_FRAMES]; // encoded frames with their FRAME header
+	long frame_bytes;
+	int slot; // frame being drawn, -1 if none
+	volatile LONG quit;
+	volatile LONG written, failed; // frames written, set when the reader went away
+} vidout;
+
+// Open path for writing, "-" for stdout or \\.\pipe\name for a named pipe,
+// and write the stream header. With stdout the decoder's own messages move
+// to stderr. Frames are marked interlaced unless they have been
+// deinterlaced. Returns 0 on success and -1 on failure.
+int vidout_open(vidout *out, const char *path, int format, int width, int height, int interlaced);
+
+// Surface to draw the next frame into, waiting up to timeout ms for the
+// writer to free one. Returns the same surface until vidout_submit, or NULL
+// if the writer is still busy or has failed.
+SDL_Surface * vidout_frame(vidout *out, DWORD timeout);
+
+// Hand the frame from vidout_frame to the writer
+void vidout_submit(vidout *out);
+
+// Write out the submitted frames and close the stream. Returns the amount
+// of frames written.
+long vidout_close(vidout *out);
+
+#endif // VIDOUT_H
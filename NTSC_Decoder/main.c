@@ -38,12 +38,16 @@
 #include "utils/uartstdio.h"
 #include "utils/ustdlib.h"
 
+#include "acquire.h"
+
 #define LED_OFF   0x00
 #define RED_LED   GPIO_PIN_1
 #define BLUE_LED  GPIO_PIN_2
 #define GREEN_LED GPIO_PIN_3
 #define RGB_LED (RED_LED|BLUE_LED|GREEN_LED)
 
+#define SAMPLE_RATE 1000000 // video samples per second
+
 // Defined in driverlib/pin_map.h but not working right?
 #define GPIO_PA0_U0RX           0x00000001
 #define GPIO_PA1_U0TX           0x00000401
@@ -134,7 +138,7 @@ void (* const g_pfnVectors[])(void) =
 		IntDefaultHandler,// PWM Generator 1
 		IntDefaultHandler,// PWM Generator 2
 		IntDefaultHandler,// Quadrature Encoder 0
-		IntDefaultHandler,//ADC0_Seq0_ISR,// ADC0 Sequence 0
+		ADC0Seq0IntHandler,// ADC0 Sequence 0
 		IntDefaultHandler,//ADC0_Seq1_ISR,// ADC0 Sequence 1
 		IntDefaultHandler,//ADC0_Seq2_ISR,// ADC0 Sequence 2
 		IntDefaultHandler,//ADC0_Seq3_ISR,// ADC0 Sequence 3
@@ -265,6 +269,7 @@ static unsigned long ulADC0Value[4];
 static unsigned long ulTempAvg;
 static unsigned long ulTempValueC;
 static unsigned long ulTempValueF;
+static unsigned long ulNextBlock;
 
 static void ResetISR(void) {
 	//
@@ -334,8 +339,6 @@ static void getTemperature() {
 	ROM_ADCIntClear(ADC0_BASE, ADC_INT_SS0);
 	ROM_ADCProcessorTrigger(ADC0_BASE, ADC_INT_SS0);
 
-	short_flash(RED_LED);
-
 	// Wait for the ADC to cause an interrupt
 	while (!ROM_ADCIntStatus(ADC0_BASE, ADC_INT_SS0, false)) {
 	}
@@ -350,8 +353,14 @@ static void getTemperature() {
 	ulTempValueC = (1475 - ((2475 * ulTempAvg)) / 4096) / 10;
 	// TempF = ((TempC * 9) + 160) / 5;
 	ulTempValueF = ((ulTempValueC * 9) + 160) / 5;
+}
 
-	short_flash(BLUE_LED);
+// Light the red LED while blocks are being dropped
+static void blockReceived(const unsigned short *samples, int count,
+		unsigned long sequence) {
+	ROM_GPIOPinWrite(GPIO_PORTF_BASE, RED_LED,
+			sequence != ulNextBlock ? RED_LED : LED_OFF);
+	ulNextBlock = sequence + 1;
 }
 
 void initLEDs() {
@@ -509,12 +518,8 @@ int main(void) {
 	initLEDs();
 	initUART();
 
-	initTimer(100);
-
 	ROM_IntMasterEnable();
 
-	enableTimer();
-
 	printf((unsigned char*) "Hello world!\n");
 
 	initADC();
@@ -525,8 +530,13 @@ int main(void) {
 
 	long_beep_flash(GREEN_LED, 3);
 
-	// Start sampling the temperature sensor using the ADC
+	getTemperature();
+
+	// Timer0 paces the ADC from here on, the blocks come in through uDMA
+	acq_init(SAMPLE_RATE, ADC_CTL_CH0, blockReceived);
+	acq_start();
+
 	while (1) {
-		getTemperature();
+		acq_poll();
 	}
 }